@@ -0,0 +1,61 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * In-tree BLAKE3 (hash mode, 32-byte output): a portable compression function, and AVX2 and
+ * AVX-512 kernels that compress 8 or 16 chunks of 1 KiB side by side.
+ *
+ * BLAKE3 is a binary tree of 1 KiB chunks: a subtree of a power of two chunks starting at a
+ * multiple of its size is hashed independently (blake3_init_subtree, blake3_final_cv), and the
+ * chaining values of consecutive such subtrees are combined into the digest by blake3_root().
+ */
+
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54 // 2^54 chunks cover any 64-bit length
+
+typedef struct
+{
+    uint32_t cv[8];          // chaining value of the current chunk
+    uint64_t chunk_counter;  // index of the current chunk in the whole input
+    uint8_t buf[64];         // pending block of the current chunk
+    uint8_t buflen;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8]; // chaining values of the completed subtrees
+} blake3_hasher_t;
+
+/**
+ * Selects the compression kernel from the CPU features (AVX-512F, AVX2 or portable).
+ */
+void blake3_select(void);
+
+/**
+ * Returns the name of the selected kernel ("avx512", "avx2" or "portable").
+ */
+const char *blake3_kernel(void);
+
+void blake3_init(blake3_hasher_t *h);
+void blake3_update(blake3_hasher_t *h, const uint8_t *data, size_t len);
+void blake3_final(blake3_hasher_t *h, uint8_t out[32]);
+
+/**
+ * Starts a subtree whose first chunk is chunk_counter in the whole input.
+ */
+void blake3_init_subtree(blake3_hasher_t *h, uint64_t chunk_counter);
+
+/**
+ * Ends a subtree: writes its chaining value (32 bytes, little-endian words), not a digest.
+ * The subtree must not be the whole input.
+ */
+void blake3_final_cv(blake3_hasher_t *h, uint8_t cv[32]);
+
+/**
+ * Computes the digest of an input made of n >= 2 subtrees of the same power of two chunks
+ * (the last one may be shorter) from their chaining values.
+ */
+void blake3_root(const uint8_t (*cvs)[32], size_t n, uint8_t out[32]);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "cache_store.h"
+
+// Cache counters reported at shutdown
+typedef struct
+{
+    long entries;    // entries in the table
+    size_t capacity; // slots in the table
+    size_t bytes;    // memory used by the slots
+    size_t budget;   // memory budget
+    long evictions;  // entries evicted to stay within the budget
+    long stale;      // entries dropped because their file changed
+} cache_stats_t;
+
+/**
+ * Fills the file identity from the result of stat().
+ */
+void file_id_from_stat(file_id_t *id, const struct stat *st);
+
+/**
+ * Returns 1 if both identities designate the same version of the same inode.
+ */
+int file_id_equal(const file_id_t *a, const file_id_t *b);
+
+/**
+ * Creates the cache table with a memory budget in bytes.
+ */
+void cache_init(size_t budget);
+
+/**
+ * Searches the cache for the digest of the inode of id and copies it into sha256. Lock-free.
+ * Returns 1 on a cache hit, 0 on a miss (also if the entry is of another version of the inode).
+ */
+int cache_lookup(const file_id_t *id, unsigned int kind, uint8_t *sha256);
+
+/**
+ * Inserts or replaces the digest of the inode of id, evicting entries if the budget is exceeded.
+ * Returns 0 on success, -1 if the entry could not be stored.
+ */
+int cache_put(const file_id_t *id, unsigned int kind, const uint8_t *sha256);
+
+/**
+ * Removes the entry of the inode of id if it holds the digest of another version of the file.
+ */
+void cache_invalidate(const file_id_t *id, unsigned int kind);
+
+/**
+ * Passes every cache entry to emit (used to compact the cache file).
+ */
+void cache_walk(cache_store_entry_fn emit);
+
+/**
+ * Copies the cache counters into stats.
+ */
+void cache_get_stats(cache_stats_t *stats);
+
+/**
+ * Frees all memory allocated for the cache. Called during server termination.
+ */
+void cache_cleanup(void);
+
+#endif
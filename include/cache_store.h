@@ -0,0 +1,58 @@
+#ifndef CACHE_STORE_H
+#define CACHE_STORE_H
+
+#include <stdint.h>
+
+/*
+ * Persistent digest cache: an append-only log of checksummed records.
+ *
+ * File layout:
+ *   header: "SHA256LG" magic (8 bytes), version (u32), reserved (u32)
+ *   record: crc32 (u32) of the rest of the record, payload length (u32), payload
+ *   payload: dev (u64), ino (u64), size (u64), mtime_ns (i64), ctime_ns (i64), kind (u32), sha256 (32 bytes)
+ *
+ * All integers are little-endian. A record that is incomplete or fails its checksum
+ * (torn write after a crash) ends the log: the file is truncated there on load.
+ * Later records for the same key override earlier ones.
+ */
+
+// Identity of a file version: the inode, validated by size, mtime and ctime (nanoseconds)
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+} file_id_t;
+
+// Callback receiving one cache entry (on load or during compaction)
+typedef void (*cache_store_entry_fn)(const file_id_t *id, unsigned int kind, const uint8_t *sha256);
+
+// Walks every live cache entry, passing it to emit
+typedef void (*cache_store_walk_fn)(cache_store_entry_fn emit);
+
+/**
+ * Opens (or creates) the cache file and replays its valid records through load. An existing
+ * non-empty file that does not start with the cache file magic is left untouched.
+ * Returns the number of records loaded, or -1 if the file can't be used (persistence stays disabled).
+ */
+long cache_store_open(const char *path, cache_store_entry_fn load);
+
+/**
+ * Appends an entry to the cache file. Thread-safe, no-op if the store is not open.
+ */
+void cache_store_append(const file_id_t *id, unsigned int kind, const uint8_t *sha256);
+
+/**
+ * Rewrites the cache file with only the entries produced by walk, if the log holds at least
+ * twice as many records as there are live entries. The new file replaces the old one atomically.
+ */
+void cache_store_compact(long live_entries, cache_store_walk_fn walk);
+
+/**
+ * Flushes the cache file to disk and closes it.
+ */
+void cache_store_close(void);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache_store.h"
+#include "sha256_native.h"
+
+/*
+ * Content-defined chunk lists (REQ_CHUNKS), FastCDC with normalized chunking:
+ * - a gear hash fp = (fp << 1) + gear[byte] is rolled over each chunk, starting after its first
+ *   min bytes; the 256 gear values are generated from a fixed seed (splitmix64), so boundaries
+ *   do not depend on the server build
+ * - a chunk ends after the byte where the top bits of fp are all zero: log2(avg) + 2 bits before
+ *   avg bytes, log2(avg) - 2 bits after, at max bytes at the latest, and at the end of the file
+ * - min = avg / 4, max = avg * 8; an empty file has no chunk
+ * - every chunk has its SHA-256, and the SHA-256 of the whole file comes from the same read
+ *
+ * Chunk lists are kept per inode. A request for the version that was chunked is answered from
+ * the table; with resume set, a file that has grown and has the append-only attribute is
+ * rechunked from the start of its last chunk (the only boundary set by the end of the file), the
+ * earlier chunks are kept. The prefix is also checked with the midstate fingerprint (see
+ * midstate.h): resume has the same conditions as resumable hashing and is used for the same
+ * files (-I).
+ */
+
+#define CDC_AVG_DEFAULT (8 * 1024)
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t length;
+    uint8_t sha256[32];
+} cdc_chunk_t;
+
+// Chunk list of a file version
+typedef struct
+{
+    file_id_t id;             // version of the file that was chunked
+    uint8_t digest[32];       // SHA-256 of the whole file
+    size_t n;                 // number of chunks
+    cdc_chunk_t *chunks;      // malloc'ed, freed by cdc_list_free() or taken by cdc_put()
+    int cached;               // 1 if the list was found in the table
+    uint64_t resume_at;       // offset of the last chunk if the list can be resumed, else 0
+    sha256_state_t tail;      // whole-file SHA-256 state at resume_at
+    uint8_t fingerprint[32];  // fingerprint of the bytes before resume_at
+} cdc_list_t;
+
+// Counters reported at shutdown
+typedef struct
+{
+    long computed;         // lists computed (resumed ones included)
+    long hits;             // lists answered from the table
+    long resumed;          // lists resumed from the last chunk of an older version
+    long stored;           // lists stored in the table
+    long dropped;          // lists not stored: larger than the table budget
+    uint64_t bytes_reused; // bytes not read thanks to the resumed lists
+    uint64_t chunks;       // chunks computed
+} cdc_stats_t;
+
+// Average chunk size in bytes (power of two), set before cdc_init()
+extern size_t cdc_avg_size;
+
+/**
+ * Creates the chunk list table (direct-mapped, slots rounded up to a power of two) holding at
+ * most budget bytes of chunks, and derives the chunk size limits and masks from cdc_avg_size.
+ */
+void cdc_init(size_t slots, size_t budget);
+
+/**
+ * Fills list with the chunk list of the file of identity id: from the table if this version
+ * was chunked already, otherwise by reading it once (from the resume point of an older version
+ * if resume is set and its prefix is unchanged).
+ * Returns 0 on success or OPEN_FILE_E / READ_FILE_E / CLOSE_FILE_E like read_file().
+ */
+short cdc_digest(const char *filename, const file_id_t *id, int resume, cdc_list_t *list);
+
+/**
+ * Stores a computed list in the table, replacing the one of the same slot. The table takes the
+ * chunks: list->chunks is NULL afterwards. Lists over the budget are dropped.
+ */
+void cdc_put(cdc_list_t *list);
+
+/**
+ * Frees the chunks of a list.
+ */
+void cdc_list_free(cdc_list_t *list);
+
+/**
+ * Copies the counters into stats.
+ */
+void cdc_get_stats(cdc_stats_t *stats);
+
+/**
+ * Frees the chunk list table.
+ */
+void cdc_cleanup(void);
+
+#endif
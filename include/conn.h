@@ -0,0 +1,69 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Socket transport: an AF_UNIX SOCK_SEQPACKET listener next to the server FIFO. Every packet is
+ * one request message (v1 or v2) and every response is sent back as one packet on the same
+ * connection, so clients need no FIFO of their own.
+ *
+ * A connection is reference counted: the master holds one reference while it reads from it and
+ * every queued client node holds one until its response is sent. The descriptor is closed with
+ * the last reference, so a worker never writes on a descriptor reused by another connection.
+ */
+
+typedef struct conn conn_t;
+
+// Connection counters reported at shutdown
+typedef struct
+{
+    long accepted; // connections accepted
+    long open;     // connections not yet closed
+} conn_stats_t;
+
+/**
+ * Creates the listening socket at path, replacing a stale socket file.
+ * Returns the descriptor, or -1 on failure.
+ */
+int conn_listen(const char *path);
+
+/**
+ * Accepts a connection on the listening socket. The caller owns the first reference.
+ * Returns NULL on failure.
+ */
+conn_t *conn_accept(int listen_fd);
+
+/**
+ * Returns the descriptor of the connection (for epoll).
+ */
+int conn_fd(const conn_t *conn);
+
+/**
+ * Receives one request packet into buf. Returns its length, 0 if the client closed
+ * the connection, -1 on error.
+ */
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len);
+
+/**
+ * Sends one response packet. Returns 0 on success, -1 on failure.
+ */
+int conn_send(conn_t *conn, const void *msg, size_t len);
+
+/**
+ * Takes a reference to the connection. conn may be NULL.
+ */
+void conn_hold(conn_t *conn);
+
+/**
+ * Drops a reference; the last one closes the connection. conn may be NULL.
+ */
+void conn_release(conn_t *conn);
+
+/**
+ * Copies the connection counters into stats.
+ */
+void conn_get_stats(conn_stats_t *stats);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef DIGEST_ENGINE_H
+#define DIGEST_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#include "sha256_native.h"
+#include "blake3.h"
+
+struct digest_engine;
+
+// Per-computation state, the member used depends on the engine
+typedef struct
+{
+    const struct digest_engine *engine; // Engine that initialized the context
+    EVP_MD_CTX *evp;       // openssl-evp engines
+    sha256_state_t native; // native engine
+    blake3_hasher_t blake3; // blake3 engine
+} digest_ctx_t;
+
+// A digest implementation
+typedef struct digest_engine
+{
+    const char *name;
+    size_t digest_len;
+    int (*init)(digest_ctx_t *ctx); // returns 0 on success, sets ctx->engine
+    void (*update)(digest_ctx_t *ctx, const uint8_t *data, size_t len);
+    void (*final)(digest_ctx_t *ctx, uint8_t *out);
+} digest_engine_t;
+
+// Engine used for every SHA-256 computation, set by digest_engine_setup()
+extern const digest_engine_t *sha256_engine;
+
+/**
+ * Returns the engine of a REQ_ALG_* algorithm, or NULL if it is unknown or not available.
+ * SHA-256 is sha256_engine, SHA-512/256 comes from OpenSSL EVP, BLAKE3 is the in-tree kernel.
+ */
+const digest_engine_t *digest_engine_for(unsigned int alg);
+
+/**
+ * Chooses the SHA-256 engine: "evp" (OpenSSL EVP), "native" (in-tree kernel with CPU dispatch),
+ * "scalar" (in-tree portable kernel) or NULL for automatic selection (EVP, native if EVP is unusable).
+ * Also sets up the engines of the other algorithms; one that fails its self-test is not available.
+ * Returns 0 on success, -1 if the name is unknown or the SHA-256 engine fails its self-test.
+ */
+int digest_engine_setup(const char *name);
+
+/**
+ * Writes a human readable description of the selected engines and CPU kernels into buf.
+ */
+void digest_engine_describe(char *buf, size_t size);
+
+/**
+ * Releases the per-thread EVP context. Called by a worker thread before it terminates.
+ */
+void digest_engine_thread_cleanup(void);
+
+#endif
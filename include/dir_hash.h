@@ -0,0 +1,40 @@
+#ifndef DIR_HASH_H
+#define DIR_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "digest_engine.h"
+
+/*
+ * Directory digest (REQ_DIRECTORY):
+ * - the tree under the directory is walked without following symbolic links; only regular
+ *   files are listed, other entries (links, devices, sockets, FIFOs) are skipped
+ * - every file is hashed with the digest kind of the request (plain or tree SHA-256, another algorithm)
+ * - the files are sorted by their path relative to the directory, compared byte by byte
+ * - digest = hash with the algorithm of the request of, for every file in that order:
+ *   relative path, 0x00, 32-byte file digest
+ * - an empty tree has the digest of the empty message
+ */
+
+// A file of the directory and its digest
+typedef struct
+{
+    const char *path;      // Relative to the directory, '/' separated
+    const uint8_t *digest; // 32 bytes
+} dir_hash_entry_t;
+
+/**
+ * Walks the tree under root with openat() and getdents64(), calling visit for every regular file
+ * with its path relative to root. A nonzero return value of visit stops the walk.
+ * Returns 0 on success, NOT_DIR_E if root is not a directory, OPEN_FILE_E if it cannot be opened,
+ * WALK_DIR_E if a subdirectory cannot be listed, or the value returned by visit.
+ */
+short dir_walk(const char *root, short (*visit)(const char *relpath, void *arg), void *arg);
+
+/**
+ * Computes the directory digest of n files with engine. The entries array is sorted in place.
+ */
+void dir_hash_root(const digest_engine_t *engine, dir_hash_entry_t *entries, size_t n, uint8_t root[32]);
+
+#endif
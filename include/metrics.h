@@ -0,0 +1,97 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Server metrics: counters and per-stage latency histograms, sharded by thread.
+ *
+ * Every thread updates a shard of its own (cache-line aligned, picked on its first update), so
+ * counting a hit or a reply never takes a lock and never writes a line shared with another core.
+ * Readers sum the shards; totals may be a few updates behind while the server runs.
+ *
+ * Histograms are log-linear over nanoseconds: everything under 1024 ns in the first bucket, then
+ * 4 buckets per power of two up to 2^37 ns (about 137 s), then an overflow bucket. The error of a
+ * quantile is at most a quarter of its power of two.
+ */
+
+typedef enum
+{
+    METRIC_CLIENTS_SERVED, // responses delivered
+    METRIC_CACHE_HITS,     // digests found in the cache (intake and workers)
+    METRIC_CACHE_MISSES,   // lookups of the workers that missed
+    METRIC_INTAKE_HITS,    // cache hits answered without a worker
+    METRIC_HASHED,         // digests computed
+    METRIC_REPLY_ERRORS,   // responses that could not be delivered
+    METRIC_COUNTERS
+} metric_counter_t;
+
+typedef enum
+{
+    STAGE_STAT,         // stat() of a requested path
+    STAGE_QUEUE_WAIT,   // time in a run queue
+    STAGE_CACHE_LOOKUP, // cache lookup
+    STAGE_HASH,         // digest computation (read included)
+    STAGE_REPLY,        // delivery of one response
+    METRIC_STAGES
+} metric_stage_t;
+
+#define METRICS_SHARDS 64
+#define METRICS_MIN_SHIFT 10  // first bucket: below 2^10 ns
+#define METRICS_MAX_SHIFT 36  // last finite bucket ends at 2^37 ns
+#define METRICS_SUB_BUCKETS 4 // linear buckets per power of two
+#define METRICS_BUCKETS (2 + (METRICS_MAX_SHIFT - METRICS_MIN_SHIFT + 1) * METRICS_SUB_BUCKETS)
+
+/**
+ * Returns the monotonic clock in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Adds n to a counter.
+ */
+void metrics_add(metric_counter_t counter, uint64_t n);
+
+/**
+ * Records a latency of a stage, in nanoseconds.
+ */
+void metrics_observe(metric_stage_t stage, uint64_t ns);
+
+/**
+ * Records the time elapsed since start (from metrics_now()) for a stage.
+ */
+void metrics_since(metric_stage_t stage, uint64_t start);
+
+/**
+ * Returns the sum of a counter over the shards.
+ */
+uint64_t metrics_counter(metric_counter_t counter);
+
+/**
+ * Returns the upper bound in nanoseconds of the bucket holding quantile q (0 < q <= 1) of a
+ * stage, 0 if nothing was recorded.
+ */
+uint64_t metrics_quantile(metric_stage_t stage, double q);
+
+/**
+ * Returns the number of latencies recorded for a stage.
+ */
+uint64_t metrics_count(metric_stage_t stage);
+
+/**
+ * Returns the label of a stage ("stat", "queue_wait", "cache_lookup", "hash" or "reply").
+ */
+const char *metrics_stage_name(metric_stage_t stage);
+
+/**
+ * Writes the counters and histograms in the Prometheus text exposition format.
+ */
+void metrics_write(FILE *out);
+
+/**
+ * Writes one gauge in the Prometheus text exposition format.
+ */
+void metrics_write_gauge(FILE *out, const char *name, const char *help, double value);
+
+#endif
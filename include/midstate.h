@@ -0,0 +1,89 @@
+#ifndef MIDSTATE_H
+#define MIDSTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache_store.h"
+
+/*
+ * Resumable SHA-256 of append-only files (plain SHA-256 kind only).
+ *
+ * Only files declared append-only are resumed: the append-only attribute (chattr +a, FS_APPEND_FL)
+ * must be set when the digest is computed and when it is resumed. While it is set, the kernel
+ * refuses any write that is not an append, and truncation, so the hashed prefix cannot change.
+ *
+ * After hashing a large file the server keeps the SHA-256 chaining value of its whole 64-byte
+ * blocks (the midstate) with the number of bytes it covers and the size of the file, keyed by
+ * inode. When the same inode is requested again with a larger size, the covered prefix is
+ * checked against a fingerprint (SHA-256 of 16 samples of 4 KiB spread over the prefix, its
+ * first and last 4 KiB included) and, if it matches, only the bytes past the covered length are
+ * read and hashed. The fingerprint catches an attribute removed, the file edited and the
+ * attribute set again, unless the edit falls between the samples. A new version of the same size
+ * or smaller is hashed from the start.
+ */
+
+// Saved state of a file: the digest of its first covered bytes is the final of h
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t covered;        // multiple of 64, 0 for an empty slot
+    uint64_t size;           // size of the file that was hashed
+    uint32_t h[8];           // SHA-256 chaining value after covered bytes
+    uint8_t fingerprint[32]; // samples of the covered prefix
+} midstate_t;
+
+// Counters reported at shutdown
+typedef struct
+{
+    long saved;             // midstates stored
+    long resumed;           // digests resumed from a midstate
+    long mismatches;        // midstates dropped because the prefix changed (fingerprint or truncation)
+    uint64_t bytes_skipped; // bytes not read thanks to the resumed digests
+} midstate_stats_t;
+
+// Files of at least this size (bytes) keep a midstate (0 disables resumable hashing)
+extern size_t midstate_min_size;
+
+/**
+ * Creates the midstate table (direct-mapped, slots rounded up to a power of two).
+ * Does nothing if midstate_min_size is 0.
+ */
+void midstate_init(size_t slots);
+
+/**
+ * Computes the SHA-256 of the file of identity id, resuming from its saved midstate when the
+ * file is append-only and has grown since, and fills state with the midstate to save once the digest is known
+ * to be of an unchanged file (see midstate_put). state->covered is 0 if there is nothing to save.
+ * Returns 0 on success or OPEN_FILE_E / READ_FILE_E / CLOSE_FILE_E like read_file().
+ */
+short midstate_digest(const char *filename, const file_id_t *id, uint8_t *hash, midstate_t *state);
+
+/**
+ * Returns 1 if the opened file has the append-only attribute (FS_APPEND_FL), 0 otherwise.
+ */
+int midstate_append_only(int fd);
+
+/**
+ * Computes the fingerprint of the first covered bytes of an opened file into out.
+ * Returns 0 on success or READ_FILE_E (also if the file is shorter than covered).
+ */
+short midstate_fingerprint(int fd, const char *filename, uint64_t covered, uint8_t out[32]);
+
+/**
+ * Stores a midstate filled by midstate_digest(), replacing the one of the same slot.
+ */
+void midstate_put(const midstate_t *state);
+
+/**
+ * Copies the counters into stats.
+ */
+void midstate_get_stats(midstate_stats_t *stats);
+
+/**
+ * Frees the midstate table.
+ */
+void midstate_cleanup(void);
+
+#endif
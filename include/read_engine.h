@@ -0,0 +1,86 @@
+#ifndef READ_ENGINE_H
+#define READ_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Strategies used to feed the content of a file to a consumer
+typedef enum
+{
+    READ_ENGINE_BUFFERED, // read() into a large page-aligned buffer
+    READ_ENGINE_MMAP,     // mmap() + madvise(MADV_SEQUENTIAL), no copy
+    READ_ENGINE_NOCACHE,  // buffered read() + posix_fadvise(DONTNEED) behind the cursor
+    READ_ENGINE_URING,    // io_uring, several reads in flight while the previous chunk is hashed
+} read_engine_t;
+
+/**
+ * Consumer callback: receives consecutive chunks of the file.
+ * Returns 0 to continue reading, any other value aborts the read.
+ */
+typedef int (*read_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+// Files of at least this size (bytes) are mapped instead of read
+extern size_t read_mmap_threshold;
+
+// Files of at least this size (bytes) are read without polluting the page cache (0 disables)
+extern size_t read_nocache_threshold;
+
+// Files of at least this size (bytes) are read through io_uring when it is available (0 disables io_uring)
+extern size_t read_uring_threshold;
+
+/**
+ * Checks that io_uring can be used, otherwise the engines fall back to read() and mmap().
+ * Called once at startup, after the thresholds are set.
+ */
+void read_engine_setup(void);
+
+/**
+ * Writes a description of the engines and their thresholds into buf.
+ */
+void read_engine_describe(char *buf, size_t size);
+
+/**
+ * Selects the read engine for a file of the given size.
+ */
+read_engine_t read_engine_select(size_t filesize);
+
+/**
+ * Returns a printable name for a read engine.
+ */
+const char *read_engine_name(read_engine_t engine);
+
+/**
+ * Reads the whole file and passes its content to sink, choosing the engine from the file size.
+ * Returns 0 on success or OPEN_FILE_E / READ_FILE_E / CLOSE_FILE_E (see request_response.h).
+ * On CLOSE_FILE_E the whole content has already been delivered to sink.
+ */
+short read_file(const char *filename, read_sink_t sink, void *ctx);
+
+/**
+ * Reads len bytes at offset from an already opened file with pread() and passes them to sink.
+ * Returns 0 on success or READ_FILE_E (read error, or the file is shorter than offset + len).
+ */
+short read_range(int fd, const char *filename, off_t offset, size_t len, read_sink_t sink, void *ctx);
+
+/**
+ * Reads a whole small file into buf (capacity cap bytes) with plain read() calls, storing its size in len.
+ * Returns 0 / OPEN_FILE_E / READ_FILE_E / CLOSE_FILE_E like read_file(),
+ * or 1 if the file is larger than cap (nothing useful is left in buf).
+ */
+short read_file_into(const char *filename, uint8_t *buf, size_t cap, size_t *len);
+
+/**
+ * Reads n small files at once (with io_uring, all the reads are in flight together), like
+ * read_file_into() for each one: file i goes to bufs[i], its size to lens[i] and its result
+ * (0 / OPEN_FILE_E / READ_FILE_E / CLOSE_FILE_E, or 1 if larger than cap) to errCodes[i].
+ */
+void read_files_into(const char *const *filenames, uint8_t *const *bufs, size_t cap, size_t *lens,
+                     short *errCodes, int n);
+
+/**
+ * Releases the per-thread read buffer and io_uring. Called by a worker thread before it terminates.
+ */
+void read_engine_thread_cleanup(void);
+
+#endif
@@ -2,6 +2,7 @@
 #define REQUEST_RESPONSE_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <limits.h>
 
 #ifndef PATH_MAX
@@ -9,11 +10,37 @@
 #define PATH_MAX 4096
 #endif
 
+#ifndef PIPE_BUF
+/* Fallback: the POSIX minimum of the atomic pipe write size */
+#define PIPE_BUF 512
+#endif
+
 // Error codes
 #define STAT_FILE_E -1
 #define OPEN_FILE_E -2
 #define READ_FILE_E -3
 #define CLOSE_FILE_E -4
+#define NOT_DIR_E -5
+#define WALK_DIR_E -6
+#define BAD_ALG_E -7
+
+// Request flags
+#define REQ_TREE_HASH 0x1    // Tree SHA-256 computed in parallel chunks (see tree_hash.h), SHA-256 only
+#define REQ_ALG_MASK 0x70    // Digest algorithm field
+#define REQ_ALG_SHA256 0x00
+#define REQ_ALG_SHA512_256 0x10 // SHA-512/256 (FIPS 180-4), 32-byte digest
+#define REQ_ALG_BLAKE3 0x20     // BLAKE3, 32-byte digest
+#define REQ_KIND_MASK 0xff   // Flags that select the digest (part of the cache key)
+#define REQ_V1_FLAGS (REQ_TREE_HASH | REQ_ALG_MASK) // Flags a v1.1 request may carry
+#define REQ_RAW_DIGEST 0x100 // v2 only: digests are returned as 32 raw bytes instead of hex
+#define REQ_SESSION 0x200    // v2 only: the server keeps the client FIFO open between responses
+#define REQ_SESSION_END 0x400 // v2 only: ends the session (usually in a message without paths)
+#define REQ_DIRECTORY 0x800   // v2 only: the path is a directory, answered with a manifest (see dir_hash.h)
+#define REQ_CHUNKS 0x1000     // v2 only: content-defined chunk list of the file (see cdc.h), plain SHA-256 only
+
+// Response flags (v2)
+#define RESP_ENTRY 0x1  // File of a directory request: the message ends with its relative path
+#define RESP_CHUNKS 0x2 // Chunks of a REQ_CHUNKS request: no digest, the message holds struct ChunkV2 records
 
 // Struct mapping error codes to messages
 typedef struct
@@ -28,6 +55,9 @@ static const error_entry_t error_table[] = {
     {OPEN_FILE_E, "Error: The server couldn't open the file\n"},
     {READ_FILE_E, "Error: The server couldn't read the file\n"},
     {CLOSE_FILE_E, "Error: The server couldn't close the file\n"},
+    {NOT_DIR_E, "Error: The requested path is not a directory\n"},
+    {WALK_DIR_E, "Error: The server couldn't list the whole directory\n"},
+    {BAD_ALG_E, "Error: The server doesn't support the requested digest algorithm\n"},
 };
 
 /**
@@ -35,18 +65,109 @@ static const error_entry_t error_table[] = {
  */
 const char *get_error_message(int code);
 
-// Structure representing a request sent from client to server
+// Structure representing a request sent from client to server (protocol v1)
+// Larger than PIPE_BUF: concurrent v1 writes are not guaranteed to be atomic
 struct Request
 {
     pid_t cPid;              // PID of the client sending the request
     char pathname[PATH_MAX]; // Pathname of the file
 };
 
-// Structure representing a response sent from server to client
+// The v1 layout is fixed: clients built before the request flags keep working
+_Static_assert(sizeof(struct Request) == sizeof(pid_t) + PATH_MAX, "struct Request is the v1 wire format");
+
+/*
+ * Protocol v1.1: a v1 request with flags (tree hash, digest algorithm). It starts with
+ * PROTO_V11_MAGIC, which has the high bit set and cannot be a PID, and is answered with a
+ * struct Response like a v1 request. Clients send a plain struct Request when flags is 0.
+ */
+#define PROTO_V11_MAGIC 0xA5320001u
+
+struct RequestV11
+{
+    uint32_t magic;          // PROTO_V11_MAGIC
+    pid_t cPid;              // PID of the client sending the request
+    uint32_t flags;          // REQ_V1_FLAGS flags: REQ_TREE_HASH, REQ_ALG_*
+    char pathname[PATH_MAX]; // Pathname of the file
+};
+
+// Structure representing a response sent from server to client (protocol v1)
 struct Response
 {
     short errCode; // Error code indicating success or failure
-    char hash[65]; // SHA-256 hash string (64 hex digits + null terminator)
+    char hash[65]; // Digest string (64 hex digits + null terminator), every algorithm has 32 bytes
+};
+
+/*
+ * Protocol v2: length-prefixed messages of at most PIPE_BUF bytes, so that a message is written
+ * atomically and messages of concurrent clients never interleave. Integers are in host byte order
+ * (both ends run on the same machine).
+ *
+ * A v1 request starts with the client PID, which is positive; v1.1 and v2 messages start with
+ * PROTO_V11_MAGIC and PROTO_V2_MAGIC, which have the high bit set. The server accepts all of
+ * them on the same FIFO and answers each client in the protocol of its request.
+ *
+ * request:  struct RequestV2, then count entries: path length (u16), path bytes (no terminator)
+ * response: struct ResponseV2, then digest_len bytes of digest (hex digits or raw bytes of the
+ *           digest of the requested algorithm, or nothing if errCode is an error without digest);
+ *           one response per path
+ *
+ * The algorithm is the REQ_ALG_* field of the flags; the algorithms supported so far all have
+ * 32-byte digests (64 hex digits), which is also what a v1 response holds.
+ *
+ * Each path carries a request ID (RequestV2.id + position in the message) that is echoed in its
+ * response: responses arrive in completion order, not in request order. A client that pipelines
+ * many requests sets REQ_SESSION and opens its FIFO before sending them; the server then writes
+ * every response on one descriptor, until a message with REQ_SESSION_END.
+ *
+ * A path sent with REQ_DIRECTORY names a directory: its request ID gets one response with
+ * RESP_ENTRY per regular file of the tree, in completion order, whose digest is followed by the
+ * path of the file relative to the directory (no terminator); then one response without
+ * RESP_ENTRY that carries the directory digest.
+ *
+ * A path sent with REQ_CHUNKS gets its chunks in order, in responses with RESP_CHUNKS whose
+ * digest_len is 0 and whose body is up to PROTO_V2_CHUNKS_MAX struct ChunkV2 records (raw
+ * digests whatever REQ_RAW_DIGEST); then one response without RESP_CHUNKS that carries the
+ * SHA-256 of the whole file, computed in the same read.
+ */
+#define PROTO_V2_MAGIC 0xA5320002u
+#define PROTO_MSG_MAX PIPE_BUF
+
+struct RequestV2
+{
+    uint32_t magic;  // PROTO_V2_MAGIC
+    uint16_t length; // Length of the whole message, header included
+    uint16_t count;  // Number of paths in the message
+    int32_t cPid;    // PID of the client sending the request
+    uint32_t flags;  // REQ_* flags, applied to every path
+    uint32_t id;     // Request ID of the first path, the following paths take the next IDs
+};
+
+struct ResponseV2
+{
+    uint32_t magic;      // PROTO_V2_MAGIC
+    uint16_t length;     // Length of the whole message, header included
+    int16_t errCode;     // Error code indicating success or failure
+    uint32_t id;         // Request ID of the path
+    uint16_t digest_len; // 2 * digest size (hex), digest size (REQ_RAW_DIGEST) or 0
+    uint16_t flags;      // RESP_* flags
 };
 
+// Chunk record of a RESP_CHUNKS response
+struct ChunkV2
+{
+    uint64_t offset;    // Offset of the chunk in the file
+    uint64_t length;    // Length of the chunk
+    uint8_t sha256[32]; // SHA-256 of the chunk
+};
+
+// Chunk records in one RESP_CHUNKS response
+#define PROTO_V2_CHUNKS_MAX ((PROTO_MSG_MAX - sizeof(struct ResponseV2)) / sizeof(struct ChunkV2))
+
+// Longest path that fits in a v2 request with no other path
+#define PROTO_V2_PATH_MAX (PROTO_MSG_MAX - sizeof(struct RequestV2) - sizeof(uint16_t))
+
+// Longest relative path of a directory entry response (hex digest)
+#define PROTO_V2_ENTRY_MAX (PROTO_MSG_MAX - sizeof(struct ResponseV2) - 64)
+
 #endif
@@ -0,0 +1,48 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Client sessions: the write descriptor of a client FIFO is opened once and reused for every
+ * response until the client ends its session, instead of an open/write/close per response.
+ * Responses are at most PIPE_BUF bytes, so workers can write to the same session concurrently.
+ */
+
+// Session counters reported at shutdown
+typedef struct
+{
+    long opened;  // client FIFOs opened for a session
+    long reused;  // responses written on an already open descriptor
+    long evicted; // idle sessions closed to make room in the table
+} session_stats_t;
+
+/**
+ * Sets the base path of the client FIFOs (completed with the client PID).
+ */
+void session_init(const char *base_fifo);
+
+/**
+ * Writes a response to the FIFO of client pid. If keep is set the descriptor stays open
+ * in the client's session, otherwise the FIFO is opened and closed for this write only.
+ * Returns 0 on success, -1 on failure.
+ */
+int session_write(pid_t pid, int keep, const void *msg, size_t len);
+
+/**
+ * Ends the session of client pid: its descriptor is closed once no worker is using it.
+ */
+void session_end(pid_t pid);
+
+/**
+ * Copies the session counters into stats.
+ */
+void session_get_stats(session_stats_t *stats);
+
+/**
+ * Closes every session. Called during server termination.
+ */
+void session_cleanup(void);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Widest multi-buffer kernel (AVX-512: 16 x 32-bit lanes)
+#define SHA256_MB_MAX_LANES 16
+
+/**
+ * Selects the multi-buffer kernel from the CPU features (AVX-512F, AVX2 or none), if it passes
+ * a known-answer test on every lane.
+ */
+void sha256_mb_select(void);
+
+/**
+ * Returns the number of lanes of the selected kernel, 1 if no SIMD kernel is available.
+ */
+int sha256_mb_lanes(void);
+
+/**
+ * Returns the name of the selected kernel ("avx512", "avx2" or "none").
+ */
+const char *sha256_mb_kernel(void);
+
+/**
+ * Computes the SHA-256 of n independent in-memory messages in parallel lanes.
+ * n must not exceed sha256_mb_lanes(); the digest of msgs[i] is written to out[i].
+ */
+void sha256_mb_digest(const uint8_t *const *msgs, const size_t *lens, int n, uint8_t (*out)[32]);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SHA256_NATIVE_H
+#define SHA256_NATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-tree SHA-256 state, independent from OpenSSL
+typedef struct
+{
+    uint32_t h[8];      // chaining value
+    uint64_t total;     // bytes hashed so far
+    uint8_t buf[64];    // pending partial block
+    size_t buflen;      // bytes used in buf
+} sha256_state_t;
+
+// Round constants and initial chaining value (FIPS 180-4), shared with the multi-buffer kernels
+extern const uint32_t sha256_k[64];
+extern const uint32_t sha256_h0[8];
+
+// Compression function: processes nblocks 64-byte blocks into h
+typedef void (*sha256_blocks_fn)(uint32_t h[8], const uint8_t *data, size_t nblocks);
+
+/**
+ * Selects the fastest compression kernel supported by the CPU (SHA-NI, ARMv8 crypto or scalar).
+ * With force_scalar != 0 the portable kernel is always used.
+ */
+void sha256_native_select(int force_scalar);
+
+/**
+ * Returns the name of the selected kernel ("sha-ni", "armv8-ce" or "scalar").
+ */
+const char *sha256_native_kernel(void);
+
+void sha256_native_init(sha256_state_t *st);
+void sha256_native_update(sha256_state_t *st, const uint8_t *data, size_t len);
+void sha256_native_final(sha256_state_t *st, uint8_t out[32]);
+
+#endif
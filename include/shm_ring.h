@@ -0,0 +1,121 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "request_response.h"
+
+/*
+ * Shared-memory transport for clients on the same machine. The server creates a POSIX shared
+ * memory segment that holds:
+ *
+ * - a submission ring, shared by all the clients (multi-producer, single consumer): each slot
+ *   holds a request with its path, written in place by the client;
+ * - a table of client slots, each with its own completion ring (multi-producer: the workers,
+ *   single consumer: the client) where the raw digests are written in place.
+ *
+ * The rings are bounded queues where each slot has a sequence number (Vyukov): producers claim
+ * a position with a compare-and-swap, the consumer needs no atomic read-modify-write. Nothing is
+ * copied through the kernel and, while the rings are busy, nothing calls it. An idle consumer
+ * sleeps on a futex, and producers only call futex(FUTEX_WAKE) when someone is sleeping.
+ *
+ * A client keeps at most SHM_CQ_SLOTS requests in flight, so its completion ring never fills.
+ * A client slot is reused with a new generation; completions of an older generation are
+ * dropped by the client.
+ */
+
+#define SHM_RING_NAME "/sha256_ring" // Default name of the segment (-R)
+#define SHM_SQ_SLOTS 512             // Submission ring slots (power of two)
+#define SHM_CQ_SLOTS 256             // Completion ring slots per client (power of two)
+#define SHM_CLIENTS 64               // Client slots
+
+// Request read from the submission ring by the server
+typedef struct
+{
+    pid_t pid;          // Client PID (for the logs)
+    unsigned int slot;  // Client slot of the completion ring
+    uint32_t gen;       // Generation of the client slot
+    uint32_t id;        // Request ID, echoed in the completion
+    uint32_t flags;     // REQ_* flags
+    char path[PATH_MAX];
+} shm_request_t;
+
+// Completion read by the client
+typedef struct
+{
+    uint32_t id;        // Request ID
+    int16_t errCode;    // Error code indicating success or failure
+    uint8_t sha256[32]; // Raw digest (zeros for an error without digest)
+} shm_completion_t;
+
+// Ring counters reported at shutdown
+typedef struct
+{
+    long attached;  // clients attached to the segment
+    long requests;  // requests taken from the submission ring
+    long completed; // completions written
+    long dropped;   // completions lost: full ring or client slot reused
+} shm_ring_stats_t;
+
+typedef struct shm_ring_client shm_ring_client_t;
+
+/* ---------------------------------- server side ---------------------------------- */
+
+/**
+ * Creates the shared memory segment, replacing a stale one. Returns 0 on success, -1 on failure.
+ */
+int shm_ring_create(const char *name);
+
+/**
+ * Waits for the next request of the submission ring. Called by a single thread.
+ * Returns 0 with a request, -1 once shm_ring_stop() was called.
+ */
+int shm_ring_receive(shm_request_t *req);
+
+/**
+ * Writes a completion for the request ID of a client slot and wakes the client.
+ * sha256 is NULL for an error without digest. Returns 0 on success, -1 if dropped.
+ */
+int shm_ring_complete(unsigned int slot, uint32_t gen, uint32_t id, short errCode, const uint8_t *sha256);
+
+/**
+ * Makes shm_ring_receive() return -1 and tells the clients that the server is gone.
+ */
+void shm_ring_stop(void);
+
+/**
+ * Unmaps and removes the segment.
+ */
+void shm_ring_destroy(void);
+
+/**
+ * Copies the ring counters into stats.
+ */
+void shm_ring_get_stats(shm_ring_stats_t *stats);
+
+/* ---------------------------------- client side ---------------------------------- */
+
+/**
+ * Maps the segment and claims a client slot. Returns NULL on failure (errno set).
+ */
+shm_ring_client_t *shm_ring_attach(const char *name);
+
+/**
+ * Puts a request on the submission ring, waiting while it is full.
+ * Returns 0 on success, -1 if the path is too long or the server is gone.
+ */
+int shm_ring_submit(shm_ring_client_t *client, uint32_t id, uint32_t flags, const char *path);
+
+/**
+ * Waits for the next completion of the client. Returns 0 on success, -1 if the server is gone.
+ */
+int shm_ring_wait(shm_ring_client_t *client, shm_completion_t *completion);
+
+/**
+ * Releases the client slot and unmaps the segment.
+ */
+void shm_ring_detach(shm_ring_client_t *client);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef TREE_HASH_H
+#define TREE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tree SHA-256 (REQ_TREE_HASH):
+ * - the file is split into TREE_CHUNK_SIZE chunks, the last one may be shorter;
+ *   an empty file has a single empty chunk
+ * - leaf i = SHA-256(0x00 || chunk i)
+ * - parent = SHA-256(0x01 || left child || right child)
+ * - each level is built by pairing nodes from left to right; a node left alone
+ *   at the end of a level is promoted unchanged to the next level
+ * - the digest is the root; a file with a single chunk has its leaf as root
+ */
+#define TREE_CHUNK_SIZE (4 * 1024 * 1024)
+#define TREE_LEAF_PREFIX 0x00
+#define TREE_NODE_PREFIX 0x01
+
+/**
+ * Returns the number of leaves of a file of the given size (at least 1).
+ */
+size_t tree_hash_chunks(size_t filesize);
+
+/**
+ * Computes leaf index of an opened file of size filesize.
+ * Returns 0 on success or READ_FILE_E.
+ */
+short tree_hash_leaf(int fd, const char *filename, size_t filesize, size_t index, uint8_t leaf[32]);
+
+/**
+ * Computes the BLAKE3 chaining value of chunk index of an opened file: a chunk is a subtree of
+ * TREE_CHUNK_SIZE / BLAKE3_CHUNK_LEN (a power of two) BLAKE3 chunks, combined by blake3_root().
+ * Returns 0 on success or READ_FILE_E.
+ */
+short tree_hash_blake3_leaf(int fd, const char *filename, size_t filesize, size_t index, uint8_t cv[32]);
+
+/**
+ * Combines n leaves into the root. The leaves array is overwritten.
+ */
+void tree_hash_root(uint8_t (*leaves)[32], size_t n, uint8_t root[32]);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper on the raw system calls (no liburing): one submission and one
+ * completion ring mapped from the kernel, used by a single thread.
+ */
+
+typedef struct
+{
+    int fd;                   // io_uring descriptor, -1 if not set up
+    unsigned int *sq_head;    // Kernel: next submission to consume
+    unsigned int *sq_tail;    // Next submission slot to fill
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;   // Submission slot -> SQE index
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;    // Next completion to read
+    unsigned int *cq_tail;    // Kernel: next completion slot to fill
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;   // SQEs filled but not yet passed to the kernel
+    void *sq_ptr;             // Mappings, for uring_exit()
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Creates a ring of at least entries submissions. Returns 0 on success, -errno on failure
+ * (ENOSYS without io_uring, EPERM if it is disabled).
+ */
+int uring_init(uring_t *ring, unsigned int entries);
+
+/**
+ * Registers n buffers for fixed reads (buffer index = position in iov). Returns 0 or -errno.
+ */
+int uring_register_buffers(uring_t *ring, const struct iovec *iov, unsigned int n);
+
+/**
+ * Queues a read of len bytes at offset into buf; buf_index is the registered buffer holding buf,
+ * or -1. Returns 0, or -1 if the submission ring is full.
+ */
+int uring_prep_read(uring_t *ring, int fd, void *buf, unsigned int len, off_t offset, int buf_index,
+                    uint64_t user_data);
+
+/**
+ * Passes the queued reads to the kernel and waits until at least wait_nr completions are available.
+ * Returns 0 or -errno.
+ */
+int uring_submit(uring_t *ring, unsigned int wait_nr);
+
+/**
+ * Takes the next completion if there is one: returns 1 and fills user_data and res
+ * (bytes read or -errno), 0 if the completion ring is empty.
+ */
+int uring_peek(uring_t *ring, uint64_t *user_data, int *res);
+
+/**
+ * Unmaps and closes the ring.
+ */
+void uring_exit(uring_t *ring);
+
+#endif
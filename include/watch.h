@@ -0,0 +1,54 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/*
+ * Directory tree watcher on inotify: every directory of the watched trees has a watch of its own
+ * (inotify is not recursive), directories created or moved into a tree are added as they appear.
+ * Reports the regular files whose content may have changed: closed after writing, or moved into
+ * a watched directory (a file written elsewhere and renamed into place).
+ *
+ * Not thread-safe: used by the watcher thread only, after the trees are added at startup.
+ */
+
+#define WATCH_MAX_ROOTS 16
+
+// Receives the path of a file that was written or moved into a watched tree
+typedef void (*watch_fn)(const char *path, void *arg);
+
+// Watcher counters reported at shutdown
+typedef struct
+{
+    long dirs;      // directories watched
+    long events;    // files reported
+    long overflows; // event queue overflows (events lost)
+} watch_stats_t;
+
+/**
+ * Creates the inotify instance. Returns 0, or -1 if inotify is not available.
+ */
+int watch_init(void);
+
+/**
+ * Watches root and every directory under it (symbolic links are not followed).
+ * Returns 0, or -1 if root cannot be watched.
+ */
+int watch_add_tree(const char *root);
+
+/**
+ * Waits up to timeout_ms for events and passes every file written or moved into a watched tree
+ * to fn. The files of a directory created or moved into a tree are reported when it is added,
+ * since they may be written before its watch exists. Returns 0, or -1 on a read error.
+ */
+int watch_wait(int timeout_ms, watch_fn fn, void *arg);
+
+/**
+ * Copies the counters into stats.
+ */
+void watch_get_stats(watch_stats_t *stats);
+
+/**
+ * Removes the watches and closes the inotify instance.
+ */
+void watch_close(void);
+
+#endif
@@ -0,0 +1,711 @@
+#define _GNU_SOURCE // ppoll()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "request_response.h"
+#include "errExit.h"
+
+/*
+ * Load generator: N simulated clients, each a process of its own with its own FIFO, speaking
+ * protocol v2 in a session against a running server (one path per request message).
+ *
+ * - the files are generated in a temporary directory, their sizes drawn from a distribution
+ * - requests go to a hot set of the files with a given share, uniformly to the others otherwise
+ * - closed loop: every client keeps -w requests in flight; open loop (-r): every client sends
+ *   at a fixed rate, and the latency is counted from the scheduled send time, so a server that
+ *   falls behind is not hidden by the clients waiting for it
+ *
+ * Reports throughput, latency quantiles and the cache hit rate as text, and as JSON with -o.
+ * The hit rate comes from the metrics file of the server (SIGUSR1) when its PID is given with
+ * -p, otherwise it is estimated: the first request of each file misses, the others hit.
+ */
+
+#define BENCH_CLIENTS_MAX 1024
+#define BENCH_WINDOW_MAX 512       // responses in flight must fit in the client FIFO
+#define BENCH_SIZES_MAX 16         // entries of the size distribution
+#define BENCH_DRAIN_NS 10000000000 // time given to the requests in flight after the duration
+
+// Latency histogram: log-linear over nanoseconds, 16 buckets per power of two (error < 6.25%)
+#define HIST_MIN_SHIFT 10
+#define HIST_MAX_SHIFT 39
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (2 + (HIST_MAX_SHIFT - HIST_MIN_SHIFT + 1) * HIST_SUB_BUCKETS)
+
+// Entry of the file size distribution
+typedef struct
+{
+    uint64_t size;
+    double weight;
+} size_weight_t;
+
+// Results of a simulated client, in memory shared with the parent
+typedef struct
+{
+    uint64_t sent;       // requests sent
+    uint64_t answered;   // responses received
+    uint64_t errors;     // responses with an error
+    uint64_t bytes;      // bytes of the files answered without error
+    uint64_t first;      // requests that were the first of their file, over all the clients
+    uint64_t last_ns;    // time of the last response
+    uint64_t max_ns;     // longest latency
+    uint64_t sum_ns;     // sum of the latencies
+    int failed;          // the client could not run
+    uint64_t buckets[HIST_BUCKETS];
+} client_result_t;
+
+// Memory shared by the parent and the clients
+typedef struct
+{
+    uint64_t start_ns; // start of the run, 0 until every client is ready
+    client_result_t results[];
+} shared_t;
+
+// Request in flight; the slot of request ID id is id % BENCH_WINDOW_MAX
+typedef struct
+{
+    uint64_t sent_ns; // send time (scheduled time in open loop)
+    uint32_t id;
+    uint32_t file;
+    int used;
+} bench_slot_t;
+
+// FIFO paths of the server protocol
+char *path2ServerFIFO = "/tmp/fifo_server_SHA256";
+char *baseClientFIFO = "/tmp/fifo_client_SHA256."; // completed with the process ID
+char *path2Metrics = "/tmp/metrics_server_SHA256.prom";
+
+// Run parameters
+int nclients = 8;
+double duration = 10;
+double rate = 0;  // requests per second per client, 0 for a closed loop
+int window = 0;   // requests in flight per client: default 1 in a closed loop, BENCH_WINDOW_MAX in an open loop
+size_t nfiles = 1000;
+size_t hot_files = 0;  // files 0 .. hot_files - 1 are hot
+double hot_share = 0;  // share of the requests that go to the hot files
+unsigned int flags = REQ_RAW_DIGEST | REQ_SESSION;
+const char *base_dir = "/tmp";
+const char *json_path = NULL;
+pid_t server_pid = 0;
+int keep_files = 0;
+
+size_weight_t sizes[BENCH_SIZES_MAX];
+int nsizes = 0;
+
+char dir[PATH_MAX] = "";     // directory of the generated files
+uint64_t *file_size = NULL;  // size of each file
+uint8_t *touched = NULL;     // shared: 1 once a file has been requested
+
+volatile sig_atomic_t stop = 0;
+
+/**
+ * Parses "size:weight,..." (sizes with an optional K, M or G suffix) into sizes.
+ * Returns 0 on success, -1 if the list is invalid.
+ */
+int parse_sizes(const char *list);
+
+/**
+ * Parses "hot_percent:share_percent" into hot_files and hot_share.
+ * Returns 0 on success, -1 if it is invalid.
+ */
+int parse_hot_set(const char *arg);
+
+/**
+ * Creates the temporary directory and writes the files with sizes drawn from the distribution.
+ */
+void generate_files(void);
+
+/**
+ * Removes the generated files and their directory.
+ */
+void remove_files(void);
+
+/**
+ * Runs a simulated client until the end of the run and writes its results.
+ */
+void run_client(int index, shared_t *shared);
+
+/**
+ * Sends SIGUSR1 to the server, waits for its metrics file to be rewritten and reads the cache
+ * hit and miss counters. Returns 0 on success, -1 if the file was not rewritten in time.
+ */
+int read_server_counters(uint64_t *hits, uint64_t *misses);
+
+/**
+ * Returns the upper bound in nanoseconds of the bucket holding quantile q of the histogram.
+ */
+uint64_t hist_quantile(const uint64_t *buckets, uint64_t count, double q);
+
+/**
+ * Sets the stop flag: the clients stop sending and clean up.
+ */
+void stop_run(int sig);
+
+/* ========================== MAIN IMPLEMENTATION ========================== */
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// splitmix64: seeded per client, so runs are reproducible
+uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double random_unit(uint64_t *state) { return (next_random(state) >> 11) * 0x1.0p-53; }
+
+// 80% of the requests to a 20% hot set: a file of the hot set, or any of the others
+uint32_t pick_file(uint64_t *rng)
+{
+    if (hot_files == 0 || hot_files >= nfiles)
+        return next_random(rng) % nfiles;
+    if (random_unit(rng) < hot_share)
+        return next_random(rng) % hot_files;
+    return hot_files + next_random(rng) % (nfiles - hot_files);
+}
+
+int hist_bucket(uint64_t ns)
+{
+    if (ns < ((uint64_t)1 << HIST_MIN_SHIFT))
+        return 0;
+    int shift = 63 - __builtin_clzll(ns);
+    if (shift > HIST_MAX_SHIFT)
+        return HIST_BUCKETS - 1;
+    int sub = (int)(ns >> (shift - 4)) & (HIST_SUB_BUCKETS - 1);
+    return 1 + (shift - HIST_MIN_SHIFT) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t hist_bound(int b)
+{
+    if (b == 0)
+        return (uint64_t)1 << HIST_MIN_SHIFT;
+    if (b >= HIST_BUCKETS - 1)
+        b = HIST_BUCKETS - 2; // overflow: the last finite bound
+    int shift = HIST_MIN_SHIFT + (b - 1) / HIST_SUB_BUCKETS;
+    int sub = (b - 1) % HIST_SUB_BUCKETS;
+    return (uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (shift - 4);
+}
+
+uint64_t hist_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+            return hist_bound(b);
+    }
+    return hist_bound(HIST_BUCKETS - 1);
+}
+
+int main(int argc, char *argv[])
+{
+    // -c clients, -d duration in seconds, -r requests per second per client (open loop),
+    // -w requests in flight per client, -n files, -s size distribution, -H hot set,
+    // -a digest algorithm, -D directory of the files, -k keeps them, -o JSON report,
+    // -p server PID and -P its metrics file for the hit rate
+    int opt, bad = 0;
+    const char *size_list = "4K:70,64K:25,1M:5";
+    const char *hot_set = "20:80";
+    while ((opt = getopt(argc, argv, "a:c:D:d:H:kn:o:P:p:r:s:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            flags &= ~REQ_ALG_MASK;
+            if (strcmp(optarg, "sha512-256") == 0)
+                flags |= REQ_ALG_SHA512_256;
+            else if (strcmp(optarg, "blake3") == 0)
+                flags |= REQ_ALG_BLAKE3;
+            else if (strcmp(optarg, "sha256") != 0)
+                bad = 1;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'D':
+            base_dir = optarg;
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'H':
+            hot_set = optarg;
+            break;
+        case 'k':
+            keep_files = 1;
+            break;
+        case 'n':
+            nfiles = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            json_path = optarg;
+            break;
+        case 'P':
+            path2Metrics = optarg;
+            break;
+        case 'p':
+            server_pid = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 's':
+            size_list = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            bad = 1;
+        }
+    }
+    if (window == 0)
+        window = rate > 0 ? BENCH_WINDOW_MAX : 1;
+    if (bad || optind != argc || nclients < 1 || nclients > BENCH_CLIENTS_MAX || duration <= 0 || rate < 0 ||
+        window < 1 || window > BENCH_WINDOW_MAX || nfiles < 1 || nfiles > UINT32_MAX || parse_sizes(size_list) != 0 ||
+        parse_hot_set(hot_set) != 0)
+    {
+        fprintf(stderr,
+                "Usage: %s [-c clients] [-d seconds] [-r rate_per_client | -w in_flight] [-n files]\n"
+                "       [-s size:weight,...] [-H hot_percent:share_percent] [-a sha256|sha512-256|blake3]\n"
+                "       [-D dir] [-k] [-o report.json|-] [-p server_pid] [-P metrics_file]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Ctrl-C ends the run early: the clients clean up their FIFOs and the report is printed
+    signal(SIGINT, stop_run);
+    signal(SIGTERM, stop_run);
+    signal(SIGPIPE, SIG_IGN);
+
+    generate_files();
+
+    size_t shared_len = sizeof(shared_t) + nclients * sizeof(client_result_t) + nfiles;
+    shared_t *shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        errExit("<Bench> mmap: failed to allocate the shared results");
+    touched = (uint8_t *)&shared->results[nclients];
+
+    uint64_t hits0 = 0, misses0 = 0;
+    int server_counters = server_pid > 0 && read_server_counters(&hits0, &misses0) == 0;
+
+    // The clients set up their FIFOs, then wait for the start time; nothing buffered may be
+    // flushed twice by a client that exits
+    fflush(stdout);
+    pid_t *pids = calloc(nclients, sizeof(pid_t));
+    if (!pids)
+        errExit("<Bench> calloc: failed to allocate the client table");
+    for (int i = 0; i < nclients; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == -1)
+            errExit("<Bench> fork: failed to start a client");
+        if (pids[i] == 0)
+        {
+            run_client(i, shared);
+            _exit(0);
+        }
+    }
+    uint64_t start = now_ns() + 100000000; // 100 ms for the clients to open their FIFOs
+    __atomic_store_n(&shared->start_ns, start, __ATOMIC_RELEASE);
+    printf("<Bench> %d clients, %s, %.1f s, %zu files in %s\n", nclients, rate > 0 ? "open loop" : "closed loop",
+           duration, nfiles, dir);
+
+    for (int i = 0; i < nclients; i++)
+    {
+        while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
+    free(pids);
+
+    // Merge the results of the clients
+    client_result_t total = {0};
+    int failed = 0;
+    for (int i = 0; i < nclients; i++)
+    {
+        client_result_t *r = &shared->results[i];
+        total.sent += r->sent;
+        total.answered += r->answered;
+        total.errors += r->errors;
+        total.bytes += r->bytes;
+        total.first += r->first;
+        total.sum_ns += r->sum_ns;
+        if (r->max_ns > total.max_ns)
+            total.max_ns = r->max_ns;
+        if (r->last_ns > total.last_ns)
+            total.last_ns = r->last_ns;
+        failed += r->failed;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            total.buckets[b] += r->buckets[b];
+    }
+
+    uint64_t hits1 = 0, misses1 = 0;
+    if (server_counters)
+        server_counters = read_server_counters(&hits1, &misses1) == 0;
+    double hit_rate = 0;
+    if (server_counters && hits1 + misses1 > hits0 + misses0)
+        hit_rate = (double)(hits1 - hits0) / (hits1 + misses1 - hits0 - misses0);
+    else if (total.sent > 0)
+        hit_rate = 1 - (double)total.first / total.sent;
+
+    double elapsed = total.last_ns > start ? (total.last_ns - start) / 1e9 : duration;
+    double rps = total.answered / elapsed;
+    double mib_s = total.bytes / elapsed / (1024 * 1024);
+    double p50 = hist_quantile(total.buckets, total.answered, 0.5) / 1e6;
+    double p99 = hist_quantile(total.buckets, total.answered, 0.99) / 1e6;
+    double p999 = hist_quantile(total.buckets, total.answered, 0.999) / 1e6;
+    double mean = total.answered ? total.sum_ns / 1e6 / total.answered : 0;
+    if (total.answered && total.max_ns / 1e6 < p999)
+        p999 = total.max_ns / 1e6;
+    if (total.answered && total.max_ns / 1e6 < p99)
+        p99 = total.max_ns / 1e6;
+
+    printf("<Bench> Requests: %llu sent, %llu answered, %llu errors, %llu unanswered, %d clients failed\n",
+           (unsigned long long)total.sent, (unsigned long long)total.answered, (unsigned long long)total.errors,
+           (unsigned long long)(total.sent - total.answered), failed);
+    printf("<Bench> Throughput: %.1f requests/s, %.1f MiB/s over %.2f s\n", rps, mib_s, elapsed);
+    printf("<Bench> Latency: p50 < %.3f ms, p99 < %.3f ms, p99.9 < %.3f ms, mean %.3f ms, max %.3f ms\n", p50, p99,
+           p999, mean, total.max_ns / 1e6);
+    printf("<Bench> Cache hit rate: %.2f%% (%s)\n", hit_rate * 100,
+           server_counters ? "server counters" : "estimate: first request of each file misses");
+
+    if (json_path)
+    {
+        FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!out)
+            errExit("<Bench> fopen: failed to open the JSON report");
+        fprintf(out,
+                "{\"clients\": %d, \"mode\": \"%s\", \"rate_per_client\": %.3f, \"window\": %d, "
+                "\"duration_s\": %.3f, \"elapsed_s\": %.3f, \"files\": %zu, "
+                "\"requests\": %llu, \"answered\": %llu, \"errors\": %llu, \"clients_failed\": %d, "
+                "\"throughput_rps\": %.3f, \"throughput_mib_s\": %.3f, "
+                "\"latency_ms\": {\"p50\": %.6f, \"p99\": %.6f, \"p999\": %.6f, \"mean\": %.6f, \"max\": %.6f}, "
+                "\"cache_hit_rate\": %.6f, \"cache_hit_rate_source\": \"%s\"}\n",
+                nclients, rate > 0 ? "open" : "closed", rate, window, duration, elapsed, nfiles,
+                (unsigned long long)total.sent, (unsigned long long)total.answered, (unsigned long long)total.errors,
+                failed, rps, mib_s, p50, p99, p999, mean, total.max_ns / 1e6, hit_rate,
+                server_counters ? "server" : "estimate");
+        if (out != stdout)
+            fclose(out);
+    }
+
+    munmap(shared, shared_len);
+    if (!keep_files)
+        remove_files();
+    return failed || total.answered == 0 ? EXIT_FAILURE : 0;
+}
+
+int parse_sizes(const char *list)
+{
+    nsizes = 0;
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        uint64_t size = strtoull(p, &end, 10);
+        if (end == p)
+            return -1;
+        if (*end == 'K' || *end == 'k')
+            size <<= 10, end++;
+        else if (*end == 'M' || *end == 'm')
+            size <<= 20, end++;
+        else if (*end == 'G' || *end == 'g')
+            size <<= 30, end++;
+        double weight = 1;
+        if (*end == ':')
+        {
+            p = end + 1;
+            weight = strtod(p, &end);
+            if (end == p || weight < 0)
+                return -1;
+        }
+        if (nsizes == BENCH_SIZES_MAX || (*end != ',' && *end != '\0'))
+            return -1;
+        sizes[nsizes++] = (size_weight_t){.size = size, .weight = weight};
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    double total = 0;
+    for (int i = 0; i < nsizes; i++)
+        total += sizes[i].weight;
+    return nsizes > 0 && total > 0 ? 0 : -1;
+}
+
+int parse_hot_set(const char *arg)
+{
+    double percent, share;
+    if (sscanf(arg, "%lf:%lf", &percent, &share) != 2 || percent < 0 || percent > 100 || share < 0 || share > 100)
+        return -1;
+    hot_files = (size_t)(nfiles * percent / 100);
+    hot_share = share / 100;
+    return 0;
+}
+
+void generate_files(void)
+{
+    snprintf(dir, sizeof(dir), "%s/bench_load.XXXXXX", base_dir);
+    if (!mkdtemp(dir))
+        errExit("<Bench> mkdtemp: failed to create the directory of the files");
+
+    file_size = malloc(nfiles * sizeof(uint64_t));
+    uint8_t *block = malloc(1024 * 1024);
+    if (!file_size || !block)
+        errExit("<Bench> malloc: failed to allocate the files");
+
+    double total_weight = 0;
+    for (int i = 0; i < nsizes; i++)
+        total_weight += sizes[i].weight;
+
+    uint64_t rng = 0x62656e63686c6f61ULL, bytes = 0;
+    for (size_t f = 0; f < nfiles; f++)
+    {
+        double pick = random_unit(&rng) * total_weight;
+        int s = 0;
+        while (s < nsizes - 1 && pick >= sizes[s].weight)
+            pick -= sizes[s++].weight;
+        file_size[f] = sizes[s].size;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/f%06zu", dir, f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1)
+            errExit("<Bench> open: failed to create a file");
+
+        // Random contents, a new block every MiB
+        for (uint64_t done = 0; done < file_size[f];)
+        {
+            size_t len = file_size[f] - done < 1024 * 1024 ? file_size[f] - done : 1024 * 1024;
+            for (size_t i = 0; i < len; i += 8)
+            {
+                uint64_t r = next_random(&rng);
+                memcpy(block + i, &r, len - i < 8 ? len - i : 8);
+            }
+            if (write(fd, block, len) != (ssize_t)len)
+                errExit("<Bench> write: failed to write a file");
+            done += len;
+        }
+        if (close(fd) == -1)
+            errExit("<Bench> close: failed to close a file");
+        bytes += file_size[f];
+    }
+    free(block);
+    printf("<Bench> Generated %zu files, %.1f MiB\n", nfiles, bytes / (1024.0 * 1024));
+}
+
+void remove_files(void)
+{
+    for (size_t f = 0; f < nfiles; f++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/f%06zu", dir, f);
+        unlink(path);
+    }
+    if (rmdir(dir) == -1)
+        perror("<Bench> rmdir failed for the directory of the files");
+}
+
+// Sends the request of one file as a message of its own
+void send_request(int serverFIFO, uint32_t id, uint32_t file)
+{
+    uint8_t msg[PROTO_MSG_MAX];
+    char path[PATH_MAX];
+    uint16_t path_len = snprintf(path, sizeof(path), "%s/f%06u", dir, file);
+    struct RequestV2 header = {.magic = PROTO_V2_MAGIC, .count = 1, .cPid = getpid(), .flags = flags, .id = id};
+    header.length = sizeof(header) + sizeof(path_len) + path_len;
+    memcpy(msg, &header, sizeof(header));
+    memcpy(msg + sizeof(header), &path_len, sizeof(path_len));
+    memcpy(msg + sizeof(header) + sizeof(path_len), path, path_len);
+    if (write(serverFIFO, msg, header.length) != header.length)
+        errExit("<Bench> write: failed to write request to server FIFO");
+}
+
+void run_client(int index, shared_t *shared)
+{
+    client_result_t *result = &shared->results[index];
+    char path2ClientFIFO[PATH_MAX];
+    sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, getpid());
+
+    // Open the client FIFO before the first request, and keep a writer so that reads never
+    // return end of file; reads are non-blocking, the client waits in poll()
+    int clientFIFO = -1, clientFIFO_extra = -1, serverFIFO = -1;
+    if (mkfifo(path2ClientFIFO, S_IRUSR | S_IWUSR | S_IWGRP) == -1 ||
+        (clientFIFO = open(path2ClientFIFO, O_RDONLY | O_NONBLOCK)) == -1 ||
+        (clientFIFO_extra = open(path2ClientFIFO, O_WRONLY)) == -1 ||
+        (serverFIFO = open(path2ServerFIFO, O_WRONLY)) == -1)
+    {
+        perror("<Bench> failed to open the FIFOs of a client");
+        result->failed = 1;
+        unlink(path2ClientFIFO);
+        return;
+    }
+
+    uint64_t start;
+    while (!(start = __atomic_load_n(&shared->start_ns, __ATOMIC_ACQUIRE)) && !stop)
+        usleep(1000);
+    while (!stop && now_ns() < start)
+        usleep(1000);
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t next_send = start;
+
+    static bench_slot_t slots[BENCH_WINDOW_MAX];
+    uint64_t rng = 0x636c69656e74ULL + index;
+    uint32_t next_id = 0;
+    int inflight = 0;
+    uint8_t buf[64 * 1024];
+    size_t have = 0;
+
+    while (!stop)
+    {
+        uint64_t now = now_ns();
+        if (now < end)
+        {
+            // Closed loop: refill the window; open loop: every send that is due, window permitting
+            while (inflight < window && (interval == 0 || next_send <= now))
+            {
+                while (slots[next_id % BENCH_WINDOW_MAX].used)
+                    next_id++;
+                bench_slot_t *slot = &slots[next_id % BENCH_WINDOW_MAX];
+                slot->file = pick_file(&rng);
+                slot->id = next_id++;
+                slot->sent_ns = interval ? next_send : now;
+                slot->used = 1;
+                if (__atomic_exchange_n(&touched[slot->file], 1, __ATOMIC_RELAXED) == 0)
+                    result->first++;
+                send_request(serverFIFO, slot->id, slot->file);
+                result->sent++;
+                inflight++;
+                next_send += interval;
+            }
+        }
+        else if (inflight == 0 || now > end + BENCH_DRAIN_NS)
+            break;
+
+        // Wait for a response, or until the next send is due (to the nanosecond: a late wakeup
+        // would count as latency of the server in an open loop)
+        uint64_t wake = now < end ? (interval && inflight < window ? next_send : end) : end + BENCH_DRAIN_NS;
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec timeout = {.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+        struct pollfd pfd = {.fd = clientFIFO, .events = POLLIN};
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0)
+            continue;
+
+        // Responses are written atomically but read as a stream: parse the complete ones
+        ssize_t n = read(clientFIFO, buf + have, sizeof(buf) - have);
+        if (n <= 0)
+            continue;
+        have += n;
+        now = now_ns();
+        size_t off = 0;
+        while (have - off >= sizeof(struct ResponseV2))
+        {
+            struct ResponseV2 header;
+            memcpy(&header, buf + off, sizeof(header));
+            if (header.magic != PROTO_V2_MAGIC || header.length < sizeof(header) || header.length > PROTO_MSG_MAX)
+                errExit("<Bench> read: invalid response from the server");
+            if (have - off < header.length)
+                break;
+            off += header.length;
+
+            bench_slot_t *slot = &slots[header.id % BENCH_WINDOW_MAX];
+            if (!slot->used || slot->id != header.id)
+                errExit("<Bench> read: invalid response from the server");
+            slot->used = 0;
+            inflight--;
+
+            uint64_t latency = now - slot->sent_ns;
+            result->answered++;
+            result->buckets[hist_bucket(latency)]++;
+            result->sum_ns += latency;
+            if (latency > result->max_ns)
+                result->max_ns = latency;
+            result->last_ns = now;
+            if (header.errCode != 0 && header.errCode != CLOSE_FILE_E)
+                result->errors++;
+            else
+                result->bytes += file_size[slot->file];
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+
+    // End the session, then remove the FIFO
+    struct RequestV2 header = {.magic = PROTO_V2_MAGIC, .length = sizeof(header), .cPid = getpid(),
+                               .flags = REQ_SESSION_END};
+    if (write(serverFIFO, &header, sizeof(header)) != sizeof(header))
+        perror("<Bench> write failed for the end of session");
+    close(serverFIFO);
+    close(clientFIFO);
+    close(clientFIFO_extra);
+    unlink(path2ClientFIFO);
+}
+
+int read_server_counters(uint64_t *hits, uint64_t *misses)
+{
+    // The server renames a new file over the old one: wait for another inode or mtime
+    struct stat before = {0}, st;
+    stat(path2Metrics, &before);
+    if (kill(server_pid, SIGUSR1) == -1)
+    {
+        perror("<Bench> kill failed for the server PID");
+        return -1;
+    }
+    int rewritten = 0;
+    for (int i = 0; i < 200 && !rewritten; i++)
+    {
+        usleep(10000);
+        rewritten = stat(path2Metrics, &st) == 0 &&
+                    (st.st_ino != before.st_ino || st.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+                     st.st_mtim.tv_nsec != before.st_mtim.tv_nsec);
+    }
+    FILE *in = rewritten ? fopen(path2Metrics, "r") : NULL;
+    if (!in)
+    {
+        fprintf(stderr, "<Bench> The server did not write %s\n", path2Metrics);
+        return -1;
+    }
+
+    char line[256];
+    int found = 0;
+    unsigned long long value;
+    while (fgets(line, sizeof(line), in))
+    {
+        if (sscanf(line, "sha256_server_cache_hits_total %llu", &value) == 1)
+            *hits = value, found |= 1;
+        else if (sscanf(line, "sha256_server_cache_misses_total %llu", &value) == 1)
+            *misses = value, found |= 2;
+    }
+    fclose(in);
+    return found == 3 ? 0 : -1;
+}
+
+void stop_run(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
@@ -0,0 +1,507 @@
+#include <string.h>
+
+#include "blake3.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BLAKE3_HAVE_X86 1
+#endif
+
+// Domain separation flags
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+// Message word order of each of the 7 rounds (the permutation applied round after round)
+static const uint8_t msg_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+// Input of the last compression of a chunk or parent node: its chaining value or the digest
+typedef struct
+{
+    uint32_t cv[8];
+    uint8_t block[64];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+} output_t;
+
+static uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32(uint8_t *p, uint32_t w)
+{
+    p[0] = (uint8_t)w;
+    p[1] = (uint8_t)(w >> 8);
+    p[2] = (uint8_t)(w >> 16);
+    p[3] = (uint8_t)(w >> 24);
+}
+
+static uint32_t rotr32(uint32_t w, int n) { return (w >> n) | (w << (32 - n)); }
+
+static void g(uint32_t *s, int a, int b, int c, int d, uint32_t mx, uint32_t my)
+{
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+// Portable compression function: cv becomes the first half of the output
+static void compress(uint32_t cv[8], const uint8_t block[64], uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16], s[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = load32(block + 4 * i);
+    memcpy(s, cv, 32);
+    memcpy(s + 8, blake3_iv, 16);
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+#pragma GCC unroll 7
+    for (int r = 0; r < 7; r++)
+    {
+        const uint8_t *x = msg_schedule[r];
+        g(s, 0, 4, 8, 12, m[x[0]], m[x[1]]);
+        g(s, 1, 5, 9, 13, m[x[2]], m[x[3]]);
+        g(s, 2, 6, 10, 14, m[x[4]], m[x[5]]);
+        g(s, 3, 7, 11, 15, m[x[6]], m[x[7]]);
+        g(s, 0, 5, 10, 15, m[x[8]], m[x[9]]);
+        g(s, 1, 6, 11, 12, m[x[10]], m[x[11]]);
+        g(s, 2, 7, 8, 13, m[x[12]], m[x[13]]);
+        g(s, 3, 4, 9, 14, m[x[14]], m[x[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+        cv[i] = s[i] ^ s[i + 8];
+}
+
+static void output_cv(const output_t *o, uint32_t cv[8])
+{
+    memcpy(cv, o->cv, 32);
+    compress(cv, o->block, o->block_len, o->counter, o->flags);
+}
+
+// The root is compressed with output block counter 0, whatever the counter of its chunk
+static void output_root(const output_t *o, uint8_t out[32])
+{
+    uint32_t cv[8];
+    memcpy(cv, o->cv, 32);
+    compress(cv, o->block, o->block_len, 0, o->flags | ROOT);
+    for (int i = 0; i < 8; i++)
+        store32(out + 4 * i, cv[i]);
+}
+
+static void parent_output(output_t *o, const uint32_t left[8], const uint32_t right[8])
+{
+    memcpy(o->cv, blake3_iv, 32);
+    for (int i = 0; i < 8; i++)
+    {
+        store32(o->block + 4 * i, left[i]);
+        store32(o->block + 32 + 4 * i, right[i]);
+    }
+    o->block_len = 64;
+    o->counter = 0;
+    o->flags = PARENT;
+}
+
+#ifdef BLAKE3_HAVE_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f,avx2")))
+
+// 8x8 transpose of 32-bit words: row i of in becomes column i of out
+AVX2_TARGET static inline void transpose8(const __m256i in[8], __m256i out[8])
+{
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_epi32(in[i], in[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(in[i], in[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        out[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+#define ROT16(x) _mm256_shuffle_epi8((x), rot16)
+#define ROT8(x) _mm256_shuffle_epi8((x), rot8)
+#define ROTR256(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+#define G8(a, b, c, d, mx, my)                                      \
+    do                                                              \
+    {                                                               \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), mx);  \
+        v[d] = ROT16(_mm256_xor_si256(v[d], v[a]));                 \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                        \
+        v[b] = ROTR256(_mm256_xor_si256(v[b], v[c]), 12);           \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), my);  \
+        v[d] = ROT8(_mm256_xor_si256(v[d], v[a]));                  \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                        \
+        v[b] = ROTR256(_mm256_xor_si256(v[b], v[c]), 7);            \
+    } while (0)
+
+// Hashes 8 consecutive whole chunks (none of them the root) into their chaining values
+AVX2_TARGET static void hash8_avx2(const uint8_t *data, uint64_t counter, uint32_t cvs[8][8])
+{
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    uint32_t lo[8], hi[8];
+    for (int l = 0; l < 8; l++)
+    {
+        lo[l] = (uint32_t)(counter + l);
+        hi[l] = (uint32_t)((counter + l) >> 32);
+    }
+    const __m256i counter_lo = _mm256_loadu_si256((const __m256i *)lo);
+    const __m256i counter_hi = _mm256_loadu_si256((const __m256i *)hi);
+
+    __m256i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi32((int)blake3_iv[i]);
+
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / 64; b++)
+    {
+        // m[t]: word t of the block of every chunk
+        __m256i rows[8], m[16];
+        for (int half = 0; half < 2; half++)
+        {
+            for (int l = 0; l < 8; l++)
+                rows[l] = _mm256_loadu_si256((const __m256i *)(data + l * BLAKE3_CHUNK_LEN + b * 64 + 32 * half));
+            transpose8(rows, m + 8 * half);
+        }
+
+        int flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / 64 - 1 ? CHUNK_END : 0);
+        __m256i v[16];
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm256_set1_epi32((int)blake3_iv[i]);
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = _mm256_set1_epi32(64);
+        v[15] = _mm256_set1_epi32(flags);
+
+#pragma GCC unroll 7
+        for (int r = 0; r < 7; r++)
+        {
+            const uint8_t *x = msg_schedule[r];
+            G8(0, 4, 8, 12, m[x[0]], m[x[1]]);
+            G8(1, 5, 9, 13, m[x[2]], m[x[3]]);
+            G8(2, 6, 10, 14, m[x[4]], m[x[5]]);
+            G8(3, 7, 11, 15, m[x[6]], m[x[7]]);
+            G8(0, 5, 10, 15, m[x[8]], m[x[9]]);
+            G8(1, 6, 11, 12, m[x[10]], m[x[11]]);
+            G8(2, 7, 8, 13, m[x[12]], m[x[13]]);
+            G8(3, 4, 9, 14, m[x[14]], m[x[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+
+    __m256i out[8];
+    transpose8(h, out);
+    for (int l = 0; l < 8; l++)
+        _mm256_storeu_si256((__m256i *)cvs[l], out[l]);
+}
+
+#define G16(a, b, c, d, mx, my)                                     \
+    do                                                              \
+    {                                                               \
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), mx);  \
+        v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 16);  \
+        v[c] = _mm512_add_epi32(v[c], v[d]);                        \
+        v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 12);  \
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), my);  \
+        v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 8);   \
+        v[c] = _mm512_add_epi32(v[c], v[d]);                        \
+        v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 7);   \
+    } while (0)
+
+// 16-chunk AVX-512 kernel, blocks are transposed 8 chunks at a time
+AVX512_TARGET static void hash16_avx512(const uint8_t *data, uint64_t counter, uint32_t cvs[16][8])
+{
+    uint32_t lo[16], hi[16];
+    for (int l = 0; l < 16; l++)
+    {
+        lo[l] = (uint32_t)(counter + l);
+        hi[l] = (uint32_t)((counter + l) >> 32);
+    }
+    const __m512i counter_lo = _mm512_loadu_si512(lo);
+    const __m512i counter_hi = _mm512_loadu_si512(hi);
+
+    __m512i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm512_set1_epi32((int)blake3_iv[i]);
+
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / 64; b++)
+    {
+        __m256i rows[8], m_lo[16], m_hi[16];
+        __m512i m[16];
+        for (int half = 0; half < 2; half++)
+        {
+            for (int l = 0; l < 8; l++)
+                rows[l] = _mm256_loadu_si256((const __m256i *)(data + l * BLAKE3_CHUNK_LEN + b * 64 + 32 * half));
+            transpose8(rows, m_lo + 8 * half);
+            for (int l = 0; l < 8; l++)
+                rows[l] = _mm256_loadu_si256((const __m256i *)(data + (l + 8) * BLAKE3_CHUNK_LEN + b * 64 + 32 * half));
+            transpose8(rows, m_hi + 8 * half);
+        }
+        for (int t = 0; t < 16; t++)
+            m[t] = _mm512_inserti64x4(_mm512_castsi256_si512(m_lo[t]), m_hi[t], 1);
+
+        int flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / 64 - 1 ? CHUNK_END : 0);
+        __m512i v[16];
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm512_set1_epi32((int)blake3_iv[i]);
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = _mm512_set1_epi32(64);
+        v[15] = _mm512_set1_epi32(flags);
+
+#pragma GCC unroll 7
+        for (int r = 0; r < 7; r++)
+        {
+            const uint8_t *x = msg_schedule[r];
+            G16(0, 4, 8, 12, m[x[0]], m[x[1]]);
+            G16(1, 5, 9, 13, m[x[2]], m[x[3]]);
+            G16(2, 6, 10, 14, m[x[4]], m[x[5]]);
+            G16(3, 7, 11, 15, m[x[6]], m[x[7]]);
+            G16(0, 5, 10, 15, m[x[8]], m[x[9]]);
+            G16(1, 6, 11, 12, m[x[10]], m[x[11]]);
+            G16(2, 7, 8, 13, m[x[12]], m[x[13]]);
+            G16(3, 4, 9, 14, m[x[14]], m[x[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm512_xor_si512(v[i], v[i + 8]);
+    }
+
+    // Lanes 0-7 then 8-15: the half index of the extract must be an immediate, even at -O0
+    __m256i half_h[8], out[8];
+    for (int i = 0; i < 8; i++)
+        half_h[i] = _mm512_extracti64x4_epi64(h[i], 0);
+    transpose8(half_h, out);
+    for (int l = 0; l < 8; l++)
+        _mm256_storeu_si256((__m256i *)cvs[l], out[l]);
+    for (int i = 0; i < 8; i++)
+        half_h[i] = _mm512_extracti64x4_epi64(h[i], 1);
+    transpose8(half_h, out);
+    for (int l = 0; l < 8; l++)
+        _mm256_storeu_si256((__m256i *)cvs[8 + l], out[l]);
+}
+#endif
+
+// Selected kernel: chunks compressed side by side, 1 until blake3_select() runs
+static int blake3_lanes = 1;
+
+void blake3_select(void)
+{
+    blake3_lanes = 1;
+#ifdef BLAKE3_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        blake3_lanes = 16;
+    else if (__builtin_cpu_supports("avx2"))
+        blake3_lanes = 8;
+#endif
+}
+
+const char *blake3_kernel(void) { return blake3_lanes == 16 ? "avx512" : blake3_lanes == 8 ? "avx2" : "portable"; }
+
+static size_t chunk_len(const blake3_hasher_t *h) { return (size_t)h->blocks_compressed * 64 + h->buflen; }
+
+static void chunk_reset(blake3_hasher_t *h, uint64_t chunk_counter)
+{
+    memcpy(h->cv, blake3_iv, 32);
+    h->chunk_counter = chunk_counter;
+    h->buflen = 0;
+    h->blocks_compressed = 0;
+}
+
+// Adds bytes to the current chunk; its last block stays in buf until the chunk is ended
+static void chunk_update(blake3_hasher_t *h, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (h->buflen == 64)
+        {
+            compress(h->cv, h->buf, 64, h->chunk_counter, h->blocks_compressed == 0 ? CHUNK_START : 0);
+            h->blocks_compressed++;
+            h->buflen = 0;
+        }
+        size_t take = 64 - h->buflen < len ? 64 - h->buflen : len;
+        memcpy(h->buf + h->buflen, data, take);
+        h->buflen += take;
+        data += take;
+        len -= take;
+    }
+}
+
+static void chunk_output(const blake3_hasher_t *h, output_t *o)
+{
+    memcpy(o->cv, h->cv, 32);
+    memset(o->block, 0, 64);
+    memcpy(o->block, h->buf, h->buflen);
+    o->block_len = h->buflen;
+    o->counter = h->chunk_counter;
+    o->flags = (h->blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+}
+
+// Pushes the chaining value of a completed chunk, merging the subtrees it completes:
+// one per trailing zero bit of the number of chunks so far
+static void add_chunk_cv(blake3_hasher_t *h, uint32_t cv[8], uint64_t total_chunks)
+{
+    while ((total_chunks & 1) == 0)
+    {
+        output_t o;
+        parent_output(&o, h->cv_stack[--h->cv_stack_len], cv);
+        output_cv(&o, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(h->cv_stack[h->cv_stack_len++], cv, 32);
+}
+
+void blake3_init(blake3_hasher_t *h) { blake3_init_subtree(h, 0); }
+
+void blake3_init_subtree(blake3_hasher_t *h, uint64_t chunk_counter)
+{
+    chunk_reset(h, chunk_counter);
+    h->cv_stack_len = 0;
+}
+
+void blake3_update(blake3_hasher_t *h, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        // A full chunk is only ended when more input follows: the last one may be the root
+        if (chunk_len(h) == BLAKE3_CHUNK_LEN)
+        {
+            output_t o;
+            uint32_t cv[8];
+            chunk_output(h, &o);
+            output_cv(&o, cv);
+            uint64_t total = h->chunk_counter + 1;
+            add_chunk_cv(h, cv, total);
+            chunk_reset(h, total);
+        }
+
+#ifdef BLAKE3_HAVE_X86
+        // Whole chunks followed by more input: compressed side by side
+        int lanes = blake3_lanes == 16 && len > 16 * BLAKE3_CHUNK_LEN ? 16 : blake3_lanes >= 8 ? 8 : 1;
+        if (lanes > 1 && chunk_len(h) == 0 && len > (size_t)lanes * BLAKE3_CHUNK_LEN)
+        {
+            uint32_t cvs[16][8];
+            if (lanes == 16)
+                hash16_avx512(data, h->chunk_counter, cvs);
+            else
+                hash8_avx2(data, h->chunk_counter, cvs);
+            for (int l = 0; l < lanes; l++)
+                add_chunk_cv(h, cvs[l], h->chunk_counter + l + 1);
+            chunk_reset(h, h->chunk_counter + lanes);
+            data += (size_t)lanes * BLAKE3_CHUNK_LEN;
+            len -= (size_t)lanes * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+#endif
+
+        size_t take = BLAKE3_CHUNK_LEN - chunk_len(h);
+        if (take > len)
+            take = len;
+        chunk_update(h, data, take);
+        data += take;
+        len -= take;
+    }
+}
+
+// Merges the current chunk with every subtree on the stack, right to left
+static void final_output(const blake3_hasher_t *h, output_t *o)
+{
+    chunk_output(h, o);
+    for (int i = h->cv_stack_len - 1; i >= 0; i--)
+    {
+        uint32_t cv[8];
+        output_cv(o, cv);
+        parent_output(o, h->cv_stack[i], cv);
+    }
+}
+
+void blake3_final(blake3_hasher_t *h, uint8_t out[32])
+{
+    output_t o;
+    final_output(h, &o);
+    output_root(&o, out);
+}
+
+void blake3_final_cv(blake3_hasher_t *h, uint8_t out[32])
+{
+    output_t o;
+    uint32_t cv[8];
+    final_output(h, &o);
+    output_cv(&o, cv);
+    for (int i = 0; i < 8; i++)
+        store32(out + 4 * i, cv[i]);
+}
+
+// Output of the node over n subtrees: the left child holds the largest power of two below n
+static void node_output(const uint8_t (*cvs)[32], size_t n, output_t *o)
+{
+    size_t left = 1;
+    while (left * 2 < n)
+        left *= 2;
+
+    uint32_t l[8], r[8];
+    output_t child;
+    if (left == 1)
+        for (int i = 0; i < 8; i++)
+            l[i] = load32(cvs[0] + 4 * i);
+    else
+    {
+        node_output(cvs, left, &child);
+        output_cv(&child, l);
+    }
+    if (n - left == 1)
+        for (int i = 0; i < 8; i++)
+            r[i] = load32(cvs[left] + 4 * i);
+    else
+    {
+        node_output(cvs + left, n - left, &child);
+        output_cv(&child, r);
+    }
+    parent_output(o, l, r);
+}
+
+void blake3_root(const uint8_t (*cvs)[32], size_t n, uint8_t out[32])
+{
+    output_t o;
+    node_output(cvs, n, &o);
+    output_root(&o, out);
+}
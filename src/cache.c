@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define CACHE_SHARD_BITS 5
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS) // selected by the high bits of the key hash
+#define CACHE_MIN_CAPACITY 32                // slots per shard, always a power of two
+#define CACHE_MAX_LOAD 70                    // percentage of used slots that triggers a resize
+#define CACHE_MAX_READERS 256                // threads with a reader slot, the others read under the shard lock
+
+// Open addressing slot (linear probing), keyed by inode and kind; used == 0 marks an empty slot
+typedef struct
+{
+    uint32_t hash;       // low bits: home slot; also compared before the key
+    uint8_t used;
+    uint8_t ref;         // CLOCK reference bit, set on every hit
+    unsigned int kind;   // REQ_* flags of the digest
+    file_id_t id;        // dev and ino are the key, the rest validates the digest
+    uint8_t sha256[32];
+} cache_slot_t;
+
+// Slots of a shard, replaced as a whole when the shard grows
+typedef struct
+{
+    size_t capacity; // power of two
+    cache_slot_t slots[];
+} cache_table_t;
+
+// A shard is written under its mutex and read without locks: the seqlock tells readers to retry
+// if a writer modified the table meanwhile, the reader slots keep a replaced table alive until
+// its last reader has left
+typedef struct
+{
+    cache_table_t *table;
+    unsigned int seq;      // odd while a writer modifies the table
+    pthread_mutex_t mutex; // serializes the writers
+    size_t clock_hand;
+    long entries;
+    size_t budget;
+    long evictions;
+    long stale;
+} __attribute__((aligned(64))) cache_shard_t;
+
+// Reader slot of a thread: odd while the thread is inside a lookup
+typedef struct
+{
+    unsigned long state;
+} __attribute__((aligned(64))) cache_reader_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static cache_reader_t readers[CACHE_MAX_READERS];
+static unsigned int reader_count = 0;
+static __thread int reader_index = -1; // -2 if the thread found no free reader slot
+
+// Mixes dev, ino and kind (splitmix64 finalizer)
+static uint32_t hash_key(uint64_t dev, uint64_t ino, unsigned int kind)
+{
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)kind << 56);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static cache_shard_t *shard_of(uint32_t hash) { return &shards[hash >> (32 - CACHE_SHARD_BITS)]; }
+
+static size_t table_bytes(size_t capacity) { return sizeof(cache_table_t) + capacity * sizeof(cache_slot_t); }
+
+static cache_table_t *table_alloc(size_t capacity)
+{
+    cache_table_t *t = calloc(1, table_bytes(capacity));
+    if (t)
+        t->capacity = capacity;
+    return t;
+}
+
+// Marks the calling thread as reading; returns NULL if it has no reader slot
+static cache_reader_t *reader_enter(void)
+{
+    if (reader_index == -1)
+    {
+        unsigned int i = __atomic_fetch_add(&reader_count, 1, __ATOMIC_RELAXED);
+        reader_index = i < CACHE_MAX_READERS ? (int)i : -2;
+    }
+    if (reader_index < 0)
+        return NULL;
+
+    cache_reader_t *r = &readers[reader_index];
+    __atomic_store_n(&r->state, r->state + 1, __ATOMIC_RELAXED);
+    // The odd state must be visible before the table pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return r;
+}
+
+static void reader_exit(cache_reader_t *r) { __atomic_store_n(&r->state, r->state + 1, __ATOMIC_RELEASE); }
+
+// Waits until every lookup that may still hold a replaced table has finished
+static void wait_for_readers(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned int n = __atomic_load_n(&reader_count, __ATOMIC_RELAXED);
+    if (n > CACHE_MAX_READERS)
+        n = CACHE_MAX_READERS;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        unsigned long state = __atomic_load_n(&readers[i].state, __ATOMIC_ACQUIRE);
+        if (state & 1)
+        {
+            while (__atomic_load_n(&readers[i].state, __ATOMIC_ACQUIRE) == state)
+                sched_yield();
+        }
+    }
+}
+
+// Seqlock write section (shard mutex held)
+static void write_begin(cache_shard_t *sh)
+{
+    __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(cache_shard_t *sh) { __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELEASE); }
+
+// Returns the slot holding the key, or the empty slot where it would go (shard mutex held)
+static size_t find_slot(cache_table_t *t, uint32_t hash, uint64_t dev, uint64_t ino, unsigned int kind)
+{
+    size_t mask = t->capacity - 1;
+    size_t i = hash & mask;
+    while (t->slots[i].used)
+    {
+        cache_slot_t *s = &t->slots[i];
+        if (s->hash == hash && s->id.ino == ino && s->id.dev == dev && s->kind == kind)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Lock-free probe: copies the slot of the key into out; the copy may be torn and is only
+// trusted once the seqlock confirms that no writer ran. Returns the slot index or -1.
+static long probe(cache_table_t *t, uint32_t hash, const file_id_t *id, unsigned int kind, cache_slot_t *out)
+{
+    size_t mask = t->capacity - 1;
+    size_t i = hash & mask;
+    for (size_t n = 0; n < t->capacity; n++, i = (i + 1) & mask)
+    {
+        memcpy(out, &t->slots[i], sizeof(*out));
+        if (!out->used)
+            return -1;
+        if (out->hash == hash && out->id.ino == id->ino && out->id.dev == id->dev && out->kind == kind)
+            return (long)i;
+    }
+    return -1;
+}
+
+// Removes slot i and shifts back the following entries of the cluster (write section)
+static void remove_slot(cache_shard_t *sh, size_t i)
+{
+    cache_table_t *t = sh->table;
+    size_t mask = t->capacity - 1;
+    sh->entries--;
+
+    size_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (!t->slots[j].used)
+            break;
+
+        // An entry whose home slot lies cyclically in (i, j] must stay where it is
+        size_t home = t->slots[j].hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+    t->slots[i].used = 0;
+}
+
+// CLOCK: clears reference bits until an unreferenced entry is found, then evicts it (write section)
+static void evict_one(cache_shard_t *sh)
+{
+    cache_table_t *t = sh->table;
+    while (sh->entries > 0)
+    {
+        size_t i = sh->clock_hand;
+        sh->clock_hand = (sh->clock_hand + 1) & (t->capacity - 1);
+        if (!t->slots[i].used)
+            continue;
+        if (__atomic_load_n(&t->slots[i].ref, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&t->slots[i].ref, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        remove_slot(sh, i);
+        sh->evictions++;
+        return;
+    }
+}
+
+// Doubles the table of the shard; returns -1 if it would not fit in the budget or memory is
+// exhausted (shard mutex held). The old table is freed once its readers have left.
+static int grow(cache_shard_t *sh)
+{
+    cache_table_t *old = sh->table;
+    size_t new_capacity = old->capacity * 2;
+    if (table_bytes(new_capacity) > sh->budget)
+        return -1;
+
+    cache_table_t *t = table_alloc(new_capacity);
+    if (!t)
+        return -1;
+
+    for (size_t i = 0; i < old->capacity; i++)
+    {
+        if (!old->slots[i].used)
+            continue;
+        size_t j = old->slots[i].hash & (new_capacity - 1);
+        while (t->slots[j].used)
+            j = (j + 1) & (new_capacity - 1);
+        t->slots[j] = old->slots[i];
+    }
+    __atomic_store_n(&sh->table, t, __ATOMIC_RELEASE);
+    sh->clock_hand = 0;
+
+    wait_for_readers();
+    free(old);
+    return 0;
+}
+
+void file_id_from_stat(file_id_t *id, const struct stat *st)
+{
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = st->st_size;
+    id->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    id->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+int file_id_equal(const file_id_t *a, const file_id_t *b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+void cache_init(size_t cache_budget)
+{
+    // The smallest tables are always allocated, whatever the budget
+    size_t shard_budget = cache_budget / CACHE_SHARDS;
+    if (shard_budget < table_bytes(CACHE_MIN_CAPACITY))
+        shard_budget = table_bytes(CACHE_MIN_CAPACITY);
+
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        cache_shard_t *sh = &shards[s];
+        pthread_mutex_init(&sh->mutex, NULL);
+        sh->budget = shard_budget;
+        sh->table = table_alloc(CACHE_MIN_CAPACITY);
+    }
+}
+
+int cache_lookup(const file_id_t *id, unsigned int kind, uint8_t *sha256)
+{
+    uint32_t hash = hash_key(id->dev, id->ino, kind);
+    cache_shard_t *sh = shard_of(hash);
+    cache_table_t *t;
+    cache_slot_t slot;
+    long i;
+
+    // Threads without a reader slot exclude the writers instead
+    cache_reader_t *r = reader_enter();
+    if (!r)
+        pthread_mutex_lock(&sh->mutex);
+
+    for (;;)
+    {
+        unsigned int seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        t = __atomic_load_n(&sh->table, __ATOMIC_ACQUIRE);
+        i = t ? probe(t, hash, id, kind, &slot) : -1;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    // Same inode but another version of its content: a miss, the next insert replaces the entry
+    int hit = i >= 0 && file_id_equal(&slot.id, id);
+    if (hit)
+    {
+        memcpy(sha256, slot.sha256, 32);
+        // The reference bit is only a hint: it may land on an entry moved meanwhile
+        if (!__atomic_load_n(&t->slots[i].ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&t->slots[i].ref, 1, __ATOMIC_RELAXED);
+    }
+
+    if (r)
+        reader_exit(r);
+    else
+        pthread_mutex_unlock(&sh->mutex);
+    return hit;
+}
+
+int cache_put(const file_id_t *id, unsigned int kind, const uint8_t *sha256)
+{
+    uint32_t hash = hash_key(id->dev, id->ino, kind);
+    cache_shard_t *sh = shard_of(hash);
+
+    pthread_mutex_lock(&sh->mutex);
+    if (!sh->table)
+    {
+        pthread_mutex_unlock(&sh->mutex);
+        return -1;
+    }
+
+    // Keep the load factor below CACHE_MAX_LOAD: grow if the budget allows it, evict otherwise
+    size_t i = find_slot(sh->table, hash, id->dev, id->ino, kind);
+    if (!sh->table->slots[i].used && (size_t)(sh->entries + 1) * 100 > sh->table->capacity * CACHE_MAX_LOAD &&
+        grow(sh) != 0)
+    {
+        write_begin(sh);
+        evict_one(sh);
+        write_end(sh);
+    }
+
+    cache_table_t *t = sh->table;
+    write_begin(sh);
+    i = find_slot(t, hash, id->dev, id->ino, kind);
+    if (t->slots[i].used)
+    {
+        // Existing inode: replace the version and the digest
+        if (!file_id_equal(&t->slots[i].id, id))
+            sh->stale++;
+    }
+    else
+    {
+        t->slots[i].hash = hash;
+        t->slots[i].used = 1;
+        t->slots[i].kind = kind;
+        sh->entries++;
+    }
+    t->slots[i].ref = 0;
+    t->slots[i].id = *id;
+    memcpy(t->slots[i].sha256, sha256, 32);
+    write_end(sh);
+    pthread_mutex_unlock(&sh->mutex);
+    return 0;
+}
+
+void cache_invalidate(const file_id_t *id, unsigned int kind)
+{
+    uint32_t hash = hash_key(id->dev, id->ino, kind);
+    cache_shard_t *sh = shard_of(hash);
+
+    pthread_mutex_lock(&sh->mutex);
+    if (sh->table)
+    {
+        size_t i = find_slot(sh->table, hash, id->dev, id->ino, kind);
+        if (sh->table->slots[i].used && !file_id_equal(&sh->table->slots[i].id, id))
+        {
+            write_begin(sh);
+            remove_slot(sh, i);
+            write_end(sh);
+            sh->stale++;
+        }
+    }
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+void cache_walk(cache_store_entry_fn emit)
+{
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        cache_shard_t *sh = &shards[s];
+        pthread_mutex_lock(&sh->mutex);
+        cache_table_t *t = sh->table;
+        for (size_t i = 0; t && i < t->capacity; i++)
+        {
+            if (t->slots[i].used)
+                emit(&t->slots[i].id, t->slots[i].kind, t->slots[i].sha256);
+        }
+        pthread_mutex_unlock(&sh->mutex);
+    }
+}
+
+void cache_get_stats(cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        cache_shard_t *sh = &shards[s];
+        pthread_mutex_lock(&sh->mutex);
+        if (sh->table)
+        {
+            stats->capacity += sh->table->capacity;
+            stats->bytes += table_bytes(sh->table->capacity);
+        }
+        stats->entries += sh->entries;
+        stats->budget += sh->budget;
+        stats->evictions += sh->evictions;
+        stats->stale += sh->stale;
+        pthread_mutex_unlock(&sh->mutex);
+    }
+}
+
+void cache_cleanup(void)
+{
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        cache_shard_t *sh = &shards[s];
+        pthread_mutex_lock(&sh->mutex);
+        free(sh->table);
+        sh->table = NULL;
+        sh->entries = 0;
+        pthread_mutex_unlock(&sh->mutex);
+    }
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cache_store.h"
+#include "request_response.h"
+
+#define STORE_MAGIC "SHA256LG"
+#define STORE_VERSION 2
+#define STORE_HEADER_SIZE 16
+#define STORE_RECORD_HEAD 8                      // crc32 + payload length
+#define STORE_PAYLOAD_SIZE (5 * 8 + 4 + 32)      // file identity, kind, sha256
+#define STORE_RECORD_SIZE (STORE_RECORD_HEAD + STORE_PAYLOAD_SIZE)
+#define STORE_COMPACT_MIN 4096                   // don't compact logs smaller than this (records)
+
+// Cache file state, the descriptor is used for appends only
+static int store_fd = -1;
+static char store_path[PATH_MAX];
+static long store_records = 0; // records in the file
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Output of the compaction in progress
+static FILE *compact_out = NULL;
+static long compact_records = 0;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+static void crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t *data, size_t len)
+{
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_u64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+// Serializes an entry into rec, returns the record size
+static size_t encode_record(uint8_t *rec, const file_id_t *id, unsigned int kind, const uint8_t *sha256)
+{
+    uint8_t *p = rec + STORE_RECORD_HEAD;
+
+    put_u64(p, id->dev);
+    put_u64(p + 8, id->ino);
+    put_u64(p + 16, id->size);
+    put_u64(p + 24, (uint64_t)id->mtime_ns);
+    put_u64(p + 32, (uint64_t)id->ctime_ns);
+    put_u32(p + 40, kind);
+    memcpy(p + 44, sha256, 32);
+
+    put_u32(rec + 4, STORE_PAYLOAD_SIZE);
+    put_u32(rec, crc32(rec + 4, 4 + STORE_PAYLOAD_SIZE));
+    return STORE_RECORD_SIZE;
+}
+
+// Writes the file header
+static int write_header(int fd)
+{
+    uint8_t header[STORE_HEADER_SIZE] = {0};
+    memcpy(header, STORE_MAGIC, 8);
+    put_u32(header + 8, STORE_VERSION);
+    return write(fd, header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+// Replays the records of an opened cache file, returns the offset where the valid log ends
+static off_t replay(FILE *file, cache_store_entry_fn load)
+{
+    uint8_t rec[STORE_RECORD_SIZE];
+    off_t end = STORE_HEADER_SIZE;
+
+    for (;;)
+    {
+        if (fread(rec, 1, STORE_RECORD_SIZE, file) != STORE_RECORD_SIZE)
+            break;
+        if (get_u32(rec + 4) != STORE_PAYLOAD_SIZE || crc32(rec + 4, 4 + STORE_PAYLOAD_SIZE) != get_u32(rec))
+            break;
+
+        const uint8_t *p = rec + STORE_RECORD_HEAD;
+        file_id_t id;
+        id.dev = get_u64(p);
+        id.ino = get_u64(p + 8);
+        id.size = get_u64(p + 16);
+        id.mtime_ns = (int64_t)get_u64(p + 24);
+        id.ctime_ns = (int64_t)get_u64(p + 32);
+
+        load(&id, get_u32(p + 40), p + 44);
+        store_records++;
+        end += STORE_RECORD_SIZE;
+    }
+    return end;
+}
+
+long cache_store_open(const char *path, cache_store_entry_fn load)
+{
+    pthread_once(&crc_once, crc32_init);
+
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        perror("<Server> open failed for the cache file");
+        return -1;
+    }
+
+    uint8_t header[STORE_HEADER_SIZE];
+    ssize_t bR = read(fd, header, sizeof(header));
+    int valid = bR == sizeof(header) && memcmp(header, STORE_MAGIC, 8) == 0 &&
+                get_u32(header + 8) == STORE_VERSION;
+
+    store_records = 0;
+    if (valid)
+    {
+        FILE *file = fdopen(dup(fd), "r");
+        if (!file)
+        {
+            close(fd);
+            return -1;
+        }
+        fseeko(file, STORE_HEADER_SIZE, SEEK_SET);
+        off_t end = replay(file, load);
+        fclose(file);
+
+        // Drop a torn or corrupted tail so that new records follow valid ones
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > end)
+        {
+            printf("<Server> Cache file %s: dropping %lld bytes of torn records\n",
+                   path, (long long)(st.st_size - end));
+            if (ftruncate(fd, end) == -1)
+                perror("<Server> ftruncate failed for the cache file");
+        }
+    }
+    else if (bR != 0 && (bR < 8 || memcmp(header, STORE_MAGIC, 8) != 0))
+    {
+        // Not a cache file: never overwrite it
+        printf("<Server> %s is not a cache file, it is left untouched\n", path);
+        close(fd);
+        return -1;
+    }
+    else
+    {
+        // New file, or a cache file written by another version: start over
+        if (bR != 0)
+            printf("<Server> Cache file %s has another format version, starting from an empty cache\n", path);
+        if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1 || write_header(fd) != 0)
+        {
+            perror("<Server> failed to initialize the cache file");
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Appends go to the end, whatever the position of the descriptor
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_APPEND) == -1)
+    {
+        perror("<Server> fcntl failed for the cache file");
+        close(fd);
+        return -1;
+    }
+
+    strncpy(store_path, path, PATH_MAX - 1);
+    store_path[PATH_MAX - 1] = '\0';
+    store_fd = fd;
+    return store_records;
+}
+
+void cache_store_append(const file_id_t *id, unsigned int kind, const uint8_t *sha256)
+{
+    if (store_fd == -1)
+        return;
+
+    uint8_t rec[STORE_RECORD_SIZE];
+    size_t len = encode_record(rec, id, kind, sha256);
+
+    // One write() per record: a crash can only tear the last record, which the checksum detects
+    pthread_mutex_lock(&store_mutex);
+    if (store_fd != -1)
+    {
+        if (write(store_fd, rec, len) != (ssize_t)len)
+            perror("<Server> write failed for the cache file");
+        else
+            store_records++;
+    }
+    pthread_mutex_unlock(&store_mutex);
+}
+
+// Compaction emitter: writes an entry to the new file
+static void compact_emit(const file_id_t *id, unsigned int kind, const uint8_t *sha256)
+{
+    uint8_t rec[STORE_RECORD_SIZE];
+    size_t len = encode_record(rec, id, kind, sha256);
+    if (compact_out && fwrite(rec, 1, len, compact_out) == len)
+        compact_records++;
+}
+
+void cache_store_compact(long live_entries, cache_store_walk_fn walk)
+{
+    pthread_mutex_lock(&store_mutex);
+    if (store_fd == -1 || store_records < STORE_COMPACT_MIN || store_records < 2 * live_entries)
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || write_header(fd) != 0 || !(compact_out = fdopen(fd, "w")))
+    {
+        perror("<Server> failed to create the compacted cache file");
+        if (fd != -1)
+            close(fd);
+        unlink(tmp_path);
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+
+    compact_records = 0;
+    walk(compact_emit);
+
+    // The new file must be on disk before it replaces the old one
+    int failed = fflush(compact_out) != 0 || fsync(fd) != 0;
+    fclose(compact_out);
+    compact_out = NULL;
+    if (failed || rename(tmp_path, store_path) == -1)
+    {
+        perror("<Server> failed to replace the cache file");
+        unlink(tmp_path);
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+
+    int new_fd = open(store_path, O_WRONLY | O_APPEND);
+    if (new_fd == -1)
+        perror("<Server> open failed for the compacted cache file");
+    printf("<Server> Cache file %s compacted: %ld -> %ld records\n", store_path, store_records, compact_records);
+    close(store_fd);
+    store_fd = new_fd;
+    store_records = compact_records;
+    pthread_mutex_unlock(&store_mutex);
+}
+
+void cache_store_close(void)
+{
+    pthread_mutex_lock(&store_mutex);
+    if (store_fd != -1)
+    {
+        if (fdatasync(store_fd) == -1)
+            perror("<Server> fdatasync failed for the cache file");
+        close(store_fd);
+        store_fd = -1;
+    }
+    pthread_mutex_unlock(&store_mutex);
+}
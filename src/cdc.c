@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cdc.h"
+#include "cache.h"
+#include "midstate.h"
+#include "read_engine.h"
+#include "request_response.h"
+
+#define CDC_LOCKS 64                      // slot i is protected by lock i % CDC_LOCKS
+#define GEAR_SEED 0x6765617268617368ULL   // "gearhash"
+
+size_t cdc_avg_size = CDC_AVG_DEFAULT;
+
+static size_t min_size, max_size;
+static uint64_t mask_small; // before the average size: more bits, fewer cuts
+static uint64_t mask_large; // after it: fewer bits, more cuts
+static uint64_t gear[256];
+
+static cdc_list_t **slots = NULL;
+static size_t slot_mask = 0;
+static pthread_mutex_t locks[CDC_LOCKS];
+static size_t budget = 0;
+static size_t used = 0; // bytes of the stored lists (atomic)
+static cdc_stats_t stats;
+
+// Streaming chunker: the read engine sink of one pass over the file
+typedef struct
+{
+    sha256_state_t file;  // whole file
+    sha256_state_t chunk; // current chunk
+    sha256_state_t tail;  // whole file at the start of the current chunk
+    sha256_state_t last;  // whole file at the start of the last emitted chunk
+    uint64_t offset;      // file offset of the next byte
+    uint64_t start;       // file offset of the current chunk
+    size_t pos;           // bytes of the current chunk seen by the gear hash
+    uint64_t fp;          // gear hash of the current chunk
+    int cut;              // set by scan() when the chunk ends
+    cdc_list_t *list;
+    size_t capacity;
+} chunker_t;
+
+// Mixes dev and ino (splitmix64 finalizer)
+static size_t slot_of(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (size_t)h & slot_mask;
+}
+
+// Returns the number of bytes up to the end of the current chunk, or len if it goes on
+static size_t scan(chunker_t *ck, const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+    ck->cut = 0;
+
+    // The first min bytes of a chunk are skipped, not rolled
+    if (ck->pos < min_size)
+    {
+        i = min_size - ck->pos < len ? min_size - ck->pos : len;
+        ck->pos += i;
+    }
+
+    uint64_t fp = ck->fp;
+    size_t pos = ck->pos;
+    for (; i < len && pos < cdc_avg_size; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        pos++;
+        if (!(fp & mask_small))
+            goto cut;
+    }
+    for (; i < len; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        pos++;
+        if (!(fp & mask_large) || pos >= max_size)
+            goto cut;
+    }
+    ck->fp = fp;
+    ck->pos = pos;
+    return len;
+
+cut:
+    ck->fp = 0;
+    ck->pos = 0;
+    ck->cut = 1;
+    return i + 1;
+}
+
+// Appends the current chunk to the list and starts the next one
+static int emit(chunker_t *ck)
+{
+    cdc_list_t *list = ck->list;
+    if (list->n == ck->capacity)
+    {
+        size_t capacity = ck->capacity ? ck->capacity * 2 : 64;
+        cdc_chunk_t *grown = realloc(list->chunks, capacity * sizeof(cdc_chunk_t));
+        if (!grown)
+            return -1;
+        list->chunks = grown;
+        ck->capacity = capacity;
+    }
+
+    cdc_chunk_t *chunk = &list->chunks[list->n++];
+    chunk->offset = ck->start;
+    chunk->length = ck->offset - ck->start;
+    sha256_native_final(&ck->chunk, chunk->sha256);
+
+    sha256_native_init(&ck->chunk);
+    ck->last = ck->tail;
+    ck->tail = ck->file;
+    ck->start = ck->offset;
+    return 0;
+}
+
+// Read engine sink: feeds the chunk and whole-file states, cutting at the chunk boundaries
+static int chunk_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    chunker_t *ck = ctx;
+    while (len > 0)
+    {
+        size_t n = scan(ck, data, len);
+        sha256_native_update(&ck->chunk, data, n);
+        sha256_native_update(&ck->file, data, n);
+        ck->offset += n;
+        if (ck->cut && emit(ck) != 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copies the list of the inode into out: returns 1 for this version, 2 for the chunks before
+// the resume point of an older version (only with resume), 0 if there is none
+static int lookup(const file_id_t *id, int resume, cdc_list_t *out)
+{
+    if (!slots)
+        return 0;
+
+    size_t i = slot_of(id->dev, id->ino);
+    int found = 0;
+    pthread_mutex_lock(&locks[i % CDC_LOCKS]);
+    cdc_list_t *e = slots[i];
+    if (e && e->id.dev == id->dev && e->id.ino == id->ino)
+    {
+        int exact = file_id_equal(&e->id, id);
+        if (exact || (resume && e->resume_at != 0 && e->id.size < id->size))
+        {
+            *out = *e;
+            out->n = exact ? e->n : e->n - 1;
+            out->chunks = malloc((out->n ? out->n : 1) * sizeof(cdc_chunk_t));
+            if (out->chunks)
+            {
+                memcpy(out->chunks, e->chunks, out->n * sizeof(cdc_chunk_t));
+                found = exact ? 1 : 2;
+            }
+        }
+    }
+    pthread_mutex_unlock(&locks[i % CDC_LOCKS]);
+    return found;
+}
+
+void cdc_init(size_t nslots, size_t table_budget)
+{
+    int bits = 0;
+    while (((size_t)1 << (bits + 1)) <= cdc_avg_size)
+        bits++;
+    min_size = cdc_avg_size / 4;
+    max_size = cdc_avg_size * 8;
+    mask_small = ~0ULL << (64 - (bits + 2));
+    mask_large = ~0ULL << (64 - (bits - 2));
+
+    // splitmix64 sequence
+    uint64_t x = GEAR_SEED;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+
+    size_t capacity = 64;
+    while (capacity < nslots)
+        capacity *= 2;
+    if (!(slots = calloc(capacity, sizeof(cdc_list_t *))))
+    {
+        printf("<Server> No memory for %zu chunk lists, chunk lists are not kept\n", capacity);
+        return;
+    }
+    slot_mask = capacity - 1;
+    budget = table_budget;
+    for (int i = 0; i < CDC_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+short cdc_digest(const char *filename, const file_id_t *id, int resume, cdc_list_t *list)
+{
+    cdc_list_t saved;
+    int found = lookup(id, resume, &saved);
+    if (found == 1)
+    {
+        *list = saved;
+        list->cached = 1;
+        __atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    memset(list, 0, sizeof(*list));
+    list->id = *id;
+    chunker_t ck = {.list = list};
+    int fd = -1;
+    short errCode = 1; // not resumed
+
+    // Resume from the last chunk if the file has grown, is still append-only and the bytes
+    // before the last chunk are unchanged (see midstate.h)
+    if (found == 2)
+    {
+        uint8_t fp[32];
+        if ((fd = open(filename, O_RDONLY)) != -1 && midstate_append_only(fd) &&
+            midstate_fingerprint(fd, filename, saved.resume_at, fp) == 0 && memcmp(fp, saved.fingerprint, 32) == 0)
+        {
+            list->chunks = saved.chunks;
+            list->n = saved.n;
+            ck.capacity = saved.n;
+            ck.file = saved.tail;
+            ck.tail = saved.tail;
+            ck.offset = ck.start = saved.resume_at;
+            sha256_native_init(&ck.chunk);
+            errCode = read_range(fd, filename, saved.resume_at, id->size - saved.resume_at, chunk_sink, &ck);
+            if (errCode == 0)
+            {
+                __atomic_fetch_add(&stats.resumed, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&stats.bytes_reused, saved.resume_at, __ATOMIC_RELAXED);
+            }
+            else
+                errCode = 1; // shrunk meanwhile: chunk it again from the start
+        }
+        else
+            free(saved.chunks);
+    }
+
+    if (errCode != 0)
+    {
+        cdc_list_free(list);
+        list->n = 0;
+        ck = (chunker_t){.list = list};
+        sha256_native_init(&ck.file);
+        ck.tail = ck.file;
+        sha256_native_init(&ck.chunk);
+        errCode = read_file(filename, chunk_sink, &ck);
+        if (errCode != 0 && errCode != CLOSE_FILE_E)
+        {
+            cdc_list_free(list);
+            if (fd != -1)
+                close(fd);
+            return errCode;
+        }
+    }
+
+    // The end of the file ends the last chunk
+    if (ck.offset > ck.start && emit(&ck) != 0)
+    {
+        cdc_list_free(list);
+        if (fd != -1)
+            close(fd);
+        return READ_FILE_E;
+    }
+    sha256_native_final(&ck.file, list->digest);
+    __atomic_fetch_add(&stats.computed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.chunks, list->n, __ATOMIC_RELAXED);
+
+    // Resume point: the start of the last chunk
+    if (resume && list->n > 1)
+    {
+        list->resume_at = list->chunks[list->n - 1].offset;
+        list->tail = ck.last;
+        if (fd == -1)
+            fd = open(filename, O_RDONLY);
+        if (fd == -1 || !midstate_append_only(fd) ||
+            midstate_fingerprint(fd, filename, list->resume_at, list->fingerprint) != 0)
+            list->resume_at = 0;
+    }
+    if (fd != -1)
+        close(fd);
+    return errCode;
+}
+
+void cdc_put(cdc_list_t *list)
+{
+    cdc_list_t *e = slots ? malloc(sizeof(cdc_list_t)) : NULL;
+    size_t bytes = sizeof(cdc_list_t) + list->n * sizeof(cdc_chunk_t);
+    if (!e)
+    {
+        cdc_list_free(list);
+        return;
+    }
+    *e = *list;
+    e->cached = 0;
+
+    size_t i = slot_of(list->id.dev, list->id.ino);
+    pthread_mutex_lock(&locks[i % CDC_LOCKS]);
+    cdc_list_t *old = slots[i];
+    size_t old_bytes = old ? sizeof(cdc_list_t) + old->n * sizeof(cdc_chunk_t) : 0;
+    if (__atomic_load_n(&used, __ATOMIC_RELAXED) - old_bytes + bytes > budget)
+    {
+        pthread_mutex_unlock(&locks[i % CDC_LOCKS]);
+        free(e);
+        cdc_list_free(list);
+        __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slots[i] = e;
+    __atomic_fetch_add(&used, bytes - old_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&locks[i % CDC_LOCKS]);
+
+    if (old)
+    {
+        free(old->chunks);
+        free(old);
+    }
+    list->chunks = NULL;
+    __atomic_fetch_add(&stats.stored, 1, __ATOMIC_RELAXED);
+}
+
+void cdc_list_free(cdc_list_t *list)
+{
+    free(list->chunks);
+    list->chunks = NULL;
+}
+
+void cdc_get_stats(cdc_stats_t *out)
+{
+    out->computed = __atomic_load_n(&stats.computed, __ATOMIC_RELAXED);
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->resumed = __atomic_load_n(&stats.resumed, __ATOMIC_RELAXED);
+    out->stored = __atomic_load_n(&stats.stored, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    out->bytes_reused = __atomic_load_n(&stats.bytes_reused, __ATOMIC_RELAXED);
+    out->chunks = __atomic_load_n(&stats.chunks, __ATOMIC_RELAXED);
+}
+
+void cdc_cleanup(void)
+{
+    if (!slots)
+        return;
+    for (size_t i = 0; i <= slot_mask; i++)
+    {
+        if (slots[i])
+        {
+            free(slots[i]->chunks);
+            free(slots[i]);
+        }
+    }
+    free(slots);
+    slots = NULL;
+}
@@ -6,8 +6,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <stdint.h>
+#include <glob.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "request_response.h"
+#include "shm_ring.h"
 #include "errExit.h"
 
 // Function prototypes for cleanup
@@ -18,29 +23,230 @@ void quit(int sig);
 
 /**
  * Wrapper function for atexit to ensure cleanup on normal process termination.
- * Calls quit with a default signal value.
+ * Removes the client FIFO and lets exit() flush stdout and keep the exit status.
  */
 void quit_atexit(void);
 
 // FIFO paths for handling SHA256 requests
 char *path2ServerFIFO = "/tmp/fifo_server_SHA256";
 char *baseClientFIFO = "/tmp/fifo_client_SHA256."; // completed with the process ID
+char *path2ServerSocket = "/tmp/socket_server_SHA256";
+
+// -u: requests and responses go through a connection to the server socket instead of FIFOs
+int use_socket = 0;
+
+// -s: requests and responses go through the shared memory rings of the server
+int use_ring = 0;
 
 #define MAX 100
 
+#define BATCH_WINDOW 128     // requests in flight in batch mode (-w)
+#define BATCH_WINDOW_MAX 512 // the responses in flight must fit in the client FIFO
+
+// Paths of batch mode: manifest, then the command line arguments (expanded as glob patterns,
+// "-" reads stdin), or stdin if there are neither
+typedef struct
+{
+    char **args;    // arguments not yet expanded
+    int nargs;      // number of arguments
+    int arg;        // next argument
+    int literal;    // the arguments are pathnames, not patterns
+    glob_t matches; // expansion of the current argument
+    size_t match;   // next match
+    int globbing;   // matches is valid
+    FILE *list;     // manifest or stdin being read, NULL if none
+    int delim;      // '\n', or '\0' with -0
+    char *line;     // last line read from list
+    size_t line_cap;
+} batch_input_t;
+
+// Request in flight in batch mode; the slot of request ID id is id % window
+typedef struct
+{
+    char *path; // NULL for a free slot
+    uint32_t id;
+} batch_slot_t;
+
+/**
+ * Sends a v1 request (struct Request) for pathname, or a v1.1 request (struct RequestV11) if
+ * flags is not 0.
+ */
+void send_request_v1(int serverFIFO, const char *pathname, unsigned int flags);
+
+/**
+ * Sends v2 requests for all the pathnames, packing as many as fit in each message.
+ */
+void send_requests_v2(int serverFIFO, char **pathnames, int count, unsigned int flags);
+
+/**
+ * Asks the server to close the descriptor of the session.
+ */
+void send_session_end(int serverFIFO);
+
+/**
+ * Writes the v2 message being built, if any, and resets len to 0.
+ */
+void flush_request(int serverFIFO, uint8_t *msg, struct RequestV2 *header, size_t *len);
+
+/**
+ * Returns the next path of the batch input, or NULL at the end.
+ * The path is valid until the next call.
+ */
+const char *next_path(batch_input_t *in);
+
+/**
+ * Hashes every path of the batch input keeping up to window requests in flight, and prints the
+ * results as they arrive in the format of sha256sum. Returns 0 if all succeeded, -1 otherwise.
+ */
+int run_batch(int serverFIFO, int clientFIFO, batch_input_t *in, unsigned int flags, int window);
+
+/**
+ * Hashes every path of the input through the shared memory rings, keeping up to window requests
+ * in flight; prints sha256sum lines in batch mode. Returns 0 if all succeeded, -1 otherwise.
+ */
+int run_ring(batch_input_t *in, unsigned int flags, int window, int batch);
+
+/**
+ * Connects to the server socket; returns the descriptor.
+ */
+int connect_server(void);
+
+/**
+ * Reads a v2 response and its digest as hex digits (65 bytes) into hex. The path of a directory
+ * entry (RESP_ENTRY) or the chunk records (RESP_CHUNKS) are copied into entry (PROTO_MSG_MAX
+ * bytes), which is NULL if none is expected.
+ */
+void read_response_v2(int clientFIFO, struct ResponseV2 *header, char *hex, char *entry);
+
+/**
+ * Prints a file of a directory (entry relative to dir), or the directory itself for an empty
+ * entry, as a sha256sum line; returns 0 on success, -1 on error.
+ */
+int print_entry(const char *dir, const char *entry, short errCode, const char *hex);
+
+/**
+ * Prints a result of batch mode as a sha256sum line; returns 0 on success, -1 on error.
+ */
+int print_sum(const char *pathname, short errCode, const char *hex);
+
+/**
+ * Prints the records of a RESP_CHUNKS response, one "<digest> <offset> <length>  <path>" line
+ * per chunk.
+ */
+void print_chunks(const char *pathname, const void *records, size_t n);
+
+/**
+ * Reads exactly len bytes from fd.
+ */
+void read_full(int fd, void *buf, size_t len);
+
+/**
+ * Prints the digest or the error of a response; returns 0 on success, -1 on error.
+ */
+int print_result(const char *pathname, short errCode, const char *hex, unsigned int flags);
+
 int main(int argc, char *argv[])
 {
-    // Check command line arguments: expects a single pathname
-    if (argc != 2)
+    // Check command line arguments: expects pathnames, -t asks for the tree SHA-256,
+    // -r for raw digests on the wire, -1 uses the v1 protocol (one pathname).
+    // -u connects to the server socket instead of using FIFOs, -s uses the shared memory rings.
+    // -b is batch mode: paths from a manifest (-f, implies -b), glob patterns or stdin,
+    // -w requests in flight, -0 for NUL-separated lists, output in the format of sha256sum.
+    // -d hashes directories on the server: a sha256sum line per file, then one for the directory
+    // -a selects the digest algorithm: sha256 (default), sha512-256 or blake3
+    // -k asks for the content-defined chunks of the files: a line per chunk, then a sha256sum line
+    unsigned int flags = 0;
+    int v1 = 0, batch = 0, directory = 0, chunks = 0, window = BATCH_WINDOW;
+    batch_input_t input = {.delim = '\n'};
+    const char *manifest = NULL;
+    int opt, bad_alg = 0;
+    while ((opt = getopt(argc, argv, "01a:bdf:krstuw:")) != -1)
+    {
+        if (opt == 'a')
+        {
+            flags &= ~REQ_ALG_MASK;
+            if (strcmp(optarg, "sha512-256") == 0)
+                flags |= REQ_ALG_SHA512_256;
+            else if (strcmp(optarg, "blake3") == 0)
+                flags |= REQ_ALG_BLAKE3;
+            else if (strcmp(optarg, "sha256") != 0)
+                bad_alg = 1;
+        }
+        else if (opt == 'd')
+            flags |= REQ_DIRECTORY, directory = 1;
+        else if (opt == 'k')
+            flags |= REQ_CHUNKS, chunks = 1;
+        else if (opt == 't')
+            flags |= REQ_TREE_HASH;
+        else if (opt == 'r')
+            flags |= REQ_RAW_DIGEST;
+        else if (opt == '1')
+            v1 = 1;
+        else if (opt == 'b')
+            batch = 1;
+        else if (opt == 'f')
+            manifest = optarg, batch = 1;
+        else if (opt == 'w')
+            window = atoi(optarg), batch = 1;
+        else if (opt == '0')
+            input.delim = '\0';
+        else if (opt == 'u')
+            use_socket = 1;
+        else if (opt == 's')
+            use_ring = 1;
+        else
+            break;
+    }
+    int count = argc - optind;
+    if (opt != -1 || bad_alg || ((flags & REQ_TREE_HASH) && (flags & REQ_ALG_MASK) != REQ_ALG_SHA256) ||
+        (!batch && count < 1) || (v1 && (batch || count != 1)) || window < 1 ||
+        window > BATCH_WINDOW_MAX || (use_ring && (use_socket || v1)) || (directory && (batch || v1 || use_ring)) ||
+        (chunks && (batch || v1 || use_ring || directory || (flags & REQ_KIND_MASK))))
     {
-        printf("Usage: %s <pathname>\n", argv[0]);
+        printf("Usage: %s [-1] [-r] [-t|-a alg] [-s|-u] <pathname>...\n"
+               "       %s -b [-0] [-r] [-t|-a alg] [-s|-u] [-w window] [-f manifest] [pattern|-]...\n"
+               "       %s -d [-r] [-t|-a alg] [-u] <directory>...\n"
+               "       %s -k [-u] <pathname>...\n"
+               "       alg: sha256 (default), sha512-256, blake3\n",
+               argv[0], argv[0], argv[0], argv[0]);
         return 0;
     }
+    int quiet = batch || directory || chunks; // only sha256sum lines on stdout
+    char **pathnames = argv + optind;
+
+    if (batch)
+    {
+        static char *stdin_only[] = {"-"};
+        input.args = count > 0 || manifest ? pathnames : stdin_only;
+        input.nargs = count > 0 || manifest ? count : 1;
+        if (manifest)
+        {
+            input.list = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+            if (!input.list)
+                errExit("<Client> fopen: failed to open the manifest");
+        }
+    }
+
+    // Shared memory: no FIFO and no socket, the paths of the command line are taken as they are
+    if (use_ring)
+    {
+        if (!batch)
+        {
+            input.args = pathnames;
+            input.nargs = count;
+            input.literal = 1;
+        }
+        return run_ring(&input, flags & REQ_KIND_MASK, window, batch) ? EXIT_FAILURE : 0;
+    }
 
-    if (strlen(argv[1]) >= PATH_MAX)
+    for (int i = 0; i < count && !batch; i++)
     {
-        fprintf(stderr, "Error: pathname too long (max %d characters)\n", PATH_MAX - 1);
-        exit(EXIT_FAILURE);
+        size_t max = v1 ? PATH_MAX - 1 : PROTO_V2_PATH_MAX;
+        if (strlen(pathnames[i]) > max)
+        {
+            fprintf(stderr, "Error: pathname too long (max %zu characters)\n", max);
+            exit(EXIT_FAILURE);
+        }
     }
 
     // Set a signal handler for SIGINT, SIGTERM, SIGHUP, SIGQUIT and atexit to perform cleanup
@@ -50,66 +256,565 @@ int main(int argc, char *argv[])
     signal(SIGQUIT, quit);
     atexit(quit_atexit);
 
-    // Create the client FIFO in /tmp
+    // With a connection, the responses come back on the socket of the requests
+    int serverFIFO, clientFIFO, clientFIFO_extra = -1;
     char path2ClientFIFO[PATH_MAX];
-    sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, getpid());
+    if (use_socket)
+    {
+        serverFIFO = clientFIFO = connect_server();
+        if (!quiet)
+            printf("<Client> Connected to server socket %s\n", path2ServerSocket);
+    }
+    else
+    {
+        // Create the client FIFO in /tmp
+        sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, getpid());
 
-    printf("<Client> Creating FIFO %s...\n", path2ClientFIFO);
-    // // Create the FIFO with the following permissions:
-    // user: read, write; group: write; other: no permission
-    if (mkfifo(path2ClientFIFO, S_IRUSR | S_IWUSR | S_IWGRP) == -1)
-        errExit("<Client> mkfifo: failed to create client FIFO");
+        if (!quiet)
+            printf("<Client> Creating FIFO %s...\n", path2ClientFIFO);
+        // // Create the FIFO with the following permissions:
+        // user: read, write; group: write; other: no permission
+        if (mkfifo(path2ClientFIFO, S_IRUSR | S_IWUSR | S_IWGRP) == -1)
+            errExit("<Client> mkfifo: failed to create client FIFO");
 
-    printf("<Client> FIFO %s created!\n", path2ClientFIFO);
+        if (!quiet)
+            printf("<Client> FIFO %s created!\n", path2ClientFIFO);
 
-    // Open the server FIFO to send a request
-    printf("<Client> Opening server FIFO %s...\n", path2ServerFIFO);
-    int serverFIFO = open(path2ServerFIFO, O_WRONLY);
-    if (serverFIFO == -1)
-        errExit("<Client> open: failed to open server FIFO");
+        // Open the client FIFO before sending the requests, so that the server never waits for
+        // the reader: non-blocking open, then back to blocking reads
+        if (!quiet)
+            printf("<Client> Opening client FIFO %s...\n", path2ClientFIFO);
+        clientFIFO = open(path2ClientFIFO, O_RDONLY | O_NONBLOCK);
+        if (clientFIFO == -1 || fcntl(clientFIFO, F_SETFL, 0) == -1)
+            errExit("<Client> open: failed to open client FIFO");
 
-    // Prepare the request
-    struct Request request;
-    request.cPid = getpid();
-    strncpy(request.pathname, argv[1], sizeof(request.pathname) - 1);
-    request.pathname[sizeof(request.pathname) - 1] = '\0';
+        // Keep a writer open so that reads block between two responses instead of returning
+        // end of file when the server closes its descriptor
+        clientFIFO_extra = open(path2ClientFIFO, O_WRONLY);
+        if (clientFIFO_extra == -1)
+            errExit("<Client> open: failed to open extra write descriptor for client FIFO");
 
-    // Send the request through the server FIFO
-    printf("<Client> Sending request for file: %s\n", request.pathname);
-    // struct Request is smaller than PIPE_BUF so read/write are atomic
-    if (write(serverFIFO, &request, sizeof(request)) != sizeof(struct Request))
-        errExit("<Client> write: failed to write request to server FIFO");
+        // Open the server FIFO to send a request
+        if (!quiet)
+            printf("<Client> Opening server FIFO %s...\n", path2ServerFIFO);
+        serverFIFO = open(path2ServerFIFO, O_WRONLY);
+        if (serverFIFO == -1)
+            errExit("<Client> open: failed to open server FIFO");
+    }
 
-    // Open the client FIFO to receive the response
-    printf("<Client> Opening client FIFO %s...\n", path2ClientFIFO);
-    int clientFIFO = open(path2ClientFIFO, O_RDONLY);
-    if (clientFIFO == -1)
-        errExit("<Client> open: failed to open client FIFO");
+    // Send the requests through the server FIFO; v2 requests are pipelined in a session
+    int failed = 0;
+    if (batch)
+        failed = run_batch(serverFIFO, clientFIFO, &input, flags | REQ_SESSION, window);
+    else if (v1)
+        send_request_v1(serverFIFO, pathnames[0], flags & REQ_KIND_MASK);
+    else
+        send_requests_v2(serverFIFO, pathnames, count, flags | REQ_SESSION);
 
-    // Read the response from the server
-    struct Response response;
-    if (read(clientFIFO, &response, sizeof(struct Response)) != sizeof(struct Response))
-        errExit("<Client> read: failed to read response from client FIFO");
+    // Read the responses from the server, in any order; the files of a directory come before
+    // the response of the directory
+    int received = 0;
+    while (received < count && !batch)
+    {
+        if (v1)
+        {
+            struct Response response;
+            read_full(clientFIFO, &response, sizeof(struct Response));
+            failed |= print_result(pathnames[0], response.errCode, response.hash, flags);
+            received++;
+            continue;
+        }
 
-    if (response.errCode != 0 && response.errCode != CLOSE_FILE_E)
-        errExit(get_error_message(response.errCode));
+        struct ResponseV2 header;
+        char hex[65];
+        char entry[PROTO_MSG_MAX];
+        read_response_v2(clientFIFO, &header, hex, directory || chunks ? entry : NULL);
+        if (header.id >= (uint32_t)count)
+            errExit("<Client> read: invalid response from the server");
+        if (header.flags & RESP_CHUNKS)
+        {
+            print_chunks(pathnames[header.id], entry,
+                         (header.length - sizeof(header)) / sizeof(struct ChunkV2));
+            continue;
+        }
+        if (header.flags & RESP_ENTRY)
+        {
+            failed |= print_entry(pathnames[header.id], entry, header.errCode, hex);
+            continue;
+        }
+        received++;
+        if (directory)
+            failed |= print_entry(pathnames[header.id], "", header.errCode, hex);
+        else if (chunks)
+            failed |= print_sum(pathnames[header.id], header.errCode, hex);
+        else
+            failed |= print_result(pathnames[header.id], header.errCode, hex, flags);
+    }
 
-    // Print the result
-    printf("<Client> The SHA256 is:\n\n-->  %s  <--\n\n", response.hash);
+    // Closing the connection is enough for the server
+    if (use_socket)
+    {
+        close(clientFIFO);
+        return failed ? EXIT_FAILURE : 0;
+    }
 
-    if (response.errCode == CLOSE_FILE_E)
-        fprintf(stderr, "%s", get_error_message(response.errCode));
+    // Every response is in: the server can close its descriptor
+    if (!v1)
+        send_session_end(serverFIFO);
 
     // Close the client FIFO
-    if (close(clientFIFO) == -1)
+    if (close(clientFIFO) == -1 || close(clientFIFO_extra) == -1)
         errExit("<Client> close: failed to close client FIFO");
 
     // Remove the client FIFO from the file system
     if (unlink(path2ClientFIFO) == -1)
         errExit("<Client> unlink: failed to remove client FIFO");
 
-    printf("<Client> %s closed and removed from the filesystem\n", path2ClientFIFO);
+    if (!quiet)
+        printf("<Client> %s closed and removed from the filesystem\n", path2ClientFIFO);
+
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// Sends the fixed-size v1 request, v1.1 if it carries flags
+void send_request_v1(int serverFIFO, const char *pathname, unsigned int flags)
+{
+    // Prepare the request
+    struct RequestV11 request;
+    memset(&request, 0, sizeof(request));
+    request.magic = PROTO_V11_MAGIC;
+    request.cPid = getpid();
+    request.flags = flags;
+    strncpy(request.pathname, pathname, sizeof(request.pathname) - 1);
+
+    // Without flags the request is a plain struct Request, which every server understands
+    struct Request plain;
+    const void *msg = &request;
+    size_t len = sizeof(request);
+    if (flags == 0)
+    {
+        plain.cPid = request.cPid;
+        memcpy(plain.pathname, request.pathname, sizeof(plain.pathname));
+        msg = &plain, len = sizeof(plain);
+    }
+
+    printf("<Client> Sending request for file: %s\n", request.pathname);
+    // The request is larger than PIPE_BUF: the write may interleave with other clients
+    if (write(serverFIFO, msg, len) != (ssize_t)len)
+        errExit("<Client> write: failed to write request to server FIFO");
+}
+
+// Packs the pathnames into messages of at most PROTO_MSG_MAX bytes, each written atomically
+void send_requests_v2(int serverFIFO, char **pathnames, int count, unsigned int flags)
+{
+    uint8_t msg[PROTO_MSG_MAX];
+    int i = 0;
+    while (i < count)
+    {
+        // The request ID of a path is its position on the command line
+        struct RequestV2 header = {.magic = PROTO_V2_MAGIC, .cPid = getpid(), .flags = flags, .id = i};
+        size_t len = sizeof(header);
+        while (i < count && header.count < UINT16_MAX)
+        {
+            uint16_t path_len = strlen(pathnames[i]);
+            if (len + sizeof(path_len) + path_len > sizeof(msg))
+                break;
+            memcpy(msg + len, &path_len, sizeof(path_len));
+            memcpy(msg + len + sizeof(path_len), pathnames[i], path_len);
+            len += sizeof(path_len) + path_len;
+            header.count++;
+            if (!(flags & (REQ_DIRECTORY | REQ_CHUNKS)))
+                printf("<Client> Sending request for file: %s\n", pathnames[i]);
+            i++;
+        }
+        header.length = len;
+        memcpy(msg, &header, sizeof(header));
+
+        if (write(serverFIFO, msg, len) != (ssize_t)len)
+            errExit("<Client> write: failed to write request to server FIFO");
+    }
+}
+
+// Writes the message being built
+void flush_request(int serverFIFO, uint8_t *msg, struct RequestV2 *header, size_t *len)
+{
+    if (*len == 0)
+        return;
+    header->length = *len;
+    memcpy(msg, header, sizeof(*header));
+    if (write(serverFIFO, msg, *len) != (ssize_t)*len)
+        errExit("<Client> write: failed to write request to server FIFO");
+    *len = 0;
+}
+
+// Walks the manifest, then the arguments, expanding patterns and reading lists as they come
+const char *next_path(batch_input_t *in)
+{
+    for (;;)
+    {
+        if (in->list)
+        {
+            ssize_t n = getdelim(&in->line, &in->line_cap, in->delim, in->list);
+            if (n > 0)
+            {
+                if (in->line[n - 1] == in->delim)
+                    in->line[--n] = '\0';
+                if (n > 0) // skip empty lines
+                    return in->line;
+                continue;
+            }
+            if (ferror(in->list))
+                errExit("<Client> getdelim: failed to read the list of paths");
+            if (in->list != stdin)
+                fclose(in->list);
+            in->list = NULL;
+        }
+
+        if (in->globbing)
+        {
+            if (in->match < in->matches.gl_pathc)
+                return in->matches.gl_pathv[in->match++];
+            globfree(&in->matches);
+            in->globbing = 0;
+        }
+
+        if (in->arg >= in->nargs)
+        {
+            free(in->line);
+            in->line = NULL;
+            return NULL;
+        }
+        const char *arg = in->args[in->arg++];
+        if (in->literal)
+            return arg;
+        if (strcmp(arg, "-") == 0)
+        {
+            in->list = stdin;
+            continue;
+        }
+        // A pattern without match is sent as is, and the server reports the error
+        if (glob(arg, GLOB_NOCHECK, NULL, &in->matches) != 0)
+            errExit("<Client> glob: failed to expand a pattern");
+        in->globbing = 1;
+        in->match = 0;
+    }
+}
+
+// Keeps the window full: requests are packed into messages while there is room, then one
+// response is read, which frees a slot for the next path
+int run_batch(int serverFIFO, int clientFIFO, batch_input_t *in, unsigned int flags, int window)
+{
+    batch_slot_t *slots = calloc(window, sizeof(batch_slot_t));
+    if (!slots)
+        errExit("<Client> calloc: failed to allocate the batch window");
+
+    uint8_t msg[PROTO_MSG_MAX];
+    struct RequestV2 header;
+    size_t len = 0; // 0 if no message is being built
+    uint32_t next_id = 0;
+    int inflight = 0, failed = 0, end = 0;
+
+    while (!end || inflight > 0)
+    {
+        while (!end && inflight < window)
+        {
+            const char *path = next_path(in);
+            if (!path)
+            {
+                end = 1;
+                break;
+            }
+            uint16_t path_len = strnlen(path, PROTO_V2_PATH_MAX + 1);
+            if (path_len > PROTO_V2_PATH_MAX)
+            {
+                fprintf(stderr, "%s: pathname too long (max %zu characters)\n", path, PROTO_V2_PATH_MAX);
+                failed = -1;
+                continue;
+            }
+
+            // The IDs of a message are consecutive: skip the slot of a request still in flight
+            while (slots[next_id % window].path)
+            {
+                flush_request(serverFIFO, msg, &header, &len);
+                next_id++;
+            }
+            if (len + sizeof(path_len) + path_len > sizeof(msg))
+                flush_request(serverFIFO, msg, &header, &len);
+            if (len == 0)
+            {
+                header = (struct RequestV2){.magic = PROTO_V2_MAGIC, .cPid = getpid(), .flags = flags, .id = next_id};
+                len = sizeof(header);
+            }
+            memcpy(msg + len, &path_len, sizeof(path_len));
+            memcpy(msg + len + sizeof(path_len), path, path_len);
+            len += sizeof(path_len) + path_len;
+            header.count++;
+
+            batch_slot_t *slot = &slots[next_id % window];
+            slot->path = strdup(path);
+            if (!slot->path)
+                errExit("<Client> strdup: failed to allocate a pathname");
+            slot->id = next_id++;
+            inflight++;
+        }
+        flush_request(serverFIFO, msg, &header, &len);
+        if (inflight == 0)
+            continue;
+
+        struct ResponseV2 response;
+        char hex[65];
+        read_response_v2(clientFIFO, &response, hex, NULL);
+        batch_slot_t *slot = &slots[response.id % window];
+        if (!slot->path || slot->id != response.id)
+            errExit("<Client> read: invalid response from the server");
+        failed |= print_sum(slot->path, response.errCode, hex);
+        free(slot->path);
+        slot->path = NULL;
+        inflight--;
+    }
+
+    free(slots);
+    return failed;
+}
 
+// Same window as run_batch(), but a request ID is any free slot: the rings carry one path per request
+int run_ring(batch_input_t *in, unsigned int flags, int window, int batch)
+{
+    shm_ring_client_t *ring = shm_ring_attach(SHM_RING_NAME);
+    if (!ring)
+        errExit("<Client> shm_open: failed to attach to the shared memory rings");
+
+    // The completion ring of the client must never fill up
+    if (window > SHM_CQ_SLOTS)
+        window = SHM_CQ_SLOTS;
+    char **paths = calloc(window, sizeof(char *));
+    uint32_t *free_ids = malloc(window * sizeof(uint32_t));
+    if (!paths || !free_ids)
+        errExit("<Client> calloc: failed to allocate the batch window");
+    int nfree = window;
+    for (int i = 0; i < window; i++)
+        free_ids[i] = window - 1 - i;
+
+    int inflight = 0, failed = 0, end = 0;
+    while (!end || inflight > 0)
+    {
+        while (!end && inflight < window)
+        {
+            const char *path = next_path(in);
+            if (!path)
+            {
+                end = 1;
+                break;
+            }
+            if (strlen(path) >= PATH_MAX)
+            {
+                fprintf(stderr, "%s: pathname too long (max %d characters)\n", path, PATH_MAX - 1);
+                failed = -1;
+                continue;
+            }
+
+            uint32_t id = free_ids[--nfree];
+            paths[id] = strdup(path);
+            if (!paths[id])
+                errExit("<Client> strdup: failed to allocate a pathname");
+            if (shm_ring_submit(ring, id, flags, path) != 0)
+                errExit("<Client> submit: the server is gone");
+            inflight++;
+        }
+        if (inflight == 0)
+            continue;
+
+        shm_completion_t completion;
+        char hex[65];
+        if (shm_ring_wait(ring, &completion) != 0)
+            errExit("<Client> wait: the server is gone");
+        if (completion.id >= (uint32_t)window || !paths[completion.id])
+            errExit("<Client> read: invalid response from the server");
+        for (int i = 0; i < 32; i++)
+            sprintf(hex + (i * 2), "%02x", completion.sha256[i]);
+
+        char *path = paths[completion.id];
+        if (batch)
+            failed |= print_sum(path, completion.errCode, hex);
+        else
+            failed |= print_result(path, completion.errCode, hex, flags);
+        free(path);
+        paths[completion.id] = NULL;
+        free_ids[nfree++] = completion.id;
+        inflight--;
+    }
+
+    shm_ring_detach(ring);
+    free(paths);
+    free(free_ids);
+    return failed;
+}
+
+// Sends a message without paths that ends the session
+void send_session_end(int serverFIFO)
+{
+    struct RequestV2 header = {.magic = PROTO_V2_MAGIC, .length = sizeof(header), .cPid = getpid(),
+                               .flags = REQ_SESSION_END};
+    if (write(serverFIFO, &header, sizeof(header)) != sizeof(header))
+        errExit("<Client> write: failed to write request to server FIFO");
+}
+
+// Reads until len bytes are received: responses may be split or merged by the pipe
+void read_full(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t bR = read(fd, (uint8_t *)buf + got, len - got);
+        if (bR <= 0)
+            errExit("<Client> read: failed to read response from client FIFO");
+        got += bR;
+    }
+}
+
+// Connects a SOCK_SEQPACKET socket: each write is one request message, each read one response
+int connect_server(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path2ServerSocket, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        errExit("<Client> connect: failed to connect to the server socket");
+    return fd;
+}
+
+// Reads the header, checks it and converts a raw digest to hex digits
+void read_response_v2(int clientFIFO, struct ResponseV2 *header, char *hex, char *entry)
+{
+    uint8_t body[PROTO_MSG_MAX];
+    if (use_socket)
+    {
+        // A packet must be read whole: the part that does not fit in the buffer is discarded
+        uint8_t packet[PROTO_MSG_MAX];
+        ssize_t n = read(clientFIFO, packet, sizeof(packet));
+        if (n < (ssize_t)sizeof(*header))
+            errExit("<Client> read: failed to read response from the server socket");
+        memcpy(header, packet, sizeof(*header));
+        if (header->length != n)
+            errExit("<Client> read: invalid response from the server");
+        memcpy(body, packet + sizeof(*header), n - sizeof(*header));
+    }
+    else
+        read_full(clientFIFO, header, sizeof(*header));
+    if (header->magic != PROTO_V2_MAGIC || header->digest_len > 64 || header->length > PROTO_MSG_MAX ||
+        header->length < sizeof(*header) + header->digest_len)
+        errExit("<Client> read: invalid response from the server");
+
+    // Only a directory entry carries a path after its digest, and chunks records instead of it
+    size_t path_len = header->length - sizeof(*header) - header->digest_len;
+    if ((header->flags & RESP_ENTRY) ? !entry
+        : (header->flags & RESP_CHUNKS) ? !entry || header->digest_len != 0 || path_len % sizeof(struct ChunkV2) != 0
+                                        : path_len != 0)
+        errExit("<Client> read: invalid response from the server");
+    if (!use_socket)
+        read_full(clientFIFO, body, header->length - sizeof(*header));
+    if (header->flags & RESP_CHUNKS)
+    {
+        memcpy(entry, body, path_len);
+        return;
+    }
+    if (header->flags & RESP_ENTRY)
+    {
+        memcpy(entry, body + header->digest_len, path_len);
+        entry[path_len] = '\0';
+    }
+
+    if (header->digest_len == 32)
+    {
+        for (int i = 0; i < 32; i++)
+            sprintf(hex + (i * 2), "%02x", body[i]);
+    }
+    else
+    {
+        memcpy(hex, body, header->digest_len);
+        hex[header->digest_len] = '\0';
+    }
+}
+
+// Prints "<digest>  <path>" like sha256sum, which escapes backslashes and newlines in the
+// path and then starts the line with a backslash
+int print_sum(const char *pathname, short errCode, const char *hex)
+{
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+    {
+        fprintf(stderr, "%s: %s", pathname, get_error_message(errCode));
+        return -1;
+    }
+
+    if (strpbrk(pathname, "\\\n\r") == NULL)
+        printf("%s  %s\n", hex, pathname);
+    else
+    {
+        printf("\\%s  ", hex);
+        for (const char *c = pathname; *c; c++)
+        {
+            if (*c == '\\')
+                fputs("\\\\", stdout);
+            else if (*c == '\n')
+                fputs("\\n", stdout);
+            else if (*c == '\r')
+                fputs("\\r", stdout);
+            else
+                putchar(*c);
+        }
+        putchar('\n');
+    }
+
+    if (errCode == CLOSE_FILE_E)
+        fprintf(stderr, "%s", get_error_message(errCode));
+    return 0;
+}
+
+// Joins the directory and the entry; the directory itself is printed with a trailing slash
+int print_entry(const char *dir, const char *entry, short errCode, const char *hex)
+{
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + strlen(entry) + 2);
+    if (!path)
+        errExit("<Client> malloc: failed to allocate a pathname");
+    sprintf(path, "%s%s%s", dir, dir_len && dir[dir_len - 1] == '/' ? "" : "/", entry);
+    int failed = print_sum(path, errCode, hex);
+    free(path);
+    return failed;
+}
+
+// The records are not aligned in the message buffer: each one is copied out
+void print_chunks(const char *pathname, const void *records, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        struct ChunkV2 record;
+        memcpy(&record, (const uint8_t *)records + i * sizeof(record), sizeof(record));
+        char line[65 + 2 * 21];
+        for (int j = 0; j < 32; j++)
+            sprintf(line + (j * 2), "%02x", record.sha256[j]);
+        sprintf(line + 64, " %llu %llu", (unsigned long long)record.offset, (unsigned long long)record.length);
+        print_sum(pathname, 0, line);
+    }
+}
+
+// Prints a result; CLOSE_FILE_E still carries a valid digest
+int print_result(const char *pathname, short errCode, const char *hex, unsigned int flags)
+{
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+    {
+        fprintf(stderr, "%s: %s", pathname, get_error_message(errCode));
+        return -1;
+    }
+
+    // Print the result
+    const char *alg = (flags & REQ_ALG_MASK) == REQ_ALG_SHA512_256 ? "SHA-512/256"
+                      : (flags & REQ_ALG_MASK) == REQ_ALG_BLAKE3   ? "BLAKE3"
+                                                                   : "SHA256";
+    printf("<Client> The %s%s of %s is:\n\n-->  %s  <--\n\n", (flags & REQ_TREE_HASH) ? "tree " : "", alg, pathname, hex);
+
+    if (errCode == CLOSE_FILE_E)
+        fprintf(stderr, "%s", get_error_message(errCode));
     return 0;
 }
 
@@ -126,5 +831,10 @@ void quit(int sig)
     _exit(0);
 }
 
-// Calls quit with a default signal value.
-void quit_atexit(void) { quit(SIGINT); }
\ No newline at end of file
+// Removes the client FIFO on exit (ignore errors if it was already removed)
+void quit_atexit(void)
+{
+    char path2ClientFIFO[PATH_MAX];
+    sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, getpid());
+    unlink(path2ClientFIFO);
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "conn.h"
+
+struct conn
+{
+    int fd;   // Connected socket
+    int refs; // References (atomic): the master and the queued client nodes
+};
+
+static long accepted = 0; // atomic
+static long open_conns = 0; // atomic
+
+int conn_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    // The server FIFO was just created, so no other server owns the socket: a file left
+    // by a server that was killed would make bind() fail
+    unlink(path);
+    // Same permissions as the server FIFO: user read, write; group write
+    mode_t mask = umask(S_IXUSR | S_IRGRP | S_IXGRP | S_IRWXO);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+conn_t *conn_accept(int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return NULL;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    conn_t *conn = malloc(sizeof(conn_t));
+    if (!conn)
+    {
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+int conn_fd(const conn_t *conn)
+{
+    return conn->fd;
+}
+
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len)
+{
+    ssize_t n;
+    do
+        n = recv(conn->fd, buf, len, 0);
+    while (n == -1 && errno == EINTR);
+    return n;
+}
+
+int conn_send(conn_t *conn, const void *msg, size_t len)
+{
+    // A packet is sent whole or not at all; MSG_NOSIGNAL: a closed peer is an error, not a signal
+    ssize_t n;
+    do
+        n = send(conn->fd, msg, len, MSG_NOSIGNAL);
+    while (n == -1 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+void conn_hold(conn_t *conn)
+{
+    if (conn)
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
+
+void conn_release(conn_t *conn)
+{
+    if (!conn || __atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    close(conn->fd);
+    free(conn);
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+}
+
+void conn_get_stats(conn_stats_t *stats)
+{
+    stats->accepted = __atomic_load_n(&accepted, __ATOMIC_RELAXED);
+    stats->open = __atomic_load_n(&open_conns, __ATOMIC_RELAXED);
+}
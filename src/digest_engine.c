@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/opensslv.h>
+
+#include "digest_engine.h"
+#include "request_response.h"
+
+// Per-thread EVP context, reset and reused for every file
+static __thread EVP_MD_CTX *thread_evp = NULL;
+
+// SHA-256 and SHA-512/256 implementations fetched once from the default provider
+static const EVP_MD *evp_sha256 = NULL;
+static const EVP_MD *evp_sha512_256 = NULL;
+
+// SHA-256("abc"), FIPS 180-4 example, used as engine self-test
+static const uint8_t sha256_abc[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+};
+
+// SHA-512/256("abc"), FIPS 180-4 example
+static const uint8_t sha512_256_abc[32] = {
+    0x53, 0x04, 0x8e, 0x26, 0x81, 0x94, 0x1e, 0xf9, 0x9b, 0x2e, 0x29, 0xb7, 0x6b, 0x4c, 0x7d, 0xab,
+    0xe4, 0xc2, 0xd0, 0xc6, 0x34, 0xfc, 0x6d, 0x46, 0xe0, 0xe2, 0xf1, 0x31, 0x07, 0xe7, 0xaf, 0x23,
+};
+
+// BLAKE3("abc")
+static const uint8_t blake3_abc[32] = {
+    0x64, 0x37, 0xb3, 0xac, 0x38, 0x46, 0x51, 0x33, 0xff, 0xb6, 0x3b, 0x75, 0x27, 0x3a, 0x8d, 0xb5,
+    0x48, 0xc5, 0x58, 0x46, 0x5d, 0x79, 0xdb, 0x03, 0xfd, 0x35, 0x9c, 0x6c, 0xd5, 0xbd, 0x9d, 0x85,
+};
+
+// BLAKE3 of the 31744 bytes i % 251 (31 chunks), a vector of the reference test suite: past one
+// chunk the SIMD kernels, the parent nodes and the subtrees come into play
+#define BLAKE3_KAT_LEN 31744
+static const uint8_t blake3_kat[32] = {
+    0x62, 0xb6, 0x96, 0x0e, 0x1a, 0x44, 0xbc, 0xc1, 0xeb, 0x1a, 0x61, 0x1a, 0x8d, 0x62, 0x35, 0xb6,
+    0xb4, 0xb7, 0x8f, 0x32, 0xe7, 0xab, 0xc4, 0xfb, 0x4c, 0x6c, 0xdc, 0xce, 0x94, 0x89, 0x5c, 0x47,
+};
+
+static const digest_engine_t engine_evp, engine_native, engine_sha512_256, engine_blake3;
+
+static int evp_md_init(digest_ctx_t *ctx, const EVP_MD *md)
+{
+    if (!thread_evp && !(thread_evp = EVP_MD_CTX_new()))
+        return -1;
+    ctx->evp = thread_evp;
+    return EVP_DigestInit_ex(ctx->evp, md, NULL) == 1 ? 0 : -1;
+}
+
+static int evp_init(digest_ctx_t *ctx)
+{
+    ctx->engine = &engine_evp;
+    return evp_md_init(ctx, evp_sha256);
+}
+
+static int sha512_256_init(digest_ctx_t *ctx)
+{
+    ctx->engine = &engine_sha512_256;
+    return evp_md_init(ctx, evp_sha512_256);
+}
+
+static void evp_update(digest_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    EVP_DigestUpdate(ctx->evp, data, len);
+}
+
+static void evp_final(digest_ctx_t *ctx, uint8_t *out)
+{
+    EVP_DigestFinal_ex(ctx->evp, out, NULL);
+}
+
+static int native_init(digest_ctx_t *ctx)
+{
+    ctx->engine = &engine_native;
+    sha256_native_init(&ctx->native);
+    return 0;
+}
+
+static void native_update(digest_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    sha256_native_update(&ctx->native, data, len);
+}
+
+static void native_final(digest_ctx_t *ctx, uint8_t *out)
+{
+    sha256_native_final(&ctx->native, out);
+}
+
+static int blake3_engine_init(digest_ctx_t *ctx)
+{
+    ctx->engine = &engine_blake3;
+    blake3_init(&ctx->blake3);
+    return 0;
+}
+
+static void blake3_engine_update(digest_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    blake3_update(&ctx->blake3, data, len);
+}
+
+static void blake3_engine_final(digest_ctx_t *ctx, uint8_t *out)
+{
+    blake3_final(&ctx->blake3, out);
+}
+
+static const digest_engine_t engine_evp = {"openssl-evp", 32, evp_init, evp_update, evp_final};
+static const digest_engine_t engine_native = {"native", 32, native_init, native_update, native_final};
+static const digest_engine_t engine_sha512_256 = {"openssl-evp", 32, sha512_256_init, evp_update, evp_final};
+static const digest_engine_t engine_blake3 = {"blake3", 32, blake3_engine_init, blake3_engine_update, blake3_engine_final};
+
+const digest_engine_t *sha256_engine = &engine_native;
+
+// Engines of the other algorithms, NULL until set up
+static const digest_engine_t *sha512_256_engine = NULL;
+static const digest_engine_t *blake3_engine = NULL;
+
+// Hashes "abc" with the engine and compares it with the known digest
+static int engine_selftest(const digest_engine_t *engine, const uint8_t expected[32])
+{
+    digest_ctx_t ctx;
+    uint8_t out[32];
+    if (engine->init(&ctx) != 0)
+        return -1;
+    engine->update(&ctx, (const uint8_t *)"abc", 3);
+    engine->final(&ctx, out);
+    return memcmp(out, expected, sizeof(out)) == 0 ? 0 : -1;
+}
+
+// Hashes the BLAKE3 vector in one update (16, 8 and 1 chunks at a time), from the middle of a
+// chunk, and as two subtrees of 16 chunks combined like the leaves of a tree hash
+static int blake3_selftest_long(void)
+{
+    uint8_t *data = malloc(BLAKE3_KAT_LEN);
+    if (!data)
+        return -1;
+    for (size_t i = 0; i < BLAKE3_KAT_LEN; i++)
+        data[i] = (uint8_t)(i % 251);
+
+    int failed = 0;
+    blake3_hasher_t h;
+    uint8_t out[32], cvs[2][32];
+    blake3_init(&h);
+    blake3_update(&h, data, BLAKE3_KAT_LEN);
+    blake3_final(&h, out);
+    failed |= memcmp(out, blake3_kat, sizeof(out)) != 0;
+
+    blake3_init(&h);
+    blake3_update(&h, data, 1000);
+    blake3_update(&h, data + 1000, BLAKE3_KAT_LEN - 1000);
+    blake3_final(&h, out);
+    failed |= memcmp(out, blake3_kat, sizeof(out)) != 0;
+
+    size_t half = 16 * BLAKE3_CHUNK_LEN;
+    blake3_init_subtree(&h, 0);
+    blake3_update(&h, data, half);
+    blake3_final_cv(&h, cvs[0]);
+    blake3_init_subtree(&h, 16);
+    blake3_update(&h, data + half, BLAKE3_KAT_LEN - half);
+    blake3_final_cv(&h, cvs[1]);
+    blake3_root((const uint8_t(*)[32])cvs, 2, out);
+    failed |= memcmp(out, blake3_kat, sizeof(out)) != 0;
+
+    free(data);
+    return failed ? -1 : 0;
+}
+
+// Fetches the EVP implementation; returns 0 if it is usable
+static int evp_setup(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (!evp_sha256)
+        evp_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+#else
+    evp_sha256 = EVP_sha256();
+#endif
+    if (!evp_sha256)
+        return -1;
+    return engine_selftest(&engine_evp, sha256_abc);
+}
+
+// SHA-512/256 only comes from EVP; BLAKE3 picks its SIMD kernel
+static void other_engines_setup(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (!evp_sha512_256)
+        evp_sha512_256 = EVP_MD_fetch(NULL, "SHA512-256", NULL);
+#else
+    evp_sha512_256 = EVP_sha512_256();
+#endif
+    if (evp_sha512_256 && engine_selftest(&engine_sha512_256, sha512_256_abc) == 0)
+        sha512_256_engine = &engine_sha512_256;
+
+    blake3_select();
+    if (engine_selftest(&engine_blake3, blake3_abc) == 0 && blake3_selftest_long() == 0)
+        blake3_engine = &engine_blake3;
+}
+
+const digest_engine_t *digest_engine_for(unsigned int alg)
+{
+    switch (alg & REQ_ALG_MASK)
+    {
+    case REQ_ALG_SHA256:
+        return sha256_engine;
+    case REQ_ALG_SHA512_256:
+        return sha512_256_engine;
+    case REQ_ALG_BLAKE3:
+        return blake3_engine;
+    default:
+        return NULL;
+    }
+}
+
+int digest_engine_setup(const char *name)
+{
+    int force_scalar = name && strcmp(name, "scalar") == 0;
+    sha256_native_select(force_scalar);
+    other_engines_setup();
+
+    if (!name || strcmp(name, "evp") == 0)
+    {
+        if (evp_setup() == 0)
+        {
+            sha256_engine = &engine_evp;
+            return 0;
+        }
+        if (name) // explicitly requested
+            return -1;
+    }
+    else if (!force_scalar && strcmp(name, "native") != 0)
+        return -1;
+
+    sha256_engine = &engine_native;
+    return engine_selftest(&engine_native, sha256_abc);
+}
+
+void digest_engine_describe(char *buf, size_t size)
+{
+    int n;
+    if (sha256_engine == &engine_evp)
+        n = snprintf(buf, size, "%s (%s), native kernel available: %s",
+                     sha256_engine->name, OpenSSL_version(OPENSSL_VERSION), sha256_native_kernel());
+    else
+        n = snprintf(buf, size, "%s (kernel: %s)", sha256_engine->name, sha256_native_kernel());
+    if (n >= 0 && (size_t)n < size)
+        snprintf(buf + n, size - n, "; SHA-512/256: %s; BLAKE3: %s",
+                 sha512_256_engine ? sha512_256_engine->name : "unavailable",
+                 blake3_engine ? blake3_kernel() : "unavailable");
+}
+
+void digest_engine_thread_cleanup(void)
+{
+    EVP_MD_CTX_free(thread_evp);
+    thread_evp = NULL;
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dir_hash.h"
+#include "digest_engine.h"
+#include "request_response.h"
+
+// Record returned by getdents64 (not declared by the C library)
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define DIR_BUF_SIZE (32 * 1024)
+
+// Lists the directory fd, visits its files, then descends into its subdirectories: a directory is
+// listed completely before the next one is opened, so one buffer serves the whole walk and only
+// the directories of the current path stay open
+static short walk(int fd, char *rel, size_t rel_len, short (*visit)(const char *, void *), void *arg, uint8_t *buf)
+{
+    char **subdirs = NULL;
+    size_t nsubdirs = 0, cap = 0;
+    short errCode = 0;
+
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, fd, buf, DIR_BUF_SIZE);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            errCode = WALK_DIR_E;
+            goto out;
+        }
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            // Some file systems do not fill d_type
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue; // removed since the listing
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+            }
+
+            size_t name_len = strlen(d->d_name);
+            if (type == DT_REG)
+            {
+                if (rel_len + name_len + 1 >= PATH_MAX)
+                {
+                    errCode = WALK_DIR_E;
+                    goto out;
+                }
+                memcpy(rel + rel_len, d->d_name, name_len + 1);
+                errCode = visit(rel, arg);
+                rel[rel_len] = '\0';
+                if (errCode != 0)
+                    goto out;
+            }
+            else if (type == DT_DIR)
+            {
+                if (nsubdirs == cap)
+                {
+                    size_t new_cap = cap ? cap * 2 : 16;
+                    char **grown = realloc(subdirs, new_cap * sizeof(char *));
+                    if (!grown)
+                    {
+                        errCode = WALK_DIR_E;
+                        goto out;
+                    }
+                    subdirs = grown;
+                    cap = new_cap;
+                }
+                if (!(subdirs[nsubdirs] = strdup(d->d_name)))
+                {
+                    errCode = WALK_DIR_E;
+                    goto out;
+                }
+                nsubdirs++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nsubdirs && errCode == 0; i++)
+    {
+        size_t name_len = strlen(subdirs[i]);
+        if (rel_len + name_len + 2 >= PATH_MAX)
+        {
+            errCode = WALK_DIR_E;
+            break;
+        }
+        int sub = openat(fd, subdirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub == -1)
+        {
+            // Replaced by a link or a file since the listing: it is no longer a directory
+            if (errno == ENOTDIR || errno == ELOOP || errno == ENOENT)
+                continue;
+            errCode = WALK_DIR_E;
+            break;
+        }
+        memcpy(rel + rel_len, subdirs[i], name_len);
+        rel[rel_len + name_len] = '/';
+        rel[rel_len + name_len + 1] = '\0';
+        errCode = walk(sub, rel, rel_len + name_len + 1, visit, arg, buf);
+        rel[rel_len] = '\0';
+        close(sub);
+    }
+
+out:
+    for (size_t i = 0; i < nsubdirs; i++)
+        free(subdirs[i]);
+    free(subdirs);
+    return errCode;
+}
+
+short dir_walk(const char *root, short (*visit)(const char *relpath, void *arg), void *arg)
+{
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOTDIR ? NOT_DIR_E : OPEN_FILE_E;
+
+    char *rel = malloc(PATH_MAX);
+    uint8_t *buf = malloc(DIR_BUF_SIZE);
+    short errCode = WALK_DIR_E;
+    if (rel && buf)
+    {
+        rel[0] = '\0';
+        errCode = walk(fd, rel, 0, visit, arg, buf);
+    }
+    free(rel);
+    free(buf);
+    close(fd);
+    return errCode;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const dir_hash_entry_t *)a)->path, ((const dir_hash_entry_t *)b)->path);
+}
+
+void dir_hash_root(const digest_engine_t *engine, dir_hash_entry_t *entries, size_t n, uint8_t root[32])
+{
+    const uint8_t separator = 0x00;
+
+    // strcmp() compares as unsigned char: byte order, whatever the locale
+    qsort(entries, n, sizeof(dir_hash_entry_t), compare_entries);
+
+    digest_ctx_t ctx;
+    engine->init(&ctx);
+    for (size_t i = 0; i < n; i++)
+    {
+        engine->update(&ctx, (const uint8_t *)entries[i].path, strlen(entries[i].path));
+        engine->update(&ctx, &separator, 1);
+        engine->update(&ctx, entries[i].digest, 32);
+    }
+    engine->final(&ctx, root);
+}
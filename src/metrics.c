@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define METRICS_PREFIX "sha256_server_"
+
+typedef struct
+{
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t buckets[METRIC_STAGES][METRICS_BUCKETS];
+    uint64_t sum_ns[METRIC_STAGES];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static metrics_shard_t shards[METRICS_SHARDS];
+static int next_shard = 0;
+static __thread metrics_shard_t *thread_shard = NULL;
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    {"clients_served_total", "Responses delivered to clients"},
+    {"cache_hits_total", "Digests found in the cache"},
+    {"cache_misses_total", "Cache lookups of the workers that missed"},
+    {"intake_hits_total", "Cache hits answered at intake, without a worker"},
+    {"hashed_total", "Digests computed"},
+    {"reply_errors_total", "Responses that could not be delivered"},
+};
+
+static const char *stage_names[METRIC_STAGES] = {"stat", "queue_wait", "cache_lookup", "hash", "reply"};
+
+// Threads beyond the shard count share shards: the updates are atomic anyway
+static metrics_shard_t *shard(void)
+{
+    if (!thread_shard)
+        thread_shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS];
+    return thread_shard;
+}
+
+static int bucket_of(uint64_t ns)
+{
+    if (ns < ((uint64_t)1 << METRICS_MIN_SHIFT))
+        return 0;
+    int shift = 63 - __builtin_clzll(ns);
+    if (shift > METRICS_MAX_SHIFT)
+        return METRICS_BUCKETS - 1;
+    int sub = (int)(ns >> (shift - 2)) & (METRICS_SUB_BUCKETS - 1);
+    return 1 + (shift - METRICS_MIN_SHIFT) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Exclusive upper bound of a bucket in nanoseconds, 0 for the overflow bucket
+static uint64_t bucket_bound(int b)
+{
+    if (b == 0)
+        return (uint64_t)1 << METRICS_MIN_SHIFT;
+    if (b == METRICS_BUCKETS - 1)
+        return 0;
+    int shift = METRICS_MIN_SHIFT + (b - 1) / METRICS_SUB_BUCKETS;
+    int sub = (b - 1) % METRICS_SUB_BUCKETS;
+    return (uint64_t)(METRICS_SUB_BUCKETS + sub + 1) << (shift - 2);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n)
+{
+    __atomic_fetch_add(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metric_stage_t stage, uint64_t ns)
+{
+    metrics_shard_t *s = shard();
+    __atomic_fetch_add(&s->buckets[stage][bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_ns[stage], ns, __ATOMIC_RELAXED);
+}
+
+void metrics_since(metric_stage_t stage, uint64_t start)
+{
+    metrics_observe(stage, metrics_now() - start);
+}
+
+uint64_t metrics_counter(metric_counter_t counter)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        total += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+    return total;
+}
+
+// Sums the buckets of a stage over the shards
+static uint64_t merge(metric_stage_t stage, uint64_t buckets[METRICS_BUCKETS], uint64_t *sum_ns)
+{
+    uint64_t count = 0;
+    *sum_ns = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+    {
+        buckets[b] = 0;
+        for (int i = 0; i < METRICS_SHARDS; i++)
+            buckets[b] += __atomic_load_n(&shards[i].buckets[stage][b], __ATOMIC_RELAXED);
+        count += buckets[b];
+    }
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        *sum_ns += __atomic_load_n(&shards[i].sum_ns[stage], __ATOMIC_RELAXED);
+    return count;
+}
+
+uint64_t metrics_count(metric_stage_t stage)
+{
+    uint64_t buckets[METRICS_BUCKETS], sum_ns;
+    return merge(stage, buckets, &sum_ns);
+}
+
+uint64_t metrics_quantile(metric_stage_t stage, double q)
+{
+    uint64_t buckets[METRICS_BUCKETS], sum_ns;
+    uint64_t count = merge(stage, buckets, &sum_ns);
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+            return bucket_bound(b);
+    }
+    return bucket_bound(METRICS_BUCKETS - 2); // overflow: report the last finite bound
+}
+
+void metrics_write(FILE *out)
+{
+    for (int c = 0; c < METRIC_COUNTERS; c++)
+    {
+        fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n", counter_info[c].name, counter_info[c].help);
+        fprintf(out, "# TYPE " METRICS_PREFIX "%s counter\n", counter_info[c].name);
+        fprintf(out, METRICS_PREFIX "%s %llu\n", counter_info[c].name,
+                (unsigned long long)metrics_counter((metric_counter_t)c));
+    }
+
+    // Cumulative buckets, the full fixed set for every stage so that the series are stable, then +Inf
+    fprintf(out, "# HELP " METRICS_PREFIX "stage_seconds Latency of the request stages\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "stage_seconds histogram\n");
+    for (int s = 0; s < METRIC_STAGES; s++)
+    {
+        uint64_t buckets[METRICS_BUCKETS], sum_ns;
+        uint64_t count = merge((metric_stage_t)s, buckets, &sum_ns);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+        {
+            cumulative += buckets[b];
+            fprintf(out, METRICS_PREFIX "stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n", stage_names[s],
+                    bucket_bound(b) / 1e9, (unsigned long long)cumulative);
+        }
+        fprintf(out, METRICS_PREFIX "stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s],
+                (unsigned long long)count);
+        fprintf(out, METRICS_PREFIX "stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], sum_ns / 1e9);
+        fprintf(out, METRICS_PREFIX "stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s],
+                (unsigned long long)count);
+    }
+}
+
+void metrics_write_gauge(FILE *out, const char *name, const char *help, double value)
+{
+    fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+    fprintf(out, "# TYPE " METRICS_PREFIX "%s gauge\n", name);
+    fprintf(out, METRICS_PREFIX "%s %.17g\n", name, value);
+}
+
+const char *metrics_stage_name(metric_stage_t stage) { return stage_names[stage]; }
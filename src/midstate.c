@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "midstate.h"
+#include "sha256_native.h"
+#include "read_engine.h"
+#include "request_response.h"
+
+#define MIDSTATE_LOCKS 64            // slot i is protected by lock i % MIDSTATE_LOCKS
+#define FINGERPRINT_SAMPLES 16
+#define FINGERPRINT_SAMPLE_SIZE 4096
+
+size_t midstate_min_size = 0;
+
+static midstate_t *slots = NULL;
+static size_t slot_mask = 0;
+static pthread_mutex_t locks[MIDSTATE_LOCKS];
+static midstate_stats_t stats;
+
+// Mixes dev and ino (splitmix64 finalizer)
+static size_t slot_of(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (size_t)h & slot_mask;
+}
+
+// Read engine sink: updates the native SHA-256 state
+static int native_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    sha256_native_update((sha256_state_t *)ctx, data, len);
+    return 0;
+}
+
+// Fingerprint of the first covered bytes of the file: its length, then the whole prefix if it
+// is small, otherwise evenly spaced samples from the first to the last 4 KiB of the prefix
+short midstate_fingerprint(int fd, const char *filename, uint64_t covered, uint8_t out[32])
+{
+    sha256_state_t st;
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++)
+        len[i] = (uint8_t)(covered >> (8 * i));
+    sha256_native_init(&st);
+    sha256_native_update(&st, len, sizeof(len));
+
+    short errCode;
+    if (covered <= (uint64_t)FINGERPRINT_SAMPLES * FINGERPRINT_SAMPLE_SIZE)
+        errCode = read_range(fd, filename, 0, covered, native_sink, &st);
+    else
+    {
+        uint64_t span = covered - FINGERPRINT_SAMPLE_SIZE;
+        errCode = 0;
+        for (int i = 0; i < FINGERPRINT_SAMPLES && errCode == 0; i++)
+            errCode = read_range(fd, filename, span * i / (FINGERPRINT_SAMPLES - 1), FINGERPRINT_SAMPLE_SIZE,
+                                 native_sink, &st);
+    }
+    if (errCode != 0)
+        return errCode;
+
+    sha256_native_final(&st, out);
+    return 0;
+}
+
+int midstate_append_only(int fd)
+{
+    int attr = 0;
+    return ioctl(fd, FS_IOC_GETFLAGS, &attr) == 0 && (attr & FS_APPEND_FL);
+}
+
+// Copies the midstate of the inode into out; returns 0 if there is none
+static int lookup(uint64_t dev, uint64_t ino, midstate_t *out)
+{
+    size_t i = slot_of(dev, ino);
+    pthread_mutex_lock(&locks[i % MIDSTATE_LOCKS]);
+    int found = slots[i].covered != 0 && slots[i].dev == dev && slots[i].ino == ino;
+    if (found)
+        *out = slots[i];
+    pthread_mutex_unlock(&locks[i % MIDSTATE_LOCKS]);
+    return found;
+}
+
+// Forgets the midstate of the inode
+static void drop(uint64_t dev, uint64_t ino)
+{
+    size_t i = slot_of(dev, ino);
+    pthread_mutex_lock(&locks[i % MIDSTATE_LOCKS]);
+    if (slots[i].dev == dev && slots[i].ino == ino)
+        slots[i].covered = 0;
+    pthread_mutex_unlock(&locks[i % MIDSTATE_LOCKS]);
+    __atomic_fetch_add(&stats.mismatches, 1, __ATOMIC_RELAXED);
+}
+
+void midstate_init(size_t nslots)
+{
+    if (midstate_min_size == 0)
+        return;
+
+    size_t capacity = 64;
+    while (capacity < nslots)
+        capacity *= 2;
+    if (!(slots = calloc(capacity, sizeof(midstate_t))))
+    {
+        printf("<Server> No memory for %zu midstates, resumable hashing disabled\n", capacity);
+        midstate_min_size = 0;
+        return;
+    }
+    slot_mask = capacity - 1;
+    for (int i = 0; i < MIDSTATE_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+short midstate_digest(const char *filename, const file_id_t *id, uint8_t *hash, midstate_t *state)
+{
+    sha256_state_t st;
+    int fd = -1;
+    short errCode = 1; // not resumed
+    memset(state, 0, sizeof(*state));
+
+    // Resume if the file has grown, is still append-only and its covered prefix is unchanged;
+    // a new version of the same size was rewritten in place, it is hashed from the start
+    midstate_t saved;
+    if (lookup(id->dev, id->ino, &saved))
+    {
+        uint8_t fp[32];
+        if (id->size <= saved.size)
+            drop(id->dev, id->ino); // truncated or rewritten
+        else if ((fd = open(filename, O_RDONLY)) != -1)
+        {
+            if (!midstate_append_only(fd) || midstate_fingerprint(fd, filename, saved.covered, fp) != 0 ||
+                memcmp(fp, saved.fingerprint, 32) != 0)
+                drop(id->dev, id->ino);
+            else
+            {
+                memcpy(st.h, saved.h, sizeof(st.h));
+                st.total = saved.covered;
+                st.buflen = 0;
+                errCode = read_range(fd, filename, saved.covered, id->size - saved.covered, native_sink, &st);
+                if (errCode == 0)
+                {
+                    __atomic_fetch_add(&stats.resumed, 1, __ATOMIC_RELAXED);
+                    __atomic_fetch_add(&stats.bytes_skipped, saved.covered, __ATOMIC_RELAXED);
+                    printf("<Server> Worker %ld: resumed %s after %llu bytes\n", pthread_self(), filename,
+                           (unsigned long long)saved.covered);
+                }
+                else
+                    errCode = 1; // shrunk meanwhile: hash it again from the start
+            }
+        }
+    }
+
+    if (errCode != 0)
+    {
+        sha256_native_init(&st);
+        errCode = read_file(filename, native_sink, &st);
+        if (errCode != 0 && errCode != CLOSE_FILE_E)
+        {
+            if (fd != -1)
+                close(fd);
+            return errCode;
+        }
+    }
+
+    // The chaining value covers the whole blocks, the partial one is only in buf
+    state->dev = id->dev;
+    state->ino = id->ino;
+    state->size = st.total;
+    state->covered = st.total - st.buflen;
+    memcpy(state->h, st.h, sizeof(state->h));
+    sha256_native_final(&st, hash);
+
+    // Only the files declared append-only keep a midstate
+    if (state->covered != 0)
+    {
+        if (fd == -1)
+            fd = open(filename, O_RDONLY);
+        if (fd == -1 || !midstate_append_only(fd) ||
+            midstate_fingerprint(fd, filename, state->covered, state->fingerprint) != 0)
+            state->covered = 0;
+    }
+    if (fd != -1)
+        close(fd);
+    return errCode;
+}
+
+void midstate_put(const midstate_t *state)
+{
+    if (!slots || state->covered == 0)
+        return;
+
+    size_t i = slot_of(state->dev, state->ino);
+    pthread_mutex_lock(&locks[i % MIDSTATE_LOCKS]);
+    slots[i] = *state;
+    pthread_mutex_unlock(&locks[i % MIDSTATE_LOCKS]);
+    __atomic_fetch_add(&stats.saved, 1, __ATOMIC_RELAXED);
+}
+
+void midstate_get_stats(midstate_stats_t *out)
+{
+    out->saved = __atomic_load_n(&stats.saved, __ATOMIC_RELAXED);
+    out->resumed = __atomic_load_n(&stats.resumed, __ATOMIC_RELAXED);
+    out->mismatches = __atomic_load_n(&stats.mismatches, __ATOMIC_RELAXED);
+    out->bytes_skipped = __atomic_load_n(&stats.bytes_skipped, __ATOMIC_RELAXED);
+}
+
+void midstate_cleanup(void)
+{
+    free(slots);
+    slots = NULL;
+}
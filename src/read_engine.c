@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "read_engine.h"
+#include "request_response.h"
+#include "uring.h"
+
+#define READ_BUFFER_SIZE (1024 * 1024)    // 1 MiB aligned buffer for read()
+#define READ_MMAP_WINDOW (8 * 1024 * 1024) // mapped bytes passed to the sink at once
+#define READ_DROP_WINDOW (8 * 1024 * 1024) // bytes read before dropping them from the page cache
+#define URING_DEPTH 8                      // reads in flight per file
+#define URING_CHUNK (256 * 1024)           // bytes per read, one registered buffer each
+#define URING_ENTRIES 32                   // submission slots: a file, or a multi-buffer batch of files
+
+size_t read_mmap_threshold = 256 * 1024;
+size_t read_nocache_threshold = (size_t)1024 * 1024 * 1024;
+size_t read_uring_threshold = 256 * 1024;
+
+// Cleared at startup if io_uring can't be set up (old kernel, seccomp, io_uring_disabled)
+static int uring_available = 1;
+
+// Per-thread io_uring and its buffers, set up on first use
+typedef struct
+{
+    uring_t ring;
+    uint8_t *buffers;  // URING_DEPTH chunks
+    int registered;    // buffers registered: fixed reads without per-read page pinning
+} uring_reader_t;
+
+static __thread uring_reader_t *uring_reader = NULL;
+static __thread int uring_failed = 0;
+
+// Per-thread buffer used by the buffered engines, allocated on first use
+static __thread uint8_t *read_buffer = NULL;
+
+// SIGBUS protection for mapped files truncated while they are being read
+static __thread sigjmp_buf mmap_jmp;
+static __thread volatile sig_atomic_t mmap_active = 0;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+
+/**
+ * SIGBUS handler: a mapped page past the end of a truncated file was touched.
+ * Jumps back into read_mmap() of the faulting thread; any other SIGBUS is fatal.
+ */
+static void sigbus_handler(int sig)
+{
+    if (mmap_active)
+        siglongjmp(mmap_jmp, 1);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Installs the SIGBUS handler once for the whole process
+static void sigbus_install(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigbus_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1)
+        perror("<Server> sigaction failed for SIGBUS");
+}
+
+// Returns the per-thread aligned read buffer, NULL if the allocation failed
+static uint8_t *get_read_buffer(void)
+{
+    if (!read_buffer)
+    {
+        void *buf = NULL;
+        if (posix_memalign(&buf, 4096, READ_BUFFER_SIZE) != 0)
+            return NULL;
+        read_buffer = buf;
+    }
+    return read_buffer;
+}
+
+// Reads the file through the aligned buffer; with drop != 0 the consumed pages are evicted
+static short read_buffered(int fd, const char *filename, int drop, read_sink_t sink, void *ctx)
+{
+    uint8_t *buffer = get_read_buffer();
+    if (!buffer)
+    {
+        printf("<Server> Worker %ld: Malloc failed, can't read %s\n", pthread_self(), filename);
+        return READ_FILE_E;
+    }
+
+    if (drop)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0, dropped = 0;
+    ssize_t bR;
+    do
+    {
+        bR = read(fd, buffer, READ_BUFFER_SIZE);
+        if (bR > 0)
+        {
+            if (sink(ctx, buffer, bR) != 0)
+                return READ_FILE_E;
+            offset += bR;
+
+            // Drop what has already been hashed, it won't be read again
+            if (drop && offset - dropped >= READ_DROP_WINDOW)
+            {
+                posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+                dropped = offset;
+            }
+        }
+        else if (bR < 0)
+        {
+            printf("<Server> Worker %ld: Can't read the file %s\n", pthread_self(), filename);
+            return READ_FILE_E;
+        }
+    } while (bR > 0);
+
+    if (drop && offset > dropped)
+        posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+
+    return 0;
+}
+
+// Maps the file and passes it to the sink window by window
+// Returns 1 if the file can't be mapped, so the caller can fall back to read()
+static short read_mmap(int fd, const char *filename, size_t size, read_sink_t sink, void *ctx)
+{
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    madvise(map, size, MADV_SEQUENTIAL);
+    pthread_once(&sigbus_once, sigbus_install);
+
+    short errCode = 0;
+    if (sigsetjmp(mmap_jmp, 1) == 0)
+    {
+        mmap_active = 1;
+        for (size_t off = 0; off < size; off += READ_MMAP_WINDOW)
+        {
+            size_t len = size - off < READ_MMAP_WINDOW ? size - off : READ_MMAP_WINDOW;
+            if (sink(ctx, map + off, len) != 0)
+            {
+                errCode = READ_FILE_E;
+                break;
+            }
+        }
+    }
+    else
+    {
+        // SIGBUS: the file shrank under the mapping
+        printf("<Server> Worker %ld: %s was truncated while reading\n", pthread_self(), filename);
+        errCode = READ_FILE_E;
+    }
+    mmap_active = 0;
+
+    munmap(map, size);
+    return errCode;
+}
+
+// Returns the io_uring of the thread, NULL if io_uring is not usable
+static uring_reader_t *get_uring_reader(void)
+{
+    if (uring_reader || uring_failed || !uring_available)
+        return uring_reader;
+
+    uring_reader_t *r = calloc(1, sizeof(uring_reader_t));
+    void *buffers = NULL;
+    if (!r || posix_memalign(&buffers, 4096, (size_t)URING_DEPTH * URING_CHUNK) != 0)
+    {
+        free(r);
+        uring_failed = 1;
+        return NULL;
+    }
+    int rc = uring_init(&r->ring, URING_ENTRIES);
+    if (rc != 0)
+    {
+        printf("<Server> Worker %ld: io_uring unavailable (%s), using read()\n", pthread_self(), strerror(-rc));
+        free(buffers);
+        free(r);
+        uring_failed = 1;
+        return NULL;
+    }
+    r->buffers = buffers;
+
+    // Registration is charged to RLIMIT_MEMLOCK: without it, plain reads into the same buffers
+    struct iovec iov[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        iov[i].iov_base = r->buffers + (size_t)i * URING_CHUNK;
+        iov[i].iov_len = URING_CHUNK;
+    }
+    r->registered = uring_register_buffers(&r->ring, iov, URING_DEPTH) == 0;
+
+    uring_reader = r;
+    return r;
+}
+
+// Tears down the io_uring of the thread after a failure of the ring itself: later reads use read().
+// The pending reads passed to the kernel still write into their buffers: they are waited for
+// before the buffers are freed or reused. Returns -1 if the ring cannot even wait for them, in
+// which case the ring and its buffers are leaked
+static int uring_reader_drop(const char *filename, int pending)
+{
+    printf("<Server> Worker %ld: io_uring failed while reading %s, using read()\n", pthread_self(), filename);
+    uring_reader_t *r = uring_reader;
+    uring_reader = NULL;
+    uring_failed = 1;
+
+    // Reads queued but never passed to the kernel are discarded with the ring
+    pending -= (int)r->ring.to_submit;
+    r->ring.to_submit = 0;
+    while (pending > 0)
+    {
+        uint64_t user_data;
+        int res;
+        if (uring_peek(&r->ring, &user_data, &res))
+            pending--;
+        else if (uring_submit(&r->ring, 1) != 0)
+        {
+            printf("<Server> Worker %ld: io_uring reads still in flight, their buffers are not freed\n", pthread_self());
+            return -1;
+        }
+    }
+
+    uring_exit(&r->ring);
+    free(r->buffers);
+    free(r);
+    return 0;
+}
+
+// Reads of a file in flight: chunk k of the file is read into slot k % URING_DEPTH
+typedef struct
+{
+    off_t offset; // offset of the chunk in the file
+    size_t len;   // bytes asked for
+    size_t got;   // bytes read so far (short reads are resubmitted)
+    int state;    // URING_IDLE, URING_INFLIGHT, URING_DONE, or -errno
+} uring_slot_t;
+
+#define URING_IDLE 0
+#define URING_INFLIGHT 1
+#define URING_DONE 2
+
+// Queues the rest of the chunk of a slot
+static void uring_slot_submit(uring_reader_t *r, int fd, uring_slot_t *slots, int s)
+{
+    uring_slot_t *slot = &slots[s];
+    slot->state = URING_INFLIGHT;
+    uring_prep_read(&r->ring, fd, r->buffers + (size_t)s * URING_CHUNK + slot->got, slot->len - slot->got,
+                    slot->offset + slot->got, r->registered ? s : -1, s);
+}
+
+// Handles one completion: a short read is resubmitted, end of file or an error ends the slot
+static void uring_slot_complete(uring_reader_t *r, int fd, uring_slot_t *slots, int s, int res)
+{
+    uring_slot_t *slot = &slots[s];
+    if (res == -EINTR || res == -EAGAIN)
+        uring_slot_submit(r, fd, slots, s);
+    else if (res < 0)
+        slot->state = res;
+    else if (res == 0)
+        slot->state = URING_DONE; // end of file before the end of the chunk: the file shrank
+    else if ((slot->got += res) < slot->len)
+        uring_slot_submit(r, fd, slots, s);
+    else
+        slot->state = URING_DONE;
+}
+
+// Keeps URING_DEPTH reads in flight and passes the chunks to the sink in file order: while the
+// sink hashes a chunk, the following ones are being read. Returns 1 if io_uring is unavailable
+static short read_uring(int fd, const char *filename, size_t size, int drop, read_sink_t sink, void *ctx)
+{
+    uring_reader_t *r = get_uring_reader();
+    if (!r)
+        return 1;
+
+    if (drop)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uring_slot_t slots[URING_DEPTH];
+    memset(slots, 0, sizeof(slots));
+    off_t next = 0;
+    int inflight = 0;
+    for (int s = 0; s < URING_DEPTH && (size_t)next < size; s++)
+    {
+        slots[s].offset = next;
+        slots[s].len = size - next < URING_CHUNK ? size - next : URING_CHUNK;
+        uring_slot_submit(r, fd, slots, s);
+        next += slots[s].len;
+        inflight++;
+    }
+
+    short errCode = 0;
+    int eof = 0;
+    off_t delivered = 0, dropped = 0;
+    for (int cur = 0; inflight > 0; cur = (cur + 1) % URING_DEPTH)
+    {
+        // Wait for the next chunk in file order, recording the others as they complete
+        while (slots[cur].state == URING_INFLIGHT)
+        {
+            uint64_t s;
+            int res;
+            if (uring_peek(&r->ring, &s, &res))
+                uring_slot_complete(r, fd, slots, (int)s, res);
+            else if (uring_submit(&r->ring, 1) != 0)
+            {
+                // The ring itself failed: nothing in flight can be trusted any more
+                int pending = 0;
+                for (int i = 0; i < URING_DEPTH; i++)
+                    pending += slots[i].state == URING_INFLIGHT;
+                uring_reader_drop(filename, pending);
+                return READ_FILE_E;
+            }
+        }
+        inflight--;
+
+        // After an error or the end of the file, the remaining reads are only drained
+        if (errCode == 0 && !eof)
+        {
+            if (slots[cur].state < 0)
+            {
+                printf("<Server> Worker %ld: Can't read the file %s\n", pthread_self(), filename);
+                errCode = READ_FILE_E;
+            }
+            else if (sink(ctx, r->buffers + (size_t)cur * URING_CHUNK, slots[cur].got) != 0)
+                errCode = READ_FILE_E;
+            else
+            {
+                delivered += slots[cur].got;
+                eof = slots[cur].got < slots[cur].len;
+                if (drop && delivered - dropped >= READ_DROP_WINDOW)
+                {
+                    posix_fadvise(fd, dropped, delivered - dropped, POSIX_FADV_DONTNEED);
+                    dropped = delivered;
+                }
+            }
+        }
+        slots[cur].state = URING_IDLE;
+
+        // Reuse the slot for the next chunk
+        if (errCode == 0 && !eof && (size_t)next < size)
+        {
+            slots[cur].offset = next;
+            slots[cur].len = size - next < URING_CHUNK ? size - next : URING_CHUNK;
+            slots[cur].got = 0;
+            uring_slot_submit(r, fd, slots, cur);
+            next += slots[cur].len;
+            inflight++;
+        }
+        // Submit now rather than at the next wait, so that the read overlaps the hashing
+        // (a failure is seen again by the wait)
+        if (r->ring.to_submit)
+            uring_submit(&r->ring, 0);
+    }
+
+    // Like read(), also hash what was appended after fstat()
+    while (errCode == 0 && !eof)
+    {
+        ssize_t bR = pread(fd, r->buffers, URING_CHUNK, delivered);
+        if (bR < 0)
+        {
+            printf("<Server> Worker %ld: Can't read the file %s\n", pthread_self(), filename);
+            errCode = READ_FILE_E;
+        }
+        else if (bR == 0)
+            eof = 1;
+        else if (sink(ctx, r->buffers, bR) != 0)
+            errCode = READ_FILE_E;
+        else
+            delivered += bR;
+    }
+
+    if (drop && delivered > dropped)
+        posix_fadvise(fd, dropped, delivered - dropped, POSIX_FADV_DONTNEED);
+    return errCode;
+}
+
+void read_engine_setup(void)
+{
+    if (read_uring_threshold == 0)
+    {
+        uring_available = 0;
+        return;
+    }
+    uring_t ring;
+    int rc = uring_init(&ring, URING_ENTRIES);
+    if (rc != 0)
+    {
+        printf("<Server> io_uring unavailable (%s), files are read with read() and mmap()\n", strerror(-rc));
+        uring_available = 0;
+        return;
+    }
+    uring_exit(&ring);
+}
+
+void read_engine_describe(char *buf, size_t size)
+{
+    int len = 0;
+    if (uring_available)
+        len = snprintf(buf, size, "io_uring >= %zu KiB (%d reads of %d KiB in flight), ", read_uring_threshold / 1024,
+                       URING_DEPTH, URING_CHUNK / 1024);
+    if (len >= 0 && (size_t)len < size)
+        snprintf(buf + len, size - len, "mmap >= %zu KiB, nocache >= %zu MiB, buffered below", read_mmap_threshold / 1024,
+                 read_nocache_threshold / (1024 * 1024));
+}
+
+read_engine_t read_engine_select(size_t filesize)
+{
+    if (read_nocache_threshold && filesize >= read_nocache_threshold)
+        return READ_ENGINE_NOCACHE;
+    if (uring_available && filesize >= read_uring_threshold)
+        return READ_ENGINE_URING;
+    if (filesize >= read_mmap_threshold)
+        return READ_ENGINE_MMAP;
+    return READ_ENGINE_BUFFERED;
+}
+
+const char *read_engine_name(read_engine_t engine)
+{
+    switch (engine)
+    {
+    case READ_ENGINE_MMAP:
+        return "mmap";
+    case READ_ENGINE_NOCACHE:
+        return "nocache";
+    case READ_ENGINE_URING:
+        return "io_uring";
+    default:
+        return "buffered";
+    }
+}
+
+short read_file(const char *filename, read_sink_t sink, void *ctx)
+{
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        printf("<Server> Worker %ld: Can't open the file %s\n", pthread_self(), filename);
+        return OPEN_FILE_E;
+    }
+
+    // Use the size of the opened file, it may differ from the one seen by the master thread
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printf("<Server> Worker %ld: Can't stat the file %s\n", pthread_self(), filename);
+        close(fd);
+        return READ_FILE_E;
+    }
+
+    // nocache files go through io_uring as well, dropping the pages behind the cursor
+    short errCode = 1;
+    read_engine_t engine = S_ISREG(st.st_mode) ? read_engine_select(st.st_size) : READ_ENGINE_BUFFERED;
+    if ((engine == READ_ENGINE_URING || engine == READ_ENGINE_NOCACHE) && st.st_size > 0)
+        errCode = read_uring(fd, filename, st.st_size, engine == READ_ENGINE_NOCACHE, sink, ctx);
+    if (errCode == 1 && engine == READ_ENGINE_URING && (size_t)st.st_size >= read_mmap_threshold)
+        engine = READ_ENGINE_MMAP; // io_uring failed in this thread
+    if (engine == READ_ENGINE_MMAP && st.st_size > 0)
+        errCode = read_mmap(fd, filename, st.st_size, sink, ctx);
+    if (errCode == 1) // not mapped
+        errCode = read_buffered(fd, filename, engine == READ_ENGINE_NOCACHE, sink, ctx);
+
+    if (close(fd) != 0)
+    {
+        printf("<Server> close failed for %s", filename);
+        if (errCode == 0)
+            errCode = CLOSE_FILE_E;
+    }
+    return errCode;
+}
+
+short read_range(int fd, const char *filename, off_t offset, size_t len, read_sink_t sink, void *ctx)
+{
+    uint8_t *buffer = get_read_buffer();
+    if (!buffer)
+    {
+        printf("<Server> Worker %ld: Malloc failed, can't read %s\n", pthread_self(), filename);
+        return READ_FILE_E;
+    }
+
+    while (len > 0)
+    {
+        ssize_t bR = pread(fd, buffer, len < READ_BUFFER_SIZE ? len : READ_BUFFER_SIZE, offset);
+        if (bR <= 0)
+        {
+            printf("<Server> Worker %ld: Can't read the file %s at offset %lld\n",
+                   pthread_self(), filename, (long long)offset);
+            return READ_FILE_E;
+        }
+        if (sink(ctx, buffer, bR) != 0)
+            return READ_FILE_E;
+        offset += bR;
+        len -= bR;
+    }
+    return 0;
+}
+
+short read_file_into(const char *filename, uint8_t *buf, size_t cap, size_t *len)
+{
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        printf("<Server> Worker %ld: Can't open the file %s\n", pthread_self(), filename);
+        return OPEN_FILE_E;
+    }
+
+    // Ask for one byte more than the capacity to detect files that grew past it
+    short errCode = 0;
+    size_t total = 0;
+    ssize_t bR;
+    do
+    {
+        if (total > cap)
+        {
+            errCode = 1;
+            break;
+        }
+        uint8_t spill;
+        if (total == cap)
+            bR = read(fd, &spill, 1);
+        else
+            bR = read(fd, buf + total, cap - total);
+        if (bR > 0)
+            total += bR;
+        else if (bR < 0)
+        {
+            printf("<Server> Worker %ld: Can't read the file %s\n", pthread_self(), filename);
+            errCode = READ_FILE_E;
+        }
+    } while (bR > 0);
+    *len = total;
+
+    if (close(fd) != 0)
+    {
+        printf("<Server> close failed for %s", filename);
+        if (errCode == 0)
+            errCode = CLOSE_FILE_E;
+    }
+    return errCode;
+}
+
+// Finishes a small file after its first read: reads until end of file, up to cap bytes
+static short read_rest_into(int fd, const char *filename, uint8_t *buf, size_t cap, size_t *len)
+{
+    for (;;)
+    {
+        uint8_t spill;
+        ssize_t bR = *len < cap ? pread(fd, buf + *len, cap - *len, *len) : pread(fd, &spill, 1, *len);
+        if (bR == 0)
+            return 0;
+        if (bR < 0)
+        {
+            printf("<Server> Worker %ld: Can't read the file %s\n", pthread_self(), filename);
+            return READ_FILE_E;
+        }
+        if (*len >= cap)
+            return 1; // larger than cap
+        *len += bR;
+    }
+}
+
+void read_files_into(const char *const *filenames, uint8_t *const *bufs, size_t cap, size_t *lens,
+                     short *errCodes, int n)
+{
+    uring_reader_t *r = cap <= UINT32_MAX ? get_uring_reader() : NULL;
+    if (!r || n > URING_ENTRIES)
+    {
+        for (int i = 0; i < n; i++)
+            errCodes[i] = read_file_into(filenames[i], bufs[i], cap, &lens[i]);
+        return;
+    }
+
+    // Open every file and put all the first reads in flight (plain reads: the lanes are not registered)
+    int fds[URING_ENTRIES];
+    int results[URING_ENTRIES];
+    int inflight = 0, abandoned = 0;
+    for (int i = 0; i < n; i++)
+    {
+        lens[i] = 0;
+        errCodes[i] = 0;
+        fds[i] = open(filenames[i], O_RDONLY, 0);
+        if (fds[i] == -1)
+        {
+            printf("<Server> Worker %ld: Can't open the file %s\n", pthread_self(), filenames[i]);
+            errCodes[i] = OPEN_FILE_E;
+            continue;
+        }
+        results[i] = -EINPROGRESS;
+        uring_prep_read(&r->ring, fds[i], bufs[i], cap, 0, -1, i);
+        inflight++;
+    }
+    while (inflight > 0)
+    {
+        uint64_t i;
+        int res;
+        if (uring_peek(&r->ring, &i, &res))
+        {
+            results[i] = res;
+            inflight--;
+        }
+        else if (uring_submit(&r->ring, 1) != 0)
+        {
+            // The remaining files are read with pread() below, once their reads are over
+            abandoned = uring_reader_drop(filenames[0], inflight) != 0;
+            break;
+        }
+    }
+
+    // Short or failed reads, and files that may be larger than cap, are finished with pread()
+    for (int i = 0; i < n; i++)
+    {
+        if (fds[i] == -1)
+            continue;
+        if (results[i] >= 0)
+            lens[i] = results[i];
+        if (abandoned && results[i] == -EINPROGRESS)
+            errCodes[i] = READ_FILE_E; // the lane may still be written by its read
+        else
+            errCodes[i] = read_rest_into(fds[i], filenames[i], bufs[i], cap, &lens[i]);
+        if (close(fds[i]) != 0)
+        {
+            printf("<Server> close failed for %s", filenames[i]);
+            if (errCodes[i] == 0)
+                errCodes[i] = CLOSE_FILE_E;
+        }
+    }
+}
+
+void read_engine_thread_cleanup(void)
+{
+    free(read_buffer);
+    read_buffer = NULL;
+    if (uring_reader)
+    {
+        uring_exit(&uring_reader->ring);
+        free(uring_reader->buffers);
+        free(uring_reader);
+        uring_reader = NULL;
+    }
+}
@@ -5,15 +5,30 @@
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
-#include <openssl/sha.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
 
 #include "errExit.h"
 #include "request_response.h"
+#include "read_engine.h"
+#include "digest_engine.h"
+#include "sha256_mb.h"
+#include "tree_hash.h"
+#include "cache_store.h"
+#include "cache.h"
+#include "session.h"
+#include "conn.h"
+#include "shm_ring.h"
+#include "dir_hash.h"
+#include "midstate.h"
+#include "watch.h"
+#include "cdc.h"
+#include "metrics.h"
 
-#define CACHE_SIZE 1024
 #define MAX_THREADS 64
 
 // Server and client FIFO paths
@@ -24,44 +39,202 @@ char *baseClientFIFO = "/tmp/fifo_client_SHA256."; // Client FIFO format: base +
 int serverFIFO = -1;
 int serverFIFO_extra = -1;
 
+// Socket endpoint served alongside the FIFO (-S), and the event loop of the master
+char *path2ServerSocket = "/tmp/socket_server_SHA256";
+int serverSocket = -1;
+int epoll_fd = -1;
+#define MAX_EVENTS 64
+
+// Shared-memory rings (-R), consumed by a thread of their own
+char *ring_name = SHM_RING_NAME;
+pthread_t ring_tid;
+int ring_started = 0;
+
 // Node for the list of clients waiting for the same file hash
 typedef struct client_node
 {
     pid_t pid;                // Client process ID
+    unsigned char version;    // Protocol of the request (1 or 2), the response uses the same
+    unsigned int flags;       // REQ_* flags of the request (REQ_RAW_DIGEST, REQ_SESSION)
+    uint32_t id;              // v2: request ID of the path, echoed in the response
+    conn_t *conn;             // Socket connection the response goes to (a reference), NULL: FIFO client
+    int ring_client;          // Shared-memory client slot the response goes to, -1: FIFO or socket client
+    uint32_t ring_gen;        // Generation of the client slot
+    struct dir_entry *dir_entry; // File of a directory request the digest goes to, NULL: a real client
     struct client_node *next; // Next client in list
 } client_node_t;
 
-// Request node for both pending and in-progress lists
+// Request in flight, pending or in progress
 typedef struct request_list
 {
-    short errCode;             // Error code (0 if success)
-    char pathname[PATH_MAX];   // Requested file path
-    time_t last_mod_time;      // File modification time
-    size_t filesize;           // File size (for scheduling)
-    client_node_t *clients;    // List of waiting clients
-    struct request_list *next; // Next request in list
+    short errCode;                   // Error code (0 if success)
+    unsigned int flags;              // REQ_* flags (kind of digest)
+    char pathname[PATH_MAX];         // Requested file path
+    file_id_t id;                    // Inode and version of the file (from stat)
+    size_t filesize;                 // File size (for scheduling)
+    double queued;                   // Arrival time in seconds, monotonic (for aging and the wait stats)
+    struct request_list *pending_next; // Next pending request of the same size class
+    uint32_t key;                    // Hash of the identity (for the request index)
+    client_node_t *clients;          // List of waiting clients
+    struct request_list *index_next; // Next request in the same index bucket
 } request_list_t;
 
-// Node for the cache table
-typedef struct cache_entry
+
+// Directory request being answered: its files are queued as requests of their own, whose
+// "client" is the entry of the job; the last one to complete sends the directory digest
+typedef struct dir_job
 {
-    char pathname[PATH_MAX];
-    time_t last_mod_time;
-    uint8_t sha256[32];       // hash SHA256 32 bytes
-    struct cache_entry *next; // Next entry in case of collision
-} cache_entry_t;
+    pthread_mutex_t mutex;     // Protects entries, nentries and remaining
+    char root[PATH_MAX];       // Requested directory
+    unsigned int kind;         // REQ_KIND_MASK flags of the files
+    client_node_t *clients;    // Clients of the directory request (fixed once the walk starts)
+    struct dir_entry **entries;
+    size_t nentries;
+    size_t capacity;
+    size_t remaining;          // Files not answered yet, plus one while the walk runs
+    short errCode;             // Error of the walk
+} dir_job_t;
+
+typedef struct dir_entry
+{
+    dir_job_t *job;
+    char *path;                // Relative to the directory
+    short errCode;
+    uint8_t digest[32];
+} dir_entry_t;
+
+// Cache hits answered at intake, before the request index: the responder thread writes them to
+// the FIFOs and sockets (which can block) from a queue of its own, so they neither wait behind
+// the run queues nor take an index lock
+typedef struct hit_reply
+{
+    client_node_t client;   // Client to answer (holds a reference to its connection)
+    uint8_t hash[32];       // Cached SHA256
+    struct hit_reply *next; // Next reply in arrival order
+} hit_reply_t;
+
+hit_reply_t *hit_head = NULL;
+hit_reply_t *hit_tail = NULL;
+pthread_mutex_t hit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hit_cond = PTHREAD_COND_INITIALIZER;
+pthread_t responder_tid;
+int responder_started = 0;
+
+// Pending requests: one FIFO queue per size class (log2 of the file size). The smallest class
+// goes first, but every aging_ms of waiting promotes a request by one class, so large files
+// are never starved by a steady flow of small ones
+#define SIZE_CLASSES 16 // class 0: < 4 KiB, class c: [2 KiB << c, 4 KiB << c), class 15: >= 64 MiB
+#define LARGE_CLASS 9   // files of at least 1 MiB are large (for the reserved workers)
+
+typedef struct
+{
+    request_list_t *head;     // Oldest pending request of the class
+    request_list_t *tail;     // Newest pending request of the class
+    size_t depth;             // Pending requests
+    size_t max_depth;         // Highest depth reached
+    unsigned long served;     // Requests taken by the workers
+    unsigned long overtook;   // Taken while a smaller class had requests waiting (aging, reserved workers)
+    double wait_total;        // Seconds waited by the requests taken
+    double wait_max;          // Longest wait
+} size_class_t;
+
+// Run queue of a worker: the size classes of the requests routed to it. Each worker has its own
+// mutex and condition variable, so intake and workers only meet on the queue they touch; a worker
+// whose queue is empty steals from the others before going to sleep
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                // Wakes this worker only
+    size_class_t classes[SIZE_CLASSES];
+    size_t pending;                     // Pending requests (atomic: read by thieves without the mutex)
+    size_t pending_large;               // Pending requests of the large classes (atomic)
+    int wake;                           // Set by the thread that woke the worker
+    unsigned long stolen;               // Requests this worker took from the other queues
+    unsigned long sleeps;               // Times this worker went to sleep
+} run_queue_t;
+
+run_queue_t run_queues[MAX_THREADS];
+uint64_t idle_workers = 0;  // atomic: bit w is set while worker w sleeps, cleared by its waker
+unsigned int next_queue = 0; // atomic: round-robin target of new requests
+long aging_ms = 100;         // -A: promotion step, 0 for strict smallest class first
+long reserved_workers = 0;   // -L: workers that only take large files
+
+// Index of the requests in flight (pending or in progress) by file identity, for aggregation:
+// shards selected by the high bits of the key, each a chained hash table with its own mutex that
+// grows when there are more requests than buckets
+#define REQUEST_INDEX_MIN 64
+#define INDEX_SHARD_BITS 6
+#define INDEX_SHARDS (1 << INDEX_SHARD_BITS)
+
+typedef struct
+{
+    pthread_mutex_t mutex;     // Protects the buckets and the client lists of their requests
+    request_list_t **buckets;  // Power of two
+    size_t size;
+    size_t count;
+} index_shard_t;
+
+index_shard_t request_index[INDEX_SHARDS];
 
-// Initialize the requests list head, the mutex, and the condition variable for thread synchronization
-request_list_t *request_list_head = NULL;
-pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+// Buffer of the master for the requests read from the server FIFO (holds several v1 requests)
+#define REQUEST_BUF_SIZE (64 * 1024)
+
+// Tree hash of a large file whose chunks are shared with idle workers
+typedef struct tree_job
+{
+    int fd;                  // File opened by the owner, read with pread()
+    const char *pathname;    // Requested file path
+    size_t filesize;         // Size of the opened file
+    size_t nchunks;          // Number of leaves
+    unsigned int alg;        // REQ_ALG_SHA256 (tree SHA-256 leaves) or REQ_ALG_BLAKE3 (subtree chaining values)
+    size_t next_chunk;       // Next chunk to claim (tree_mutex)
+    size_t done;             // Chunks hashed (job mutex)
+    short errCode;           // First error of a chunk (job mutex)
+    uint8_t (*leaves)[32];   // Leaf digests
+    pthread_mutex_t mutex;   // Protects done and errCode
+    pthread_cond_t cond;     // Signaled when the last chunk is hashed
+    struct tree_job *next;   // Next job with unclaimed chunks
+} tree_job_t;
+
+// Tree jobs with unclaimed chunks, protected by tree_mutex (read without it by idle workers)
+tree_job_t *tree_job_head = NULL;
+pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Memory budget of the cache table (-m), slots and keys included
+size_t cache_budget = (size_t)256 * 1024 * 1024;
+
+// Path of the persistent cache file (-c), NULL keeps the cache in memory only
+char *cache_file = NULL;
+
+// Inodes whose SHA-256 midstate is kept for resumable hashing (-I), see midstate.h
+#define MIDSTATE_SLOTS 4096
+
+// Chunk lists of REQ_CHUNKS requests (see cdc.h): inodes kept and memory of their chunks
+#define CDC_SLOTS 1024
+#define CDC_BUDGET ((size_t)64 * 1024 * 1024)
+
+// Directory trees watched with inotify (-W): their cache entries are invalidated when a file is
+// written, and the files written are hashed in the background by the idle workers
+char *watch_roots[WATCH_MAX_ROOTS];
+int nwatch_roots = 0;
+pthread_t watch_tid;
+int watch_started = 0;
+
+// File written in a watched tree, waiting for an idle worker
+typedef struct prehash
+{
+    struct prehash *next;
+    char pathname[];
+} prehash_t;
 
-// Initialize the in_progress list head, it will use the same mutex of the request list
-request_list_t *in_progress_list_head = NULL;
+#define PREHASH_MAX 4096 // files waiting at most; later ones are dropped until the workers catch up
 
-// Initialize the cache table and the mutex
-cache_entry_t *cache[CACHE_SIZE] = {NULL};
-pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+prehash_t *prehash_head = NULL;
+prehash_t *prehash_tail = NULL;
+size_t prehash_pending = 0; // atomic: read by the workers without the mutex
+pthread_mutex_t prehash_mutex = PTHREAD_MUTEX_INITIALIZER;
+long prehash_done = 0;    // atomic: files hashed in the background
+long prehash_dropped = 0; // files not queued because the queue was full
 
 // Create global threads and global variable for thread pool size
 pthread_t thread[MAX_THREADS];
@@ -70,78 +243,397 @@ long thread_pool_size = 0;
 // atomic variable for threads termination
 volatile sig_atomic_t server_running = 1;
 
-// client counter
-pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
-long client_served = 0;
-long cache_hits = 0;
-long cache_misses = 0;
+// Multi-buffer hashing: maximum batch size (1 disables it) and small-file limit in bytes
+int mb_batch_size = 1;
+size_t mb_small_max = 64 * 1024;
+
+// Per-worker memory holding the files of a multi-buffer batch, one lane of mb_small_max bytes each
+__thread uint8_t *batch_buffer = NULL;
+
+// Metrics dump (SIGUSR1): the handler only wakes the master through this pipe
+int metrics_pipe[2] = {-1, -1};
+char *path2Metrics = "/tmp/metrics_server_SHA256.prom";
 
 /* ========================== FUNCTION PROTOTYPES ========================== */
 
 /**
  * Processes new client requests:
- * - Searches in_progress and pending lists for duplicate requests
- * - Adds new request to pending list (sorted by filesize)
+ * - Searches the request index for a pending or in progress request of the same file
+ * - Adds new request to the run queue of a worker (see schedule_request)
  * - Aggregates clients for same file requests
+ * Returns 0 if the request was queued or answered, -1 if the client could not be served.
+ */
+int update_request_list(const char *pathname, unsigned int flags, const client_node_t *client);
+
+/**
+ * Answers a directory request: walks the tree, queues every file as a request of its own and
+ * streams their digests to the clients; the last file answered sends the directory digest.
+ */
+void digest_directory(request_list_t *req);
+
+/**
+ * Answers a chunk list request: the chunk list comes from the chunk table or from one read of
+ * the file, its records are sent to every client, then the SHA-256 of the whole file.
+ */
+void digest_chunks(request_list_t *req, int *hash_computed);
+
+/**
+ * Sends the chunk records of a list to a v2 client, as many per message as fit.
+ */
+void send_chunks(const client_node_t *client, const cdc_list_t *list);
+
+/**
+ * Walk callback: adds a file to the directory job and queues its request.
+ */
+short dir_job_visit(const char *relpath, void *arg);
+
+/**
+ * Records the digest of a file of a directory job and streams it to the clients of the job.
+ */
+void dir_entry_done(dir_entry_t *entry, short errCode, const uint8_t *hash);
+
+/**
+ * Sends the directory digest (or its error) to the clients of the job and frees it.
+ */
+void dir_job_finish(dir_job_t *job);
+
+/**
+ * Writes a message to a client: on its socket connection or in its FIFO. Returns 0 or -1.
+ */
+int send_to_client(const client_node_t *client, const void *msg, size_t len);
+
+/**
+ * Answers a request from the cache at intake, without an index lock: ring clients inline, the
+ * others through the responder thread. Returns 1 if the client was answered, 0 on a miss.
+ */
+int answer_from_cache(const char *pathname, unsigned int flags, const file_id_t *id, const client_node_t *client);
+
+/**
+ * Responder thread: sends the cache hits queued at intake, in arrival order.
+ */
+void *responder_thread(void *arg);
+
+/**
+ * Watcher thread: waits for the inotify events of the watched trees until the server stops.
+ */
+void *watch_thread(void *arg);
+
+/**
+ * Watcher callback for a file written or moved into a watched tree: drops its stale cache entries
+ * and queues it for a background digest.
+ */
+void file_written(const char *pathname, void *arg);
+
+/**
+ * Takes the oldest file queued for a background digest, or NULL if there is none.
+ */
+prehash_t *prehash_pop(void);
+
+/**
+ * Computes the digest of a file written in a watched tree, unless it is cached or requested
+ * already. The request is indexed while it is hashed, so clients asking meanwhile wait for it.
+ */
+void prehash_run(prehash_t *item, int *hash_computed);
+
+/**
+ * Computes the digest of the request (plain, resumed or tree) and caches it.
+ * Returns 0, or the error of the read (CLOSE_FILE_E comes with a valid digest).
+ */
+short compute_digest(request_list_t *req, uint8_t *hash);
+
+/**
+ * Converts a binary SHA256 into 64 hex characters (hex holds 65 bytes).
+ */
+void digest_to_hex(const uint8_t *hash, char *hex);
+
+/**
+ * Returns the label of the digest algorithm of the request flags for the logs, empty for SHA-256.
+ */
+const char *alg_label(unsigned int flags);
+
+/**
+ * Returns 1 if a queued request can be answered with the digest of the new request.
+ */
+int same_file(request_list_t *node, const char *pathname, unsigned int flags, const file_id_t *id, short errCode);
+
+/**
+ * Computes the request index key: the inode and kind, or the pathname if stat() failed.
+ */
+uint32_t request_key(const char *pathname, unsigned int flags, const file_id_t *id, short errCode);
+
+/**
+ * Returns the index shard of a key.
+ */
+index_shard_t *index_shard(uint32_t key);
+
+/**
+ * Returns the request in flight that can answer the new request, or NULL (shard mutex held).
+ */
+request_list_t *request_index_find(index_shard_t *shard, uint32_t key, const char *pathname, unsigned int flags,
+                                   const file_id_t *id, short errCode);
+
+/**
+ * Adds a request to its index shard (shard mutex held). Returns -1 if the shard could not be allocated.
+ */
+int request_index_add(index_shard_t *shard, request_list_t *req);
+
+/**
+ * Removes a request from its index shard (shard mutex held).
+ */
+void request_index_remove(index_shard_t *shard, request_list_t *req);
+
+/**
+ * Initializes the mutexes of the index shards and of the run queues.
+ */
+void scheduler_init(void);
+
+/**
+ * Returns the current time in seconds from a monotonic clock.
+ */
+double now_seconds(void);
+
+/**
+ * Returns the size class of a file size (log2 buckets).
+ */
+int size_class(size_t filesize);
+
+/**
+ * Appends a request to the queue of its size class in a run queue (queue mutex held).
+ */
+void pending_push(run_queue_t *q, request_list_t *req);
+
+/**
+ * Returns the size class of the run queue to schedule next: the smallest class, unless the oldest
+ * request of a larger class has been promoted ahead of it by aging. Only the large classes are
+ * considered for large_only. Returns -1 if there is no candidate (queue mutex held).
  */
-void update_request_list(struct Request *request);
+int pending_pick(run_queue_t *q, int large_only);
+
+/**
+ * Removes and returns the oldest request of a size class, recording its wait (queue mutex held).
+ */
+request_list_t *pending_take(run_queue_t *q, int c);
+
+/**
+ * Takes the next request of a run queue, with the small requests scheduled after it if it can
+ * start a multi-buffer batch. Returns the number of requests put in batch, 0 if none.
+ */
+int take_requests(run_queue_t *q, int large_only, request_list_t **batch);
+
+/**
+ * Takes requests from the run queue of another worker, scanning from the next worker.
+ * Returns the number of requests put in batch, 0 if every queue is empty.
+ */
+int steal_requests(int self, int large_only, request_list_t **batch);
+
+/**
+ * Routes a new request to a run queue: an idle worker if there is one, else round robin
+ * (large files to the reserved workers); wakes the target if it sleeps, or an idle worker
+ * that can steal the request.
+ */
+void schedule_request(request_list_t *req);
+
+/**
+ * Wakes one sleeping worker of mask. Returns 1 if a worker was woken.
+ */
+int wake_idle_worker(uint64_t mask);
+
+/**
+ * Returns 1 if a worker may find something to do: a pending request it can take, or a tree job.
+ */
+int work_available(int large_only);
+
+/**
+ * Returns the bit mask of the workers that take small files (all of them without -L).
+ */
+uint64_t general_workers(void);
+
+/**
+ * Prints the queue depth and wait time of each size class that was used.
+ */
+void print_size_class_stats(void);
+
+/**
+ * Prints the count and the p50 / p99 / p99.9 latencies of each request stage that was timed.
+ */
+void print_stage_stats(void);
 
 /**
  * Worker thread main function:
- * - Takes requests from pending list
- * - Moves them to in_progress list
+ * - Takes requests from its run queue, or steals them (they stay in the request index until answered)
  * - Computes SHA256 (with cache check)
  * - Sends responses to all waiting clients
  */
 void *worker_thread(void *arg);
 
+/**
+ * Returns 1 if the request can join a multi-buffer batch (no error, small file).
+ */
+int is_batchable(request_list_t *req);
+
+/**
+ * Handles a single request taken from the pending list:
+ * - Sends error responses for requests that failed at stat()
+ * - Checks the cache, computes and caches the SHA256 on a miss
+ * - Replies to all waiting clients
+ */
+void process_request(request_list_t *req, int *hash_computed);
+
+/**
+ * Handles a batch of small requests taken together from the pending list:
+ * - Replies to cache hits immediately
+ * - Reads the misses into memory and hashes them in parallel SIMD lanes
+ */
+void process_batch(request_list_t **batch, int n, int *hash_computed);
+
+/**
+ * Copies the cached SHA256 of the request into hash and updates the hit/miss counters.
+ * Returns 1 on a cache hit, 0 otherwise.
+ */
+int cache_get(request_list_t *req, uint8_t *hash);
+
 /**
  * Sends response to all clients waiting for a request:
- * - Removes request from in_progress list
- * - Sends response to each client via FIFO
+ * - Removes request from the request index
+ * - Sends the SHA256 (NULL for an error without digest) to each client via FIFO
  * - Frees all allocated memory for the request
  */
-void send_response(request_list_t *req, struct Response *response);
+void send_response(request_list_t *req, short errCode, const uint8_t *hash);
+
+/**
+ * Sends the response to the clients of a request already out of the request index and frees it.
+ */
+void reply_clients(request_list_t *req, short errCode, const uint8_t *hash);
 
 /**
- * Computes SHA256 hash of specified file:
+ * Computes the digest of specified file with the engine of its algorithm:
+ * - Reads it through the read engine selected for its size
  * - Handles file opening/reading errors
  * - Returns appropriate error codes
  */
-short digest_file(const char *filename, uint8_t *hash);
+short digest_file(const digest_engine_t *engine, const char *filename, uint8_t *hash);
+
+/**
+ * Read engine sink: updates the digest context passed as ctx with the engine that initialized it.
+ */
+int digest_sink(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Parses the command line options, exits with a usage message on invalid input.
+ */
+void parse_options(int argc, char *argv[]);
+
+/**
+ * Computes the tree SHA256 of the file (see tree_hash.h), or its BLAKE3 digest with alg REQ_ALG_BLAKE3:
+ * - Files of a single chunk are hashed directly
+ * - Otherwise the chunks are published as a tree job and hashed by this worker
+ *   together with any idle worker, then combined into the root
+ */
+short digest_tree(const char *filename, unsigned int alg, uint8_t *hash);
+
+/**
+ * Claims the next unhashed chunk of a tree job, must be called with tree_mutex held.
+ * Unlinks the job from tree_job_head when its last chunk is claimed.
+ * Returns the chunk index or -1 if every chunk is already claimed.
+ */
+long tree_job_claim(tree_job_t *job);
+
+/**
+ * Hashes a claimed chunk of a tree job and signals the owner when it was the last one.
+ */
+void tree_job_run(tree_job_t *job, size_t index);
+
+/**
+ * Sends response to a single client in the protocol of its request: in its completion ring,
+ * on its socket connection, or via its FIFO
+ */
+void reply_client(const client_node_t *client, short errCode, const uint8_t *hash, const char *hex);
+
+/**
+ * Parses the requests read from the server FIFO or from a socket connection (conn, NULL for the
+ * FIFO), v1 and v1.1 structs and v2 messages, and queues them. Bytes that are not a request are
+ * skipped up to the next offset where a request may start.
+ * Returns the number of bytes consumed; an incomplete message at the end is left in buf.
+ */
+size_t parse_requests(const uint8_t *buf, size_t len, conn_t *conn);
+
+/**
+ * Checks the len bytes at msg, a request or its beginning.
+ * Returns the size of the request, 0 if it may be one but is not complete, -1 if it is not a request.
+ */
+ssize_t request_size(const uint8_t *msg, size_t len);
+
+/**
+ * Checks the len bytes read so far of the pathname of a v1 or v1.1 request.
+ * Returns 0 if they cannot be one, 1 otherwise.
+ */
+int v1_pathname_valid(const uint8_t *path, size_t len);
+
+/**
+ * Queues a complete v1 or v1.1 request.
+ */
+void parse_request_v1(const uint8_t *msg, conn_t *conn);
+
+/**
+ * Queues every path of a complete v2 request message, and ends the session of the client if asked.
+ */
+void parse_request_v2(const uint8_t *msg, const struct RequestV2 *hdr, conn_t *conn);
+
+/**
+ * Reads the server FIFO and queues the complete requests; the incomplete tail is kept for the next call.
+ * Returns -1 if the FIFO is broken.
+ */
+int read_fifo_requests(void);
+
+/**
+ * Shared-memory ring thread: takes the requests of the submission ring and queues them
+ * like the master does for the FIFO and the sockets.
+ */
+void *ring_thread(void *arg);
 
 /**
- * Sends response to a single client via its FIFO
+ * Accepts a socket connection and adds it to the event loop.
  */
-void fifo_client(struct Response *response, pid_t cPid);
+void accept_connection(void);
 
 /**
- * Frees all memory allocated for the hash cache.
- * Called during server termination.
+ * Receives a request packet from a socket connection; closes the connection at end of file.
  */
-void cache_cleanup(void);
+void read_connection(conn_t *conn);
 
 /**
- * Computes a hash value for a given pathname and mtime using the djb2 algorithm.
+ * Inserts the SHA256 of the request into the cache and appends it to the cache file,
+ * unless the file changed since the request was queued.
+ * Returns 0 if the digest was cached, -1 otherwise.
  */
-unsigned int hash_path(const char *path, time_t mtime);
+int cache_insert(request_list_t *req, unsigned int kind, const uint8_t *sha256);
 
 /**
- * Searches the cache for a previously computed SHA256.
- * Returns pointer to cache entry or NULL if not found.
+ * Cache file loader: inserts a persisted entry, replacing the digest of an older record for the same key.
  */
-cache_entry_t *cache_lookup(const char *pathname, time_t mtime);
+void cache_load_entry(const file_id_t *id, unsigned int kind, const uint8_t *sha256);
 
 /**
- * Inserts a new SHA256 hash into the cache.
+ * Opens the persistent cache file, loads its entries and compacts it if needed.
  */
-void cache_insert(const char *pathname, time_t mtime, const uint8_t *sha256);
+void cache_warm_start(void);
 
 /**
  * Handles server termination: closes and removes the FIFO, terminates the process.
  */
 void quit(int sig);
 
+/**
+ * SIGUSR1 handler: asks the master thread for a metrics dump through metrics_pipe.
+ */
+void request_metrics(int sig);
+
+/**
+ * Writes the metrics and a few gauges (workers, cache, pending prehashes) in the Prometheus
+ * text format to path2Metrics, through a temporary file renamed over it.
+ */
+void dump_metrics(void);
+
 /**
  * Wrapper function for atexit to ensure cleanup on normal process termination.
  * Calls quit with a default signal value.
@@ -150,290 +642,1333 @@ void quit_atexit(void);
 
 /* ========================== MAIN IMPLEMENTATION ========================== */
 
-// Add a new request to the request list
-void update_request_list(struct Request *request)
+// Returns 1 if the queued request asks for the same digest of the same file version:
+// hardlinks and different spellings of a path share the inode; failed stat()s match by path
+int same_file(request_list_t *node, const char *pathname, unsigned int flags, const file_id_t *id, short errCode)
 {
-    struct stat st;
-    time_t mtime = 0;
-    size_t filesize = 0;
-    short errCode = 0;
+    if (node->flags != flags || node->errCode != errCode)
+        return 0;
+    if (errCode != 0)
+        return strcmp(node->pathname, pathname) == 0;
+    return file_id_equal(&node->id, id);
+}
 
-    // Read file stats to get the last modification time and filesize
-    if (stat(request->pathname, &st) != 0)
+// Hashes the identity of a request (splitmix64 finalizer), or its pathname (FNV-1a) if stat() failed
+uint32_t request_key(const char *pathname, unsigned int flags, const file_id_t *id, short errCode)
+{
+    uint64_t h;
+    if (errCode != 0)
     {
-        errCode = STAT_FILE_E;
+        h = 0xcbf29ce484222325ULL;
+        for (const char *c = pathname; *c; c++)
+            h = (h ^ (uint8_t)*c) * 0x100000001b3ULL;
     }
     else
+        h = id->ino ^ (id->dev * 0x9e3779b97f4a7c15ULL);
+    h ^= (uint64_t)flags << 48;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// The high bits select the shard, the low bits the bucket
+index_shard_t *index_shard(uint32_t key)
+{
+    return &request_index[key >> (32 - INDEX_SHARD_BITS)];
+}
+
+// Searches the bucket of the key for a request of the same file
+request_list_t *request_index_find(index_shard_t *shard, uint32_t key, const char *pathname, unsigned int flags,
+                                   const file_id_t *id, short errCode)
+{
+    if (!shard->buckets)
+        return NULL;
+    for (request_list_t *node = shard->buckets[key & (shard->size - 1)]; node; node = node->index_next)
     {
-        mtime = st.st_mtime;
-        filesize = st.st_size;
+        if (node->key == key && same_file(node, pathname, flags, id, errCode))
+            return node;
     }
+    return NULL;
+}
 
-    // Acquire the list mutex
-    pthread_mutex_lock(&list_mutex);
-
-    // First check in_progress list for same file request
-    request_list_t *node = in_progress_list_head;
-    while (node)
+// Adds a request at the head of its bucket, doubling the buckets when they are all used on average
+int request_index_add(index_shard_t *shard, request_list_t *req)
+{
+    if (shard->count >= shard->size)
     {
-        if (strcmp(node->pathname, request->pathname) == 0 &&
-            node->last_mod_time == mtime)
+        size_t new_size = shard->size ? shard->size * 2 : REQUEST_INDEX_MIN;
+        request_list_t **new_buckets = calloc(new_size, sizeof(request_list_t *));
+        if (new_buckets)
         {
-            // Path and mtime already in the list, add the client PID
-            // Only one thread will calculate the SHA256 and send to multiple clients
-            client_node_t *new_client = malloc(sizeof(client_node_t));
-            if (!new_client)
+            for (size_t b = 0; b < shard->size; b++)
             {
-                printf("<Server> Malloc failed, client %d not served\n", request->cPid);
-                pthread_mutex_unlock(&list_mutex);
-                return;
+                request_list_t *node = shard->buckets[b];
+                while (node)
+                {
+                    request_list_t *next = node->index_next;
+                    node->index_next = new_buckets[node->key & (new_size - 1)];
+                    new_buckets[node->key & (new_size - 1)] = node;
+                    node = next;
+                }
             }
-            new_client->pid = request->cPid;
-            new_client->next = node->clients;
-            node->clients = new_client;
-            pthread_mutex_unlock(&list_mutex);
-            return;
+            free(shard->buckets);
+            shard->buckets = new_buckets;
+            shard->size = new_size;
         }
-        node = node->next;
+        else if (!shard->buckets)
+            return -1; // a full shard only makes the chains longer
     }
 
-    // If not found check or inserti in pending list
-    request_list_t *prev = NULL, *curr = request_list_head;
+    request_list_t **bucket = &shard->buckets[req->key & (shard->size - 1)];
+    req->index_next = *bucket;
+    *bucket = req;
+    shard->count++;
+    return 0;
+}
+
+// Unlinks a request from its bucket
+void request_index_remove(index_shard_t *shard, request_list_t *req)
+{
+    request_list_t **link = &shard->buckets[req->key & (shard->size - 1)];
+    while (*link != req)
+        link = &(*link)->index_next;
+    *link = req->index_next;
+    shard->count--;
+}
 
-    while (curr)
+void scheduler_init(void)
+{
+    for (int i = 0; i < INDEX_SHARDS; i++)
+        pthread_mutex_init(&request_index[i].mutex, NULL);
+    for (int i = 0; i < MAX_THREADS; i++)
     {
-        if (strcmp(curr->pathname, request->pathname) == 0 &&
-            curr->last_mod_time == mtime)
-        {
-            // Path and mtime already in the list, add the client PID
-            // Only one thread will calculate the SHA256 and send to multiple clients
-            client_node_t *new_client = malloc(sizeof(client_node_t));
-            if (!new_client)
-            {
-                printf("<Server> Malloc failed, client %d not served\n", request->cPid);
-                pthread_mutex_unlock(&list_mutex);
-                return;
-            }
-            new_client->pid = request->cPid;
-            new_client->next = curr->clients;
-            curr->clients = new_client;
+        pthread_mutex_init(&run_queues[i].mutex, NULL);
+        pthread_cond_init(&run_queues[i].cond, NULL);
+    }
+}
 
-            // Release the mutex and return
-            pthread_mutex_unlock(&list_mutex);
-            return;
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int size_class(size_t filesize)
+{
+    int c = 0;
+    for (size_t units = filesize >> 12; units && c < SIZE_CLASSES - 1; units >>= 1)
+        c++;
+    return c;
+}
+
+// Queues are FIFO: inside a class the oldest request is the one that aging promotes the most
+void pending_push(run_queue_t *q, request_list_t *req)
+{
+    int c = size_class(req->filesize);
+    size_class_t *sc = &q->classes[c];
+    req->queued = now_seconds();
+    req->pending_next = NULL;
+    if (sc->tail)
+        sc->tail->pending_next = req;
+    else
+        sc->head = req;
+    sc->tail = req;
+    if (++sc->depth > sc->max_depth)
+        sc->max_depth = sc->depth;
+    // Sequentially consistent: a worker going to sleep publishes its idle bit, then reads these
+    __atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+    if (c >= LARGE_CLASS)
+        __atomic_add_fetch(&q->pending_large, 1, __ATOMIC_SEQ_CST);
+}
+
+// Priority of a class head: its class, minus one for every aging_ms it has waited
+int pending_pick(run_queue_t *q, int large_only)
+{
+    double now = now_seconds();
+    double best_priority = 0;
+    int best = -1;
+    for (int c = large_only ? LARGE_CLASS : 0; c < SIZE_CLASSES; c++)
+    {
+        if (!q->classes[c].head)
+            continue;
+        double priority = c;
+        if (aging_ms > 0)
+            priority -= (now - q->classes[c].head->queued) * 1000 / aging_ms;
+        if (best < 0 || priority < best_priority)
+        {
+            best = c;
+            best_priority = priority;
         }
-        if (filesize < curr->filesize)
+    }
+    return best;
+}
+
+request_list_t *pending_take(run_queue_t *q, int c)
+{
+    size_class_t *sc = &q->classes[c];
+    request_list_t *req = sc->head;
+    sc->head = req->pending_next;
+    if (!sc->head)
+        sc->tail = NULL;
+    sc->depth--;
+    __atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+    if (c >= LARGE_CLASS)
+        __atomic_sub_fetch(&q->pending_large, 1, __ATOMIC_RELAXED);
+
+    // Taken ahead of smaller files
+    for (int smaller = 0; smaller < c; smaller++)
+    {
+        if (q->classes[smaller].head)
+        {
+            sc->overtook++;
             break;
-        prev = curr;
-        curr = curr->next;
+        }
+    }
+
+    double wait = now_seconds() - req->queued;
+    metrics_observe(STAGE_QUEUE_WAIT, (uint64_t)(wait * 1e9));
+    sc->served++;
+    sc->wait_total += wait;
+    if (wait > sc->wait_max)
+        sc->wait_max = wait;
+    return req;
+}
+
+// Sums the classes of the run queues; the depth is the highest of a single queue
+void print_size_class_stats(void)
+{
+    unsigned long stolen = 0, sleeps = 0;
+    for (int w = 0; w < thread_pool_size; w++)
+    {
+        stolen += run_queues[w].stolen;
+        sleeps += run_queues[w].sleeps;
+    }
+    printf("<Server> Run queues: %lu requests stolen, %lu worker sleeps\n", stolen, sleeps);
+
+    for (int c = 0; c < SIZE_CLASSES; c++)
+    {
+        size_class_t total = {0};
+        for (int w = 0; w < thread_pool_size; w++)
+        {
+            size_class_t *wc = &run_queues[w].classes[c];
+            total.served += wc->served;
+            total.overtook += wc->overtook;
+            total.wait_total += wc->wait_total;
+            if (wc->max_depth > total.max_depth)
+                total.max_depth = wc->max_depth;
+            if (wc->wait_max > total.wait_max)
+                total.wait_max = wc->wait_max;
+        }
+        size_class_t *sc = &total;
+        if (!sc->served)
+            continue;
+        char range[32];
+        if (c == 0)
+            snprintf(range, sizeof(range), "< 4 KiB");
+        else if (c == SIZE_CLASSES - 1)
+            snprintf(range, sizeof(range), ">= %d MiB", 1 << (c - 9));
+        else if (c < 9)
+            snprintf(range, sizeof(range), "%d-%d KiB", 2 << c, 4 << c);
+        else
+            snprintf(range, sizeof(range), "%d-%d MiB", 1 << (c - 9), 2 << (c - 9));
+        printf("<Server> Size class %s: %lu requests, max depth %zu, wait avg %.2f ms, max %.2f ms, %lu ahead of smaller files\n",
+               range, sc->served, sc->max_depth, sc->wait_total / sc->served * 1000, sc->wait_max * 1000,
+               sc->overtook);
+    }
+}
+
+void print_stage_stats(void)
+{
+    for (int s = 0; s < METRIC_STAGES; s++)
+    {
+        uint64_t count = metrics_count((metric_stage_t)s);
+        if (!count)
+            continue;
+        printf("<Server> Stage %s: %llu timed, p50 < %.3f ms, p99 < %.3f ms, p99.9 < %.3f ms\n",
+               metrics_stage_name((metric_stage_t)s), (unsigned long long)count,
+               metrics_quantile((metric_stage_t)s, 0.5) / 1e6, metrics_quantile((metric_stage_t)s, 0.99) / 1e6,
+               metrics_quantile((metric_stage_t)s, 0.999) / 1e6);
+    }
+}
+
+int take_requests(run_queue_t *q, int large_only, request_list_t **batch)
+{
+    int n = 0;
+    pthread_mutex_lock(&q->mutex);
+    int c = pending_pick(q, large_only);
+    if (c >= 0)
+    {
+        do
+            batch[n++] = pending_take(q, c);
+        while (n < mb_batch_size && is_batchable(batch[0]) && (c = pending_pick(q, large_only)) >= 0 &&
+               is_batchable(q->classes[c].head));
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+// The counters are read without the mutex: a queue that looks empty is skipped
+int steal_requests(int self, int large_only, request_list_t **batch)
+{
+    for (int i = 1; i < thread_pool_size; i++)
+    {
+        run_queue_t *q = &run_queues[(self + i) % thread_pool_size];
+        if (!__atomic_load_n(large_only ? &q->pending_large : &q->pending, __ATOMIC_RELAXED))
+            continue;
+        int n = take_requests(q, large_only, batch);
+        if (n)
+        {
+            run_queues[self].stolen += n;
+            return n;
+        }
+    }
+    return 0;
+}
+
+uint64_t general_workers(void)
+{
+    uint64_t all = thread_pool_size >= 64 ? ~0ULL : (1ULL << thread_pool_size) - 1;
+    return all & ~((1ULL << reserved_workers) - 1);
+}
+
+// The waker clears the idle bit under the mutex of the sleeper, so two producers never spend
+// their wakeup on the same worker
+int wake_idle_worker(uint64_t mask)
+{
+    for (;;)
+    {
+        uint64_t idle = __atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) & mask;
+        if (!idle)
+            return 0;
+        int w = __builtin_ctzll(idle);
+        run_queue_t *q = &run_queues[w];
+        pthread_mutex_lock(&q->mutex);
+        int claimed = (__atomic_fetch_and(&idle_workers, ~(1ULL << w), __ATOMIC_SEQ_CST) >> w) & 1;
+        if (claimed)
+        {
+            q->wake = 1;
+            pthread_cond_signal(&q->cond);
+        }
+        pthread_mutex_unlock(&q->mutex);
+        if (claimed)
+            return 1;
+    }
+}
+
+void schedule_request(request_list_t *req)
+{
+    // Large files go to the reserved workers, the others to the general ones; any worker
+    // that takes small files can steal a large one
+    int large = size_class(req->filesize) >= LARGE_CLASS;
+    uint64_t general = general_workers();
+    uint64_t route = large && reserved_workers ? (1ULL << reserved_workers) - 1 : general;
+    uint64_t thieves = large ? route | general : general;
+
+    // Prefer an idle worker, else round robin over the route
+    int target;
+    uint64_t idle = __atomic_load_n(&idle_workers, __ATOMIC_RELAXED) & route;
+    if (idle)
+        target = __builtin_ctzll(idle);
+    else
+    {
+        unsigned int turn = __atomic_fetch_add(&next_queue, 1, __ATOMIC_RELAXED) % __builtin_popcountll(route);
+        uint64_t bits = route;
+        while (turn--)
+            bits &= bits - 1;
+        target = __builtin_ctzll(bits);
+    }
+
+    run_queue_t *q = &run_queues[target];
+    pthread_mutex_lock(&q->mutex);
+    pending_push(q, req);
+    int woken = (__atomic_fetch_and(&idle_workers, ~(1ULL << target), __ATOMIC_SEQ_CST) >> target) & 1;
+    if (woken)
+    {
+        q->wake = 1;
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    // The target is busy: an idle worker steals the request rather than let it wait
+    if (!woken)
+        wake_idle_worker(thieves);
+}
+
+int work_available(int large_only)
+{
+    if (__atomic_load_n(&tree_job_head, __ATOMIC_SEQ_CST))
+        return 1;
+    if (!large_only && __atomic_load_n(&prehash_pending, __ATOMIC_SEQ_CST))
+        return 1;
+    for (int w = 0; w < thread_pool_size; w++)
+    {
+        if (__atomic_load_n(large_only ? &run_queues[w].pending_large : &run_queues[w].pending, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+// Looks up the cache right after stat(); the lookup is lock-free, so the intake threads
+// (master, ring thread) never wait for the workers
+int answer_from_cache(const char *pathname, unsigned int flags, const file_id_t *id, const client_node_t *client)
+{
+    uint8_t hash[32];
+    uint64_t start = metrics_now();
+    int cached = cache_lookup(id, flags, hash);
+    metrics_since(STAGE_CACHE_LOOKUP, start);
+    if (!cached)
+        return 0;
+
+    // Completion rings never block: write the digest in place from here
+    if (client->ring_client >= 0)
+    {
+        metrics_add(METRIC_CACHE_HITS, 1);
+        metrics_add(METRIC_INTAKE_HITS, 1);
+        reply_client(client, 0, hash, NULL);
+        return 1;
+    }
+
+    // Without the responder the hit is served by a worker, as before
+    if (!responder_started)
+        return 0;
+    hit_reply_t *reply = malloc(sizeof(hit_reply_t));
+    if (!reply)
+        return 0;
+    reply->client = *client;
+    conn_hold(reply->client.conn);
+    reply->client.next = NULL;
+    memcpy(reply->hash, hash, sizeof(reply->hash));
+    reply->next = NULL;
+
+    metrics_add(METRIC_CACHE_HITS, 1);
+    metrics_add(METRIC_INTAKE_HITS, 1);
+    printf("<Server> Intake: cache HIT for %s\n", pathname);
+
+    pthread_mutex_lock(&hit_mutex);
+    if (hit_tail)
+        hit_tail->next = reply;
+    else
+        hit_head = reply;
+    hit_tail = reply;
+    pthread_cond_signal(&hit_cond);
+    pthread_mutex_unlock(&hit_mutex);
+    return 1;
+}
+
+// Takes the whole queue at once and answers it outside the mutex; the queue is drained before exiting
+void *responder_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&hit_mutex);
+        while (!hit_head && server_running)
+            pthread_cond_wait(&hit_cond, &hit_mutex);
+        hit_reply_t *reply = hit_head;
+        hit_head = hit_tail = NULL;
+        pthread_mutex_unlock(&hit_mutex);
+
+        if (!reply)
+            break; // server stopped and nothing left to send
+        while (reply)
+        {
+            char hex[65];
+            digest_to_hex(reply->hash, hex);
+            reply_client(&reply->client, 0, reply->hash, hex);
+            hit_reply_t *tmp = reply;
+            reply = reply->next;
+            conn_release(tmp->client.conn);
+            free(tmp);
+        }
+    }
+    return NULL;
+}
+
+void digest_to_hex(const uint8_t *hash, char *hex)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        hex[2 * i] = "0123456789abcdef"[hash[i] >> 4];
+        hex[2 * i + 1] = "0123456789abcdef"[hash[i] & 0xf];
+    }
+    hex[64] = '\0';
+}
+
+const char *alg_label(unsigned int flags)
+{
+    switch (flags & REQ_ALG_MASK)
+    {
+    case REQ_ALG_SHA256:
+        return "";
+    case REQ_ALG_SHA512_256:
+        return " (SHA-512/256)";
+    case REQ_ALG_BLAKE3:
+        return " (BLAKE3)";
+    default:
+        return " (unknown algorithm)";
+    }
+}
+
+// Add a new request to the request list
+int update_request_list(const char *pathname, unsigned int flags, const client_node_t *client)
+{
+    struct stat st;
+    file_id_t id = {0};
+    short errCode = 0;
+
+    // Read file stats to get the identity (inode and version) and filesize of the file
+    // The tree hash and the chunk lists are only defined over SHA-256
+    if (!digest_engine_for(flags & REQ_ALG_MASK) ||
+        ((flags & REQ_TREE_HASH) && (flags & REQ_ALG_MASK) != REQ_ALG_SHA256) ||
+        ((flags & REQ_CHUNKS) && (flags & REQ_KIND_MASK) != 0))
+        errCode = BAD_ALG_E;
+    else
+    {
+        uint64_t start = metrics_now();
+        int failed = stat(pathname, &st) != 0;
+        metrics_since(STAGE_STAT, start);
+        if (failed)
+            errCode = STAT_FILE_E;
+        else
+            file_id_from_stat(&id, &st);
+    }
+
+    // Known digest of this file version: answer now, no worker and no index lock needed
+    if (errCode == 0 && !(flags & (REQ_DIRECTORY | REQ_CHUNKS)) && answer_from_cache(pathname, flags, &id, client))
+        return 0;
+
+    uint32_t key = request_key(pathname, flags, &id, errCode);
+
+    // Acquire the mutex of the index shard of the file
+    index_shard_t *shard = index_shard(key);
+    pthread_mutex_lock(&shard->mutex);
+
+    // Same version of the same inode already pending or in progress: add the client PID
+    // Only one thread will calculate the SHA256 and send to multiple clients
+    request_list_t *node = request_index_find(shard, key, pathname, flags, &id, errCode);
+    if (node)
+    {
+        client_node_t *new_client = malloc(sizeof(client_node_t));
+        if (!new_client)
+        {
+            printf("<Server> Malloc failed, client %d not served\n", client->pid);
+            pthread_mutex_unlock(&shard->mutex);
+            return -1;
+        }
+        *new_client = *client;
+        conn_hold(new_client->conn);
+        new_client->next = node->clients;
+        node->clients = new_client;
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
     }
 
     // New request: allocate and fill the request node
     request_list_t *new_req = malloc(sizeof(request_list_t));
     if (!new_req)
     {
-        printf("<Server> Malloc failed, client %d not served\n", request->cPid);
-        pthread_mutex_unlock(&list_mutex);
-        return;
+        printf("<Server> Malloc failed, client %d not served\n", client->pid);
+        pthread_mutex_unlock(&shard->mutex);
+        return -1;
     }
 
     client_node_t *new_client = malloc(sizeof(client_node_t));
     if (!new_client)
     {
-        printf("<Server> Malloc failed, client %d not served\n", request->cPid);
+        printf("<Server> Malloc failed, client %d not served\n", client->pid);
         free(new_req);
-        pthread_mutex_unlock(&list_mutex);
-        return;
+        pthread_mutex_unlock(&shard->mutex);
+        return -1;
     }
 
     // Prepare the node
-    new_req->errCode = 0; // success
-    strncpy(new_req->pathname, request->pathname, PATH_MAX);
-    new_req->last_mod_time = st.st_mtime;
-    new_req->filesize = st.st_size;
-    new_client->pid = request->cPid;
+    new_req->errCode = errCode;
+    new_req->flags = flags;
+    strncpy(new_req->pathname, pathname, PATH_MAX);
+    new_req->id = id;
+    new_req->filesize = id.size;
+    new_req->key = key;
+    *new_client = *client;
+    conn_hold(new_client->conn);
     new_client->next = NULL;
     new_req->clients = new_client;
 
-    // Insert the request into the list
-    new_req->next = curr;
-    if (prev)
-        prev->next = new_req;
-    else
-        request_list_head = new_req;
-
-    // Wake up a worker thread and release the mutex
-    pthread_cond_signal(&list_cond);
-    pthread_mutex_unlock(&list_mutex);
+    // Index the request, release the shard and queue the request: until it is answered,
+    // later clients are added to it under the shard mutex
+    if (request_index_add(shard, new_req) != 0)
+    {
+        printf("<Server> Malloc failed, client %d not served\n", client->pid);
+        conn_release(new_client->conn);
+        free(new_client);
+        free(new_req);
+        pthread_mutex_unlock(&shard->mutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    schedule_request(new_req);
+    return 0;
 }
 
-// Worker thread: handles client requests; waits on a condition variable if the list is empty;
+// Worker thread: takes requests from its run queue, steals from the other queues or helps a tree
+// job when it is empty, and sleeps on its own condition variable when there is nothing to do;
 // uses cache to avoid recomputing SHA256
 void *worker_thread(void *arg)
 {
     int hash_computed = 0; // counter for hash computed
+    request_list_t *batch[SHA256_MB_MAX_LANES];
+    int self = (intptr_t)arg;
+    run_queue_t *q = &run_queues[self];
+    // The first reserved_workers workers only take large files, so they always make progress
+    int large_only = self < reserved_workers;
     while (server_running)
     {
-        // Acquire the list_mutex to access the request list
-        pthread_mutex_lock(&list_mutex);
-
-        // If the list is empty, wait on the condition variable
-        while (!request_list_head && server_running)
-            pthread_cond_wait(&list_cond, &list_mutex);
-
-        if (!server_running)
+        // take the request of the scheduled size class; small files are taken in batches while
+        // the next one scheduled is small too; requests in progress stay in the index
+        int n = take_requests(q, large_only, batch);
+        if (!n)
+            n = steal_requests(self, large_only, batch);
+        if (n == 1)
         {
-            pthread_mutex_unlock(&list_mutex);
-            break; // terminate the thread function
+            process_request(batch[0], &hash_computed);
+            continue;
+        }
+        if (n > 1)
+        {
+            process_batch(batch, n, &hash_computed);
+            continue;
         }
 
-        // take a request from the head of the list
-        request_list_t *req = request_list_head;
-        request_list_head = request_list_head->next;
-
-        // Move the request to the in_progress list
-        req->next = in_progress_list_head;
-        in_progress_list_head = req;
+        // No pending request: help the oldest tree job with one of its chunks
+        if (__atomic_load_n(&tree_job_head, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&tree_mutex);
+            tree_job_t *job = tree_job_head;
+            long index = job ? tree_job_claim(job) : -1;
+            pthread_mutex_unlock(&tree_mutex);
+            if (index >= 0)
+            {
+                tree_job_run(job, index);
+                continue;
+            }
+        }
 
-        // Unlock the list_mutex
-        pthread_mutex_unlock(&list_mutex);
+        // Still idle: hash a file written in a watched tree before a client asks for it
+        if (!large_only && __atomic_load_n(&prehash_pending, __ATOMIC_ACQUIRE))
+        {
+            prehash_t *item = prehash_pop();
+            if (item)
+            {
+                prehash_run(item, &hash_computed);
+                continue;
+            }
+        }
 
-        // Check for errors, send an invalid response
-        struct Response response;
-        if (req->errCode != 0)
+        // Nothing to do: publish the idle bit, then look again (a producer pushes, then reads the
+        // idle bits), and sleep until a producer claims the bit
+        pthread_mutex_lock(&q->mutex);
+        __atomic_fetch_or(&idle_workers, 1ULL << self, __ATOMIC_SEQ_CST);
+        if (work_available(large_only) || q->wake || !server_running)
         {
-            response.errCode = req->errCode;
-            send_response(req, &response);
+            __atomic_fetch_and(&idle_workers, ~(1ULL << self), __ATOMIC_SEQ_CST);
+            q->wake = 0;
+            pthread_mutex_unlock(&q->mutex);
             continue;
         }
+        q->sleeps++;
+        while (!q->wake && server_running)
+            pthread_cond_wait(&q->cond, &q->mutex);
+        q->wake = 0;
+        __atomic_fetch_and(&idle_workers, ~(1ULL << self), __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    free(batch_buffer);
+    read_engine_thread_cleanup();
+    digest_engine_thread_cleanup();
+    printf("\n<Server> Worker %ld terminates, %d SHA256 hashes computed", pthread_self(), hash_computed);
+    return NULL;
+}
+
+// Returns 1 if the request can be hashed in a multi-buffer batch
+int is_batchable(request_list_t *req)
+{
+    return req->errCode == 0 && req->flags == 0 && req->filesize <= mb_small_max;
+}
+
+// Looks up the cache and copies the SHA256 into hash, updating the hit/miss counters
+int cache_get(request_list_t *req, uint8_t *hash)
+{
+    uint64_t start = metrics_now();
+    int cached = cache_lookup(&req->id, req->flags, hash);
+    metrics_since(STAGE_CACHE_LOOKUP, start);
+
+    // Sharded counters: the hit path takes no lock
+    metrics_add(cached ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
 
-        // Compute SHA256 for the requested file
-        printf("<Server> Worker %ld: computing SHA256 for %s\n",
-               pthread_self(), req->pathname);
+    if (cached)
+        printf("<Server> Worker %ld: cache HIT for %s\n", pthread_self(), req->pathname);
+    return cached;
+}
+
+// Handles a single request: cache check, SHA256 computation, response
+void process_request(request_list_t *req, int *hash_computed)
+{
+    // Check for errors, send an invalid response
+    if (req->errCode != 0)
+    {
+        send_response(req, req->errCode, NULL);
+        return;
+    }
 
-        // Initialize to zeros
-        uint8_t hash[32] = {0};
+    // A directory is answered file by file, by the whole worker pool
+    if (req->flags & REQ_DIRECTORY)
+    {
+        digest_directory(req);
+        return;
+    }
 
-        // Check if SHA256 is already cached
-        pthread_mutex_lock(&cache_mutex);
-        cache_entry_t *cached = cache_lookup(req->pathname, req->last_mod_time);
-        pthread_mutex_unlock(&cache_mutex);
+    // A chunk list has a table of its own
+    if (req->flags & REQ_CHUNKS)
+    {
+        digest_chunks(req, hash_computed);
+        return;
+    }
 
-        if (cached)
+    // Compute SHA256 for the requested file
+    printf("<Server> Worker %ld: computing SHA256 for %s\n",
+           pthread_self(), req->pathname);
+
+    // Initialize to zeros
+    uint8_t hash[32] = {0};
+
+    // Check if SHA256 is already cached
+    if (cache_get(req, hash))
+    {
+        // Cache HIT: reuse cached SHA256
+        send_response(req, 0, hash);
+        return;
+    }
+
+    // Cache MISS: compute SHA256 and insert into cache
+    printf("<Server> Worker %ld: cache MISS for %s, computing SHA256...\n", pthread_self(), req->pathname);
+    (*hash_computed)++;
+
+    short errCode = compute_digest(req, hash);
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+    {
+        send_response(req, errCode, NULL);
+        return;
+    }
+
+    // Send the response to all waiting clients
+    send_response(req, errCode, hash);
+}
+
+short compute_digest(request_list_t *req, uint8_t *hash)
+{
+    // Large plain SHA-256 digests resume from the midstate of a shorter version of the file,
+    // BLAKE3 digests of several chunks are shared with idle workers like the tree hash
+    short errCode;
+    midstate_t midstate = {0};
+    unsigned int alg = req->flags & REQ_ALG_MASK;
+    uint64_t start = metrics_now();
+    if ((req->flags & REQ_TREE_HASH) || (alg == REQ_ALG_BLAKE3 && req->filesize > TREE_CHUNK_SIZE))
+        errCode = digest_tree(req->pathname, alg, hash);
+    else if (alg == REQ_ALG_SHA256 && midstate_min_size != 0 && req->filesize >= midstate_min_size)
+        errCode = midstate_digest(req->pathname, &req->id, hash, &midstate);
+    else
+        errCode = digest_file(digest_engine_for(alg), req->pathname, hash);
+    metrics_add(METRIC_HASHED, 1);
+    metrics_since(STAGE_HASH, start);
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+        return errCode;
+
+    // The midstate is only good if the file did not change while it was hashed
+    if (cache_insert(req, req->flags, hash) == 0)
+        midstate_put(&midstate);
+    return errCode;
+}
+
+void digest_chunks(request_list_t *req, int *hash_computed)
+{
+    // Chunk lists of the files declared append-only (-I) resume from their last chunk
+    cdc_list_t list;
+    int resume = midstate_min_size != 0 && req->filesize >= midstate_min_size;
+    uint64_t start = metrics_now();
+    short errCode = cdc_digest(req->pathname, &req->id, resume, &list);
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+    {
+        send_response(req, errCode, NULL);
+        return;
+    }
+
+    // The whole-file digest also answers plain requests; the list is kept for this version only
+    int store = 0;
+    if (list.cached)
+        printf("<Server> Worker %ld: chunk list HIT for %s\n", pthread_self(), req->pathname);
+    else
+    {
+        printf("<Server> Worker %ld: %zu chunks in %s\n", pthread_self(), list.n, req->pathname);
+        (*hash_computed)++;
+        metrics_add(METRIC_HASHED, 1);
+        metrics_since(STAGE_HASH, start);
+        store = cache_insert(req, REQ_ALG_SHA256, list.digest) == 0;
+    }
+
+    // Out of the index first: no client can join once the chunks are being sent
+    index_shard_t *shard = index_shard(req->key);
+    pthread_mutex_lock(&shard->mutex);
+    request_index_remove(shard, req);
+    pthread_mutex_unlock(&shard->mutex);
+
+    for (client_node_t *client = req->clients; client; client = client->next)
+        send_chunks(client, &list);
+    reply_clients(req, errCode, list.digest);
+    if (store)
+        cdc_put(&list);
+    cdc_list_free(&list);
+}
+
+void send_chunks(const client_node_t *client, const cdc_list_t *list)
+{
+    uint8_t msg[PROTO_MSG_MAX];
+    for (size_t i = 0; i < list->n; i += PROTO_V2_CHUNKS_MAX)
+    {
+        size_t n = list->n - i < PROTO_V2_CHUNKS_MAX ? list->n - i : PROTO_V2_CHUNKS_MAX;
+        struct ResponseV2 header = {.magic = PROTO_V2_MAGIC, .id = client->id, .flags = RESP_CHUNKS};
+        header.length = sizeof(header) + n * sizeof(struct ChunkV2);
+        memcpy(msg, &header, sizeof(header));
+        for (size_t j = 0; j < n; j++)
         {
-            // Cache HIT: reuse cached SHA256
-            printf("<Server> Worker %ld: cache HIT for %s\n", pthread_self(), req->pathname);
-            memcpy(hash, cached->sha256, 32);
-            pthread_mutex_lock(&stats_mutex);
-            cache_hits++;
-            pthread_mutex_unlock(&stats_mutex);
+            struct ChunkV2 record = {.offset = list->chunks[i + j].offset, .length = list->chunks[i + j].length};
+            memcpy(record.sha256, list->chunks[i + j].sha256, 32);
+            memcpy(msg + sizeof(header) + j * sizeof(record), &record, sizeof(record));
         }
-        else
+        if (send_to_client(client, msg, header.length) != 0)
+            return;
+    }
+}
+
+void *watch_thread(void *arg)
+{
+    (void)arg;
+    while (server_running)
+    {
+        if (watch_wait(250, file_written, NULL) != 0)
+        {
+            printf("<Server> Watcher: inotify read failed, the watched trees are no longer followed\n");
+            break;
+        }
+    }
+    return NULL;
+}
+
+// The cache validates every entry against stat() anyway: dropping the old digest here only
+// frees its slot. Files already queued are not queued twice.
+void file_written(const char *pathname, void *arg)
+{
+    (void)arg;
+    struct stat st;
+    file_id_t id;
+    if (stat(pathname, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    file_id_from_stat(&id, &st);
+    cache_invalidate(&id, REQ_ALG_SHA256);
+    cache_invalidate(&id, REQ_ALG_SHA256 | REQ_TREE_HASH);
+    cache_invalidate(&id, REQ_ALG_SHA512_256);
+    cache_invalidate(&id, REQ_ALG_BLAKE3);
+
+    size_t len = strlen(pathname) + 1;
+    pthread_mutex_lock(&prehash_mutex);
+    for (prehash_t *p = prehash_head; p; p = p->next)
+    {
+        if (strcmp(p->pathname, pathname) == 0)
         {
-            // Cache MISS: compute SHA256 and insert into cache
-            printf("<Server> Worker %ld: cache MISS for %s, computing SHA256...\n", pthread_self(), req->pathname);
+            pthread_mutex_unlock(&prehash_mutex);
+            return;
+        }
+    }
+    prehash_t *item = prehash_pending < PREHASH_MAX ? malloc(sizeof(prehash_t) + len) : NULL;
+    if (!item)
+    {
+        prehash_dropped++;
+        pthread_mutex_unlock(&prehash_mutex);
+        return;
+    }
+    memcpy(item->pathname, pathname, len);
+    item->next = NULL;
+    if (prehash_tail)
+        prehash_tail->next = item;
+    else
+        prehash_head = item;
+    prehash_tail = item;
+    __atomic_store_n(&prehash_pending, prehash_pending + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&prehash_mutex);
 
-            hash_computed++;
-            pthread_mutex_lock(&stats_mutex);
-            cache_misses++;
-            pthread_mutex_unlock(&stats_mutex);
+    // Only a worker with nothing else to do takes it
+    wake_idle_worker(general_workers());
+}
 
-            response.errCode = digest_file(req->pathname, hash);
+prehash_t *prehash_pop(void)
+{
+    pthread_mutex_lock(&prehash_mutex);
+    prehash_t *item = prehash_head;
+    if (item)
+    {
+        prehash_head = item->next;
+        if (!prehash_head)
+            prehash_tail = NULL;
+        __atomic_store_n(&prehash_pending, prehash_pending - 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&prehash_mutex);
+    return item;
+}
 
-            if (response.errCode != 0 && response.errCode != CLOSE_FILE_E)
+void prehash_run(prehash_t *item, int *hash_computed)
+{
+    struct stat st;
+    file_id_t id;
+    uint8_t hash[32];
+    if (stat(item->pathname, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        free(item);
+        return;
+    }
+    file_id_from_stat(&id, &st);
+    if (cache_lookup(&id, 0, hash))
+    {
+        free(item);
+        return;
+    }
+
+    // A client request for the file is pending or in progress: it computes the digest
+    uint32_t key = request_key(item->pathname, 0, &id, 0);
+    index_shard_t *shard = index_shard(key);
+    pthread_mutex_lock(&shard->mutex);
+    request_list_t *req = request_index_find(shard, key, item->pathname, 0, &id, 0) ? NULL : malloc(sizeof(request_list_t));
+    if (!req)
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        free(item);
+        return;
+    }
+    req->errCode = 0;
+    req->flags = 0;
+    strncpy(req->pathname, item->pathname, PATH_MAX);
+    req->id = id;
+    req->filesize = id.size;
+    req->queued = now_seconds();
+    req->key = key;
+    req->clients = NULL;
+    if (request_index_add(shard, req) != 0)
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        free(req);
+        free(item);
+        return;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    free(item);
+
+    printf("<Server> Worker %ld: background SHA256 for %s\n", pthread_self(), req->pathname);
+    (*hash_computed)++;
+    __atomic_fetch_add(&prehash_done, 1, __ATOMIC_RELAXED);
+    short errCode = compute_digest(req, hash);
+
+    // Answers the clients that asked while it was hashed
+    send_response(req, errCode, errCode != 0 && errCode != CLOSE_FILE_E ? NULL : hash);
+}
+
+// Handles a batch of small requests: cache hits are answered first, the misses are read
+// into memory and hashed together by the multi-buffer kernel
+void process_batch(request_list_t **batch, int n, int *hash_computed)
+{
+    if (!batch_buffer && !(batch_buffer = malloc((size_t)SHA256_MB_MAX_LANES * mb_small_max)))
+    {
+        // No memory for the lanes: hash one file at a time
+        for (int i = 0; i < n; i++)
+            process_request(batch[i], hash_computed);
+        return;
+    }
+
+    request_list_t *lane_req[SHA256_MB_MAX_LANES];
+    const uint8_t *msgs[SHA256_MB_MAX_LANES];
+    size_t lens[SHA256_MB_MAX_LANES];
+    short errCodes[SHA256_MB_MAX_LANES];
+    uint8_t hashes[SHA256_MB_MAX_LANES][32];
+    int lanes = 0;
+
+    printf("<Server> Worker %ld: multi-buffer batch of %d files\n", pthread_self(), n);
+
+    // Reply to the cache hits, then read all the misses at once (in parallel with io_uring)
+    request_list_t *misses[SHA256_MB_MAX_LANES];
+    const char *names[SHA256_MB_MAX_LANES];
+    uint8_t *bufs[SHA256_MB_MAX_LANES];
+    size_t sizes[SHA256_MB_MAX_LANES];
+    short results[SHA256_MB_MAX_LANES];
+    int nmisses = 0;
+    uint64_t start = 0;
+    for (int i = 0; i < n; i++)
+    {
+        request_list_t *req = batch[i];
+        if (cache_get(req, hashes[0]))
+        {
+            send_response(req, 0, hashes[0]);
+            continue;
+        }
+        (*hash_computed)++;
+        metrics_add(METRIC_HASHED, 1);
+        misses[nmisses] = req;
+        names[nmisses] = req->pathname;
+        bufs[nmisses] = batch_buffer + (size_t)nmisses * mb_small_max;
+        nmisses++;
+    }
+    start = metrics_now();
+    read_files_into(names, bufs, mb_small_max, sizes, results, nmisses);
+
+    for (int i = 0; i < nmisses; i++)
+    {
+        request_list_t *req = misses[i];
+        short errCode = results[i];
+        if (errCode == 1)
+        {
+            // The file grew past the small-file limit after stat(): use the streaming path
+            errCode = digest_file(sha256_engine, req->pathname, hashes[lanes]);
+            if (errCode != 0 && errCode != CLOSE_FILE_E)
+                send_response(req, errCode, NULL);
+            else
             {
-                send_response(req, &response);
-                continue;
+                cache_insert(req, req->flags, hashes[lanes]);
+                send_response(req, errCode, hashes[lanes]);
             }
-            cache_insert(req->pathname, req->last_mod_time, hash);
+            continue;
+        }
+        if (errCode != 0 && errCode != CLOSE_FILE_E)
+        {
+            send_response(req, errCode, NULL);
+            continue;
         }
 
-        // Convert binary SHA256 to hex string
-        char char_hash[65] = {0};
-        for (int i = 0; i < 32; i++)
-            sprintf(char_hash + (i * 2), "%02x", hash[i]);
+        // Failed misses leave no lane: lane l hashes the buffer of miss i >= l
+        lane_req[lanes] = req;
+        msgs[lanes] = bufs[i];
+        lens[lanes] = sizes[i];
+        errCodes[lanes] = errCode;
+        lanes++;
+    }
 
-        // Prepare the response for the clients
-        strcpy(response.hash, char_hash);
+    if (lanes == 0)
+        return;
 
-        // Send the response to all waiting clients
-        send_response(req, &response);
+    // Every file of the batch waits for the whole batch: that is its hash latency
+    sha256_mb_digest(msgs, lens, lanes, hashes);
+    uint64_t elapsed = metrics_now() - start;
+    for (int l = 0; l < lanes; l++)
+    {
+        metrics_observe(STAGE_HASH, elapsed);
+        cache_insert(lane_req[l], lane_req[l]->flags, hashes[l]);
+        send_response(lane_req[l], errCodes[l], hashes[l]);
     }
-    printf("\n<Server> Worker %ld terminates, %d SHA256 hashes computed", pthread_self(), hash_computed);
-    return NULL;
 }
 
-// Remove the request from the in_progress list and send the response to all waiting clients
-void send_response(request_list_t *req, struct Response *response)
+// The clients are taken from the request before the walk: a client asking for the directory
+// while it is walked starts a new walk, since files may have changed
+void digest_directory(request_list_t *req)
+{
+    index_shard_t *shard = index_shard(req->key);
+    pthread_mutex_lock(&shard->mutex);
+    request_index_remove(shard, req);
+    pthread_mutex_unlock(&shard->mutex);
+
+    dir_job_t *job = calloc(1, sizeof(dir_job_t));
+    if (!job)
+    {
+        // send_response() takes the request out of the index again: put it back first
+        pthread_mutex_lock(&shard->mutex);
+        request_index_add(shard, req);
+        pthread_mutex_unlock(&shard->mutex);
+        send_response(req, WALK_DIR_E, NULL);
+        return;
+    }
+    pthread_mutex_init(&job->mutex, NULL);
+    strcpy(job->root, req->pathname);
+    job->kind = req->flags & REQ_KIND_MASK;
+    job->clients = req->clients;
+    job->remaining = 1;
+    free(req);
+
+    printf("<Server> Worker %ld: walking directory %s\n", pthread_self(), job->root);
+    short errCode = dir_walk(job->root, dir_job_visit, job);
+
+    pthread_mutex_lock(&job->mutex);
+    if (errCode != 0 && job->errCode == 0)
+        job->errCode = errCode;
+    int last = --job->remaining == 0;
+    pthread_mutex_unlock(&job->mutex);
+    if (last)
+        dir_job_finish(job);
+}
+
+short dir_job_visit(const char *relpath, void *arg)
+{
+    dir_job_t *job = arg;
+
+    // The relative path must fit in an entry response, the full path in a request
+    char pathname[PATH_MAX];
+    size_t root_len = strlen(job->root);
+    int slash = root_len > 0 && job->root[root_len - 1] != '/';
+    if (strlen(relpath) > PROTO_V2_ENTRY_MAX || root_len + slash + strlen(relpath) >= PATH_MAX)
+        return WALK_DIR_E;
+    sprintf(pathname, "%s%s%s", job->root, slash ? "/" : "", relpath);
+
+    dir_entry_t *entry = calloc(1, sizeof(dir_entry_t));
+    if (!entry || !(entry->path = strdup(relpath)))
+    {
+        free(entry);
+        return WALK_DIR_E;
+    }
+    entry->job = job;
+
+    pthread_mutex_lock(&job->mutex);
+    if (job->nentries == job->capacity)
+    {
+        size_t new_capacity = job->capacity ? job->capacity * 2 : 64;
+        dir_entry_t **grown = realloc(job->entries, new_capacity * sizeof(dir_entry_t *));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&job->mutex);
+            free(entry->path);
+            free(entry);
+            return WALK_DIR_E;
+        }
+        job->entries = grown;
+        job->capacity = new_capacity;
+    }
+    job->entries[job->nentries++] = entry;
+    job->remaining++;
+    pthread_mutex_unlock(&job->mutex);
+
+    // The file is an ordinary request: cache, aggregation and scheduling over the workers
+    client_node_t client = {.pid = job->clients->pid, .version = 2, .ring_client = -1, .dir_entry = entry};
+    if (update_request_list(pathname, job->kind, &client) != 0)
+        dir_entry_done(entry, READ_FILE_E, NULL);
+    return 0;
+}
+
+void dir_entry_done(dir_entry_t *entry, short errCode, const uint8_t *hash)
 {
+    dir_job_t *job = entry->job;
+    entry->errCode = errCode;
+    if (hash)
+        memcpy(entry->digest, hash, 32);
+
+    // Stream the entry in the protocol of each client: digest, then the relative path
+    char hex[65];
+    if (hash)
+        digest_to_hex(hash, hex);
+    size_t path_len = strlen(entry->path);
+    for (client_node_t *client = job->clients; client; client = client->next)
+    {
+        if (client->version != 2)
+            continue;
+        uint8_t msg[PROTO_MSG_MAX];
+        struct ResponseV2 header = {.magic = PROTO_V2_MAGIC, .errCode = errCode, .id = client->id, .flags = RESP_ENTRY};
+        header.digest_len = !hash ? 0 : (client->flags & REQ_RAW_DIGEST) ? 32 : 64;
+        header.length = sizeof(header) + header.digest_len + path_len;
+        memcpy(msg, &header, sizeof(header));
+        if (header.digest_len)
+            memcpy(msg + sizeof(header), (client->flags & REQ_RAW_DIGEST) ? (const void *)hash : hex, header.digest_len);
+        memcpy(msg + sizeof(header) + header.digest_len, entry->path, path_len);
+        send_to_client(client, msg, header.length);
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    int last = --job->remaining == 0;
+    pthread_mutex_unlock(&job->mutex);
+    if (last)
+        dir_job_finish(job);
+}
 
-    // Remove the request from the in_progress list
-    pthread_mutex_lock(&list_mutex);
-    if (in_progress_list_head == req)
+void dir_job_finish(dir_job_t *job)
+{
+    // Every file must have a digest for the directory to have one
+    short errCode = job->errCode;
+    for (size_t i = 0; i < job->nentries && errCode == 0; i++)
     {
-        in_progress_list_head = req->next;
+        if (job->entries[i]->errCode != 0 && job->entries[i]->errCode != CLOSE_FILE_E)
+            errCode = READ_FILE_E;
     }
-    else
+
+    uint8_t hash[32];
+    char hex[65] = {0};
+    if (errCode == 0)
     {
-        request_list_t *prev = in_progress_list_head;
-        while (prev->next != req)
-            prev = prev->next;
-        prev->next = req->next;
+        dir_hash_entry_t *entries = malloc((job->nentries ? job->nentries : 1) * sizeof(dir_hash_entry_t));
+        if (entries)
+        {
+            for (size_t i = 0; i < job->nentries; i++)
+                entries[i] = (dir_hash_entry_t){job->entries[i]->path, job->entries[i]->digest};
+            dir_hash_root(digest_engine_for(job->kind), entries, job->nentries, hash);
+            digest_to_hex(hash, hex);
+            free(entries);
+        }
+        else
+            errCode = WALK_DIR_E;
     }
-    pthread_mutex_unlock(&list_mutex);
+    printf("<Server> Directory %s: %zu files\n", job->root, job->nentries);
 
-    // Send a response to all the clients
-    client_node_t *clients = req->clients;
+    client_node_t *clients = job->clients;
     while (clients)
     {
-        fifo_client(response, clients->pid);
+        reply_client(clients, errCode, errCode == 0 ? hash : NULL, hex);
         client_node_t *tmp = clients;
         clients = clients->next;
+        conn_release(tmp->conn);
         free(tmp);
     }
 
-    free(req);
+    for (size_t i = 0; i < job->nentries; i++)
+    {
+        free(job->entries[i]->path);
+        free(job->entries[i]);
+    }
+    free(job->entries);
+    pthread_mutex_destroy(&job->mutex);
+    free(job);
 }
 
-// Cleanup the cache and free the memory allocated
-void cache_cleanup()
+// Remove the request from the index and send the response to all waiting clients
+void send_response(request_list_t *req, short errCode, const uint8_t *hash)
 {
-    pthread_mutex_lock(&cache_mutex);
-    for (int i = 0; i < CACHE_SIZE; i++)
+    // Remove the request from the index: later requests for the file are new work
+    index_shard_t *shard = index_shard(req->key);
+    pthread_mutex_lock(&shard->mutex);
+    request_index_remove(shard, req);
+    pthread_mutex_unlock(&shard->mutex);
+
+    reply_clients(req, errCode, hash);
+}
+
+void reply_clients(request_list_t *req, short errCode, const uint8_t *hash)
+{
+    // Convert binary SHA256 to hex string once for all the clients
+    char hex[65] = {0};
+    if (hash)
+        digest_to_hex(hash, hex);
+
+    // Send a response to all the clients
+    client_node_t *clients = req->clients;
+    while (clients)
     {
-        cache_entry_t *entry = cache[i];
-        while (entry)
-        {
-            cache_entry_t *next = entry->next;
-            free(entry);
-            entry = next;
-        }
-        cache[i] = NULL;
+        reply_client(clients, errCode, hash, hex);
+        client_node_t *tmp = clients;
+        clients = clients->next;
+        conn_release(tmp->conn);
+        free(tmp);
     }
-    pthread_mutex_unlock(&cache_mutex);
+
+    free(req);
 }
 
 // Handles server termination: closes the FIFO descriptors, removes the FIFO, and exits the process
 void quit(int sig)
 {
-    // Shut down the server and terminate the threads
+    // Stop taking requests from the rings, then shut down the server and terminate the threads
+    if (ring_started)
+    {
+        shm_ring_stop();
+        pthread_join(ring_tid, NULL);
+        ring_started = 0;
+    }
     server_running = 0;
-    pthread_cond_broadcast(&list_cond);
+    if (watch_started)
+    {
+        pthread_join(watch_tid, NULL);
+        watch_started = 0;
+    }
+    for (int i = 0; i < thread_pool_size; i++)
+    {
+        pthread_mutex_lock(&run_queues[i].mutex);
+        pthread_cond_signal(&run_queues[i].cond);
+        pthread_mutex_unlock(&run_queues[i].mutex);
+    }
+    pthread_mutex_lock(&hit_mutex);
+    pthread_cond_broadcast(&hit_cond);
+    pthread_mutex_unlock(&hit_mutex);
 
     for (int i = 0; i < thread_pool_size; i++)
     {
         if (pthread_join(thread[i], NULL) != 0)
             perror("<Server> pthread_join failed");
     }
+    if (responder_started && pthread_join(responder_tid, NULL) != 0)
+        perror("<Server> pthread_join failed");
+
+    uint64_t cache_hits = metrics_counter(METRIC_CACHE_HITS);
+    uint64_t cache_misses = metrics_counter(METRIC_CACHE_MISSES);
+    printf("\n<Server> client served: %llu\n", (unsigned long long)metrics_counter(METRIC_CLIENTS_SERVED));
+    printf("<Server> Cache stats: hits=%llu misses=%llu (%.2f%% hit rate), %llu hits answered at intake\n",
+           (unsigned long long)cache_hits, (unsigned long long)cache_misses,
+           (double)cache_hits / (cache_hits + cache_misses) * 100,
+           (unsigned long long)metrics_counter(METRIC_INTAKE_HITS));
+    print_size_class_stats();
+    print_stage_stats();
+
+    cache_stats_t cstats;
+    cache_get_stats(&cstats);
+    printf("<Server> Cache table: %ld entries in %zu slots, %zu of %zu KiB used, %ld evictions, %ld stale\n",
+           cstats.entries, cstats.capacity, cstats.bytes / 1024, cstats.budget / 1024, cstats.evictions,
+           cstats.stale);
+
+    if (midstate_min_size != 0)
+    {
+        midstate_stats_t mstats;
+        midstate_get_stats(&mstats);
+        printf("<Server> Midstates: %ld saved, %ld digests resumed (%llu MiB not re-read), %ld prefixes changed\n",
+               mstats.saved, mstats.resumed, (unsigned long long)(mstats.bytes_skipped / (1024 * 1024)),
+               mstats.mismatches);
+    }
+
+    cdc_stats_t kstats;
+    cdc_get_stats(&kstats);
+    if (kstats.computed + kstats.hits > 0)
+        printf("<Server> Chunk lists: %ld computed (%llu chunks), %ld from the table, %ld resumed (%llu MiB not re-read), "
+               "%ld stored, %ld over budget\n",
+               kstats.computed, (unsigned long long)kstats.chunks, kstats.hits, kstats.resumed,
+               (unsigned long long)(kstats.bytes_reused / (1024 * 1024)), kstats.stored, kstats.dropped);
+
+    if (nwatch_roots > 0)
+    {
+        watch_stats_t wstats;
+        watch_get_stats(&wstats);
+        printf("<Server> Watcher: %ld directories, %ld files written, %ld hashed in the background, %ld dropped, %ld overflows\n",
+               wstats.dirs, wstats.events, prehash_done, prehash_dropped, wstats.overflows);
+        watch_close();
+    }
+
+    session_stats_t sstats;
+    session_get_stats(&sstats);
+    printf("<Server> Sessions: %ld client FIFOs opened, %ld responses on an open descriptor, %ld evicted\n",
+           sstats.opened, sstats.reused, sstats.evicted);
+    session_cleanup();
 
-    printf("\n<Server> client served: %ld\n", client_served);
-    printf("<Server> Cache stats: hits=%ld misses=%ld (%.2f%% hit rate)\n",
-           cache_hits, cache_misses,
-           (double)cache_hits / (cache_hits + cache_misses) * 100);
+    conn_stats_t nstats;
+    conn_get_stats(&nstats);
+    printf("<Server> Connections: %ld accepted, %ld open\n", nstats.accepted, nstats.open);
 
-    // cleanup the cache
+    shm_ring_stats_t rstats;
+    shm_ring_get_stats(&rstats);
+    printf("<Server> Rings: %ld clients attached, %ld requests, %ld completed, %ld dropped\n",
+           rstats.attached, rstats.requests, rstats.completed, rstats.dropped);
+    shm_ring_destroy();
+
+    // flush the persistent cache and cleanup the cache
+    cache_store_close();
     printf("<Server> Cleanup the cache\n");
     cache_cleanup();
+    midstate_cleanup();
+    cdc_cleanup();
 
     printf("<Server> Closing and removing FIFO %s...\n", path2ServerFIFO);
 
@@ -448,6 +1983,15 @@ void quit(int sig)
     if (unlink(path2ServerFIFO) == -1 && errno != ENOENT)
         perror("<Server> unlink failed for server FIFO\n");
 
+    // Stop listening and remove the socket; connections still open are closed by _exit()
+    if (serverSocket != -1)
+    {
+        printf("<Server> Closing and removing socket %s...\n", path2ServerSocket);
+        close(serverSocket);
+        if (unlink(path2ServerSocket) == -1 && errno != ENOENT)
+            perror("<Server> unlink failed for server socket\n");
+    }
+
     // Terminate the process
     _exit(0);
 }
@@ -455,147 +1999,665 @@ void quit(int sig)
 // Calls quit with a default signal value
 void quit_atexit(void) { quit(SIGINT); }
 
-// Computes the SHA256 hash of a file and writes it to the hash array
-short digest_file(const char *filename, uint8_t *hash)
+void request_metrics(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(metrics_pipe[1], &byte, 1) == -1)
+    {
+        // Pipe full: a dump is already on its way
+    }
+    errno = saved_errno;
+}
+
+void dump_metrics(void)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path2Metrics);
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+    {
+        perror("<Server> fopen failed for the metrics file");
+        return;
+    }
+
+    metrics_write(out);
+
+    size_t pending = 0;
+    for (int w = 0; w < thread_pool_size; w++)
+        pending += __atomic_load_n(&run_queues[w].pending, __ATOMIC_RELAXED);
+    cache_stats_t cstats;
+    cache_get_stats(&cstats);
+    metrics_write_gauge(out, "workers", "Worker threads", thread_pool_size);
+    metrics_write_gauge(out, "pending_requests", "Requests waiting in the run queues", pending);
+    metrics_write_gauge(out, "prehash_pending", "Written files waiting for a background hash",
+                        __atomic_load_n(&prehash_pending, __ATOMIC_RELAXED));
+    metrics_write_gauge(out, "cache_entries", "Digests in the cache", cstats.entries);
+    metrics_write_gauge(out, "cache_bytes", "Bytes used by the cache", cstats.bytes);
+    metrics_write_gauge(out, "cache_budget_bytes", "Memory budget of the cache", cstats.budget);
+
+    if (fclose(out) != 0 || rename(tmp, path2Metrics) == -1)
+    {
+        perror("<Server> failed to write the metrics file");
+        unlink(tmp);
+        return;
+    }
+    printf("<Server> Metrics written to %s\n", path2Metrics);
+}
+
+// Feeds a chunk read from the file into the digest context
+int digest_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    digest_ctx_t *dctx = ctx;
+    dctx->engine->update(dctx, data, len);
+    return 0;
+}
+
+// Computes the digest of a file and writes it to the hash array
+// The read engine (buffered, mmap or nocache) is selected from the file size
+short digest_file(const digest_engine_t *engine, const char *filename, uint8_t *hash)
 {
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
+    digest_ctx_t ctx;
+    if (engine->init(&ctx) != 0)
+    {
+        printf("<Server> Worker %ld: %s init failed for %s\n", pthread_self(), engine->name, filename);
+        return READ_FILE_E;
+    }
+
+    short errCode = read_file(filename, digest_sink, &ctx);
+    if (errCode != 0 && errCode != CLOSE_FILE_E)
+        return errCode;
 
-    char buffer[4096];
+    engine->final(&ctx, hash);
+    return errCode;
+}
 
-    int file = open(filename, O_RDONLY, 0);
-    if (file == -1)
+// Computes the tree SHA256 or the BLAKE3 digest of a file, sharing the chunks with idle workers
+short digest_tree(const char *filename, unsigned int alg, uint8_t *hash)
+{
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd == -1)
     {
         printf("<Server> Worker %ld: Can't open the file %s\n", pthread_self(), filename);
         return OPEN_FILE_E;
     }
 
-    ssize_t bR;
-    do
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return READ_FILE_E;
+    }
+
+    tree_job_t job = {.fd = fd, .pathname = filename, .filesize = st.st_size, .alg = alg, .errCode = 0};
+    job.nchunks = tree_hash_chunks(job.filesize);
+
+    // A BLAKE3 subtree is not a digest: a single chunk (shrunk since stat()) is hashed as a whole
+    if (alg == REQ_ALG_BLAKE3 && job.nchunks == 1)
+    {
+        close(fd);
+        return digest_file(digest_engine_for(alg), filename, hash);
+    }
+    job.leaves = malloc(job.nchunks * sizeof(*job.leaves));
+    if (!job.leaves)
+    {
+        printf("<Server> Worker %ld: Malloc failed, can't hash %s\n", pthread_self(), filename);
+        close(fd);
+        return READ_FILE_E;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    if (job.nchunks == 1)
+        tree_job_run(&job, 0);
+    else
+    {
+        // Publish the job so that idle workers can take chunks
+        printf("<Server> Worker %ld: tree hash of %s in %zu chunks\n", pthread_self(), filename, job.nchunks);
+        pthread_mutex_lock(&tree_mutex);
+        job.next = tree_job_head;
+        __atomic_store_n(&tree_job_head, &job, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&tree_mutex);
+        while (wake_idle_worker(~0ULL))
+            ;
+
+        // Hash chunks until all of them are claimed
+        for (;;)
+        {
+            pthread_mutex_lock(&tree_mutex);
+            long index = tree_job_claim(&job);
+            pthread_mutex_unlock(&tree_mutex);
+            if (index < 0)
+                break;
+            tree_job_run(&job, index);
+        }
+    }
+
+    // Wait for the chunks still being hashed by other workers
+    pthread_mutex_lock(&job.mutex);
+    while (job.done < job.nchunks)
+        pthread_cond_wait(&job.cond, &job.mutex);
+    pthread_mutex_unlock(&job.mutex);
+
+    short errCode = job.errCode;
+    if (errCode == 0 && alg == REQ_ALG_BLAKE3)
+        blake3_root((const uint8_t(*)[32])job.leaves, job.nchunks, hash);
+    else if (errCode == 0)
+        tree_hash_root(job.leaves, job.nchunks, hash);
+
+    free(job.leaves);
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.cond);
+
+    if (close(fd) != 0)
+    {
+        printf("<Server> close failed for %s", filename);
+        if (errCode == 0)
+            errCode = CLOSE_FILE_E;
+    }
+    return errCode;
+}
+
+// Claims the next chunk of a tree job (tree_mutex held)
+long tree_job_claim(tree_job_t *job)
+{
+    if (job->next_chunk >= job->nchunks)
+        return -1;
+
+    long index = job->next_chunk++;
+    if (job->next_chunk == job->nchunks)
+    {
+        // Last chunk claimed: nothing left for the other workers
+        tree_job_t **link = &tree_job_head;
+        while (*link && *link != job)
+            link = &(*link)->next;
+        if (*link)
+            __atomic_store_n(link, job->next, __ATOMIC_RELEASE); // idle workers read the head without tree_mutex
+    }
+    return index;
+}
+
+// Hashes a claimed chunk and reports its completion to the owner
+void tree_job_run(tree_job_t *job, size_t index)
+{
+    short errCode = job->alg == REQ_ALG_BLAKE3
+                        ? tree_hash_blake3_leaf(job->fd, job->pathname, job->filesize, index, job->leaves[index])
+                        : tree_hash_leaf(job->fd, job->pathname, job->filesize, index, job->leaves[index]);
+
+    pthread_mutex_lock(&job->mutex);
+    if (errCode != 0 && job->errCode == 0)
+        job->errCode = errCode;
+    if (++job->done == job->nchunks)
+        pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+// Parses the requests buffered from the server FIFO: a read may return several messages,
+// of every protocol, and end in the middle of one
+size_t parse_requests(const uint8_t *buf, size_t len, conn_t *conn)
+{
+    size_t off = 0;
+    while (off < len)
     {
-        // read the file in chunks of 4 KB
-        bR = read(file, buffer, sizeof(buffer));
-        if (bR > 0)
+        ssize_t size = request_size(buf + off, len - off);
+        if (size == 0)
+            break;
+        if (size < 0)
         {
-            SHA256_Update(&ctx, (uint8_t *)buffer, bR);
+            // The message boundaries are lost (a v1 request larger than PIPE_BUF may interleave
+            // with other writes): skip to the next offset where a request may start
+            printf("<Server> it looks like I did not receive a valid request\n");
+            do
+                off++;
+            while (off < len && request_size(buf + off, len - off) < 0);
+            continue;
         }
-        else if (bR < 0)
+
+        uint32_t magic;
+        memcpy(&magic, buf + off, sizeof(magic));
+        if (magic == PROTO_V2_MAGIC)
         {
-            printf("<Server> Worker %ld: Can't read the file\n", pthread_self());
-            close(file);
-            return READ_FILE_E;
+            struct RequestV2 header;
+            memcpy(&header, buf + off, sizeof(header));
+            parse_request_v2(buf + off, &header, conn);
         }
-    } while (bR > 0);
+        else
+            parse_request_v1(buf + off, conn);
+        off += size;
+    }
+    return off;
+}
 
-    SHA256_Final(hash, &ctx);
+// Checks a request as far as it was read: the message boundaries are not trusted
+ssize_t request_size(const uint8_t *msg, size_t len)
+{
+    if (len < sizeof(uint32_t))
+        return 0;
+    uint32_t magic;
+    memcpy(&magic, msg, sizeof(magic));
 
-    if (close(file) != 0)
+    // v2: a length-prefixed message
+    if (magic == PROTO_V2_MAGIC)
     {
-        printf("<Server> close failed for %s", filename);
-        return CLOSE_FILE_E;
+        if (len < sizeof(struct RequestV2))
+            return 0;
+        struct RequestV2 header;
+        memcpy(&header, msg, sizeof(header));
+        if (header.length < sizeof(header) || header.length > PROTO_MSG_MAX || header.cPid <= 0)
+            return -1;
+        return len < header.length ? 0 : header.length;
     }
-    return 0;
+
+    // v1.1: the magic, the PID and the flags, then the v1 pathname
+    size_t path_off = offsetof(struct Request, pathname), size = sizeof(struct Request);
+    if (magic == PROTO_V11_MAGIC)
+    {
+        path_off = offsetof(struct RequestV11, pathname), size = sizeof(struct RequestV11);
+        if (len >= path_off)
+        {
+            struct RequestV11 request;
+            memcpy(&request, msg, path_off);
+            if (request.cPid <= 0 || (request.flags & ~REQ_V1_FLAGS) != 0)
+                return -1;
+        }
+    }
+    else
+    {
+        // v1: a struct Request, which starts with the PID
+        pid_t pid;
+        memcpy(&pid, msg, sizeof(pid));
+        if (pid <= 0)
+            return -1;
+    }
+
+    if (len > path_off && !v1_pathname_valid(msg + path_off, len - path_off))
+        return -1;
+    return len < size ? 0 : (ssize_t)size;
+}
+
+// Clients fill the pathname with strncpy(): it is not empty and only zeros follow its end
+int v1_pathname_valid(const uint8_t *path, size_t len)
+{
+    if (len > PATH_MAX)
+        len = PATH_MAX;
+    if (path[0] == '\0')
+        return 0;
+    const uint8_t *end = memchr(path, '\0', len);
+    if (!end)
+        return len < PATH_MAX;
+    for (const uint8_t *p = end + 1; p < path + len; p++)
+        if (*p != '\0')
+            return 0;
+    return 1;
+}
+
+// A v1 request is a v1.1 request without flags
+void parse_request_v1(const uint8_t *msg, conn_t *conn)
+{
+    struct RequestV11 request;
+    uint32_t magic;
+    memcpy(&magic, msg, sizeof(magic));
+    if (magic == PROTO_V11_MAGIC)
+        memcpy(&request, msg, sizeof(request));
+    else
+    {
+        request.flags = 0;
+        memcpy(&request.cPid, msg + offsetof(struct Request, cPid), sizeof(request.cPid));
+        memcpy(request.pathname, msg + offsetof(struct Request, pathname), sizeof(request.pathname));
+    }
+
+    client_node_t client = {.pid = request.cPid, .version = 1, .conn = conn, .ring_client = -1};
+    printf("<Server> Received %s%s%s from client %d\n", request.pathname,
+           (request.flags & REQ_TREE_HASH) ? " (tree)" : "", alg_label(request.flags), request.cPid);
+    update_request_list(request.pathname, request.flags & REQ_KIND_MASK, &client);
+}
+
+// Queues the paths of a v2 message, each one as a request of its own
+void parse_request_v2(const uint8_t *msg, const struct RequestV2 *hdr, conn_t *conn)
+{
+    char pathname[PATH_MAX];
+    size_t off = sizeof(*hdr);
+    for (uint32_t i = 0; i < hdr->count; i++)
+    {
+        uint16_t path_len;
+        if (off + sizeof(path_len) > hdr->length)
+            break;
+        memcpy(&path_len, msg + off, sizeof(path_len));
+        off += sizeof(path_len);
+        if (path_len >= PATH_MAX || off + path_len > hdr->length)
+            break;
+        memcpy(pathname, msg + off, path_len);
+        pathname[path_len] = '\0';
+        off += path_len;
+
+        client_node_t client = {.pid = hdr->cPid, .version = 2, .flags = hdr->flags, .id = hdr->id + i, .conn = conn,
+                                .ring_client = -1};
+        printf("<Server> Received %s%s%s%s%s from client %d\n", pathname,
+               (hdr->flags & REQ_TREE_HASH) ? " (tree)" : "", alg_label(hdr->flags),
+               (hdr->flags & REQ_DIRECTORY) ? " (directory)" : "", (hdr->flags & REQ_CHUNKS) ? " (chunks)" : "",
+               hdr->cPid);
+        update_request_list(pathname, hdr->flags & (REQ_KIND_MASK | REQ_DIRECTORY | REQ_CHUNKS), &client);
+    }
+
+    // The client has all its responses: close its descriptor (a connection is closed by the client)
+    if ((hdr->flags & REQ_SESSION_END) && !conn)
+        session_end(hdr->cPid);
 }
 
-// Sends a Response to a client through its FIFO
-void fifo_client(struct Response *response, pid_t cPid)
+// Sends a Response to a client through its completion ring, its connection or its FIFO
+void reply_client(const client_node_t *client, short errCode, const uint8_t *hash, const char *hex)
 {
-    // Build the path to the client's FIFO
-    char path2ClientFIFO[PATH_MAX];
-    sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, cPid);
+    // A file of a directory request: the digest goes to the directory job
+    if (client->dir_entry)
+    {
+        dir_entry_done(client->dir_entry, errCode, hash);
+        return;
+    }
 
-    printf("<Server> Worker %ld: Sending a response to client PID %d...\n", pthread_self(), cPid);
-    // Open the client's FIFO in write-only mode
-    int clientFIFO = open(path2ClientFIFO, O_WRONLY);
-    if (clientFIFO == -1)
+    // Ring clients get the raw digest written in place, without a message or a system call
+    // unless the client sleeps (no log line either: these clients are the high-rate ones)
+    if (client->ring_client >= 0)
     {
-        printf("<Server> Worker %ld: failed to open client FIFO %s", pthread_self(), path2ClientFIFO);
+        uint64_t start = metrics_now();
+        int failed = shm_ring_complete(client->ring_client, client->ring_gen, client->id, errCode, hash) != 0;
+        metrics_since(STAGE_REPLY, start);
+        if (failed)
+        {
+            printf("<Server> Worker %ld: failed to complete the request of client %d\n", pthread_self(), client->pid);
+            metrics_add(METRIC_REPLY_ERRORS, 1);
+        }
+        else
+            metrics_add(METRIC_CLIENTS_SERVED, 1);
         return;
     }
 
-    // Write the Response into the opened FIFO
-    if (write(clientFIFO, response, sizeof(struct Response)) != sizeof(struct Response))
+    // Build the message in the protocol of the request
+    uint8_t msg[sizeof(struct ResponseV2) + 64];
+    size_t len;
+    if (client->version == 1)
     {
-        printf("<Server> Worker %ld: failed to write on client FIFO %s", pthread_self(), path2ClientFIFO);
+        struct Response response;
+        memset(&response, 0, sizeof(response));
+        response.errCode = errCode;
+        memcpy(response.hash, hex, sizeof(response.hash));
+        memcpy(msg, &response, sizeof(response));
+        len = sizeof(response);
     }
     else
     {
-        pthread_mutex_lock(&stats_mutex);
-        client_served++;
-        pthread_mutex_unlock(&stats_mutex);
+        struct ResponseV2 header = {.magic = PROTO_V2_MAGIC, .errCode = errCode, .id = client->id};
+        header.digest_len = !hash ? 0 : (client->flags & REQ_RAW_DIGEST) ? 32 : 64;
+        header.length = sizeof(header) + header.digest_len;
+        memcpy(msg, &header, sizeof(header));
+        if (header.digest_len)
+            memcpy(msg + sizeof(header), (client->flags & REQ_RAW_DIGEST) ? (const void *)hash : hex, header.digest_len);
+        len = header.length;
     }
 
-    // Close the FIFO
-    if (close(clientFIFO) == -1)
+    // Send the Response as one packet on the connection of the client, or write it into the
+    // client's FIFO (smaller than PIPE_BUF, so the write is atomic): on the descriptor of its
+    // session, or opened for this response only
+    printf("<Server> Worker %ld: Sending a response to client PID %d...\n", pthread_self(), client->pid);
+    uint64_t start = metrics_now();
+    int failed = send_to_client(client, msg, len) != 0;
+    metrics_since(STAGE_REPLY, start);
+    metrics_add(failed ? METRIC_REPLY_ERRORS : METRIC_CLIENTS_SERVED, 1);
+}
+
+int send_to_client(const client_node_t *client, const void *msg, size_t len)
+{
+    if (client->conn)
     {
-        printf("<Server> Worker %ld: failed to close client FIFO %s", pthread_self(), path2ClientFIFO);
-        return;
+        if (conn_send(client->conn, msg, len) != 0)
+        {
+            printf("<Server> Worker %ld: failed to send on the connection of client %d\n", pthread_self(), client->pid);
+            return -1;
+        }
+    }
+    else if (session_write(client->pid, client->flags & REQ_SESSION, msg, len) != 0)
+    {
+        printf("<Server> Worker %ld: failed to write on the FIFO of client %d\n", pthread_self(), client->pid);
+        return -1;
     }
+    return 0;
 }
 
-// djb2 hash function for pathname and mtime
-unsigned int hash_path(const char *path, time_t mtime)
+// Reads requests from the FIFO and updates the request list for worker threads;
+// one read may return several requests, the incomplete tail is kept for the next one
+int read_fifo_requests(void)
 {
-    unsigned int hash = 5381;
-    int c;
+    static uint8_t request_buf[REQUEST_BUF_SIZE];
+    static size_t buffered = 0;
 
-    // Process each character of the pathname
-    while ((c = *path++))
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+    ssize_t bR = read(serverFIFO, request_buf + buffered, sizeof(request_buf) - buffered);
+    if (bR == -1)
+    {
+        if (errno == EINTR)
+            return 0;
+        printf("<Server> it looks like the FIFO is broken\n");
+        return -1;
+    }
 
-    // Mix last modification time
-    hash = ((hash << 5) + hash) + (unsigned int)mtime;
+    buffered += bR;
+    size_t used = parse_requests(request_buf, buffered, NULL);
+    memmove(request_buf, request_buf + used, buffered - used);
+    buffered -= used;
+    return 0;
+}
 
-    return hash % CACHE_SIZE; // Keep index in range
+// Queues the requests of the submission ring until shm_ring_stop()
+void *ring_thread(void *arg)
+{
+    (void)arg;
+    static shm_request_t req;
+    while (shm_ring_receive(&req) == 0)
+    {
+        client_node_t client = {.pid = req.pid, .version = 2, .flags = req.flags | REQ_RAW_DIGEST, .id = req.id,
+                                .ring_client = req.slot, .ring_gen = req.gen};
+        update_request_list(req.path, req.flags & REQ_KIND_MASK, &client);
+    }
+    return NULL;
 }
 
-// Searches the cache for a previously computed SHA256
-// Returns pointer to cache entry or NULL if not found
-cache_entry_t *cache_lookup(const char *pathname, time_t mtime)
+// Accepts a client connection; the event loop keeps the first reference until the client closes it
+void accept_connection(void)
 {
-    // calculate the hash table entry
-    unsigned int idx = hash_path(pathname, mtime);
+    conn_t *conn = conn_accept(serverSocket);
+    if (!conn)
+    {
+        perror("<Server> accept failed");
+        return;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd(conn), &event) == -1)
+    {
+        perror("<Server> epoll_ctl failed for a connection");
+        conn_release(conn);
+    }
+}
 
-    cache_entry_t *entry = cache[idx];
-    while (entry)
+// Packets keep the message boundaries: a packet holds whole requests, anything left is dropped
+void read_connection(conn_t *conn)
+{
+    static uint8_t packet[REQUEST_BUF_SIZE];
+    ssize_t n = conn_recv(conn, packet, sizeof(packet));
+    if (n > 0)
     {
-        if (strcmp(entry->pathname, pathname) == 0 &&
-            entry->last_mod_time == mtime)
-            return entry; // cache HIT
-        entry = entry->next;
+        if (parse_requests(packet, n, conn) != (size_t)n)
+            printf("<Server> it looks like I did not receive a valid request\n");
+        return;
     }
-    return NULL; // cache MISS
+
+    // End of file or error: stop reading, the pending responses keep their references
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn_fd(conn), NULL);
+    conn_release(conn);
 }
 
 // Inserts a new SHA256 hash into the cache
-// Adds entry to head of chain for this bucket
-void cache_insert(const char *pathname, time_t mtime, const uint8_t *sha256)
+int cache_insert(request_list_t *req, unsigned int kind, const uint8_t *sha256)
+{
+    // The file must still be the version that was stat()ed when the request was queued,
+    // otherwise the digest may mix two versions and is only good for this reply
+    struct stat st;
+    file_id_t id;
+    if (stat(req->pathname, &st) != 0)
+        return -1;
+    file_id_from_stat(&id, &st);
+    if (!file_id_equal(&id, &req->id))
+    {
+        printf("<Server> Worker %ld: %s changed while hashing, not cached\n", pthread_self(), req->pathname);
+        return -1;
+    }
+
+    if (cache_put(&req->id, kind, sha256) != 0)
+    {
+        printf("<Server> Worker %ld: %s not stored in the cache\n", pthread_self(), req->pathname);
+        return -1;
+    }
+
+    // Persist the entry so that it survives a restart
+    cache_store_append(&req->id, kind, sha256);
+    return 0;
+}
+
+// Inserts an entry read from the cache file; the last record of an inode wins
+void cache_load_entry(const file_id_t *id, unsigned int kind, const uint8_t *sha256)
 {
-    // Hash table index
-    unsigned int index = hash_path(pathname, mtime);
+    if (cache_put(id, kind, sha256) != 0)
+        printf("<Server> inode %llu not loaded from the cache file\n", (unsigned long long)id->ino);
+}
+
+// Loads the persistent cache before the workers start
+void cache_warm_start(void)
+{
+    if (!cache_file)
+        return;
 
-    // New cache entry
-    cache_entry_t *new_entry = malloc(sizeof(cache_entry_t));
-    if (!new_entry)
+    long records = cache_store_open(cache_file, cache_load_entry);
+    if (records < 0)
     {
-        printf("<Server> Worker %ld: Malloc failed, %s not stored in the cache\n", pthread_self(), pathname);
+        printf("<Server> Cache file %s not usable, the cache stays in memory only\n", cache_file);
         return;
     }
+    cache_stats_t cstats;
+    cache_get_stats(&cstats);
+    printf("<Server> Cache file %s: %ld records, %ld entries loaded\n", cache_file, records, cstats.entries);
+
+    // Rewrite the log without the records overridden by later ones or evicted
+    cache_store_compact(cstats.entries, cache_walk);
+}
+
+// Parses the command line options
+void parse_options(int argc, char *argv[])
+{
+    const char *engine = NULL;
+    long batch = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "A:B:b:c:E:I:K:L:M:m:N:P:R:S:T:U:W:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'A': // aging step in ms: a waiting request is promoted by one size class per step, 0 disables it
+            aging_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'B': // multi-buffer batch size, 0 or 1 disables it
+            batch = strtol(optarg, NULL, 10);
+            break;
+        case 'b': // small-file limit for multi-buffer batches in KiB
+            mb_small_max = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'c': // persistent cache file
+            cache_file = optarg;
+            break;
+        case 'E': // SHA-256 engine: evp, native or scalar
+            engine = optarg;
+            break;
+        case 'I': // resumable hashing threshold in MiB, 0 disables it
+            midstate_min_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'K': // average chunk size of the chunk lists in KiB (power of two)
+            cdc_avg_size = strtoull(optarg, NULL, 10) * 1024;
+            if (cdc_avg_size == 0 || cdc_avg_size > 1024 * 1024 || (cdc_avg_size & (cdc_avg_size - 1)) != 0)
+            {
+                fprintf(stderr, "<Server> The average chunk size must be a power of two from 1 to 1024 KiB\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L': // workers reserved for large files (>= 1 MiB)
+            reserved_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'M': // mmap threshold in KiB
+            read_mmap_threshold = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'P': // metrics file written on SIGUSR1
+            path2Metrics = optarg;
+            break;
+        case 'R': // shared memory segment name, empty to disable the rings
+            ring_name = optarg;
+            break;
+        case 'S': // socket path, empty to serve the FIFO only
+            path2ServerSocket = optarg;
+            break;
+        case 'U': // io_uring threshold in KiB, 0 disables io_uring
+            read_uring_threshold = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'T': // worker threads, default: online CPUs - 1
+            thread_pool_size = strtol(optarg, NULL, 10);
+            break;
+        case 'm': // cache memory budget in MiB
+            cache_budget = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'N': // nocache threshold in MiB, 0 disables it
+            read_nocache_threshold = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'W': // directory tree to watch for written files, repeatable
+            if (nwatch_roots == WATCH_MAX_ROOTS)
+            {
+                fprintf(stderr, "<Server> At most %d trees can be watched\n", WATCH_MAX_ROOTS);
+                exit(EXIT_FAILURE);
+            }
+            watch_roots[nwatch_roots++] = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-A aging_ms] [-B batch_lanes] [-b batch_file_KiB] [-c cache_file] [-E evp|native|scalar]"
+                            " [-I resume_threshold_MiB] [-K chunk_avg_KiB] [-L large_workers] [-M mmap_threshold_KiB] [-m cache_budget_MiB] [-N nocache_threshold_MiB] [-P metrics_file] [-R shm_name] [-S socket_path] [-T threads] [-U uring_threshold_KiB] [-W watched_dir]...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    strncpy(new_entry->pathname, pathname, PATH_MAX - 1);
-    new_entry->pathname[PATH_MAX - 1] = '\0';
-    new_entry->last_mod_time = mtime;
-    memcpy(new_entry->sha256, sha256, 32);
+    // Select the SHA-256 engine and report which implementation is running
+    if (digest_engine_setup(engine) != 0)
+    {
+        fprintf(stderr, "<Server> SHA-256 engine %s is not available\n", engine ? engine : "(auto)");
+        exit(EXIT_FAILURE);
+    }
+    char description[256];
+    digest_engine_describe(description, sizeof(description));
+    printf("<Server> SHA-256 engine: %s\n", description);
+
+    // Multi-buffer batches are limited by the lanes of the SIMD kernel
+    sha256_mb_select();
+    mb_batch_size = batch < 0 || batch > sha256_mb_lanes() ? sha256_mb_lanes() : (batch < 1 ? 1 : batch);
+    if (mb_small_max == 0)
+        mb_batch_size = 1;
+    if (mb_batch_size > 1)
+        printf("<Server> Multi-buffer: %s kernel, batches of up to %d files <= %zu KiB\n",
+               sha256_mb_kernel(), mb_batch_size, mb_small_max / 1024);
+    else
+        printf("<Server> Multi-buffer: disabled (kernel: %s)\n", sha256_mb_kernel());
 
-    // Insert at head of collision chain, use the mutex for thread synchronization
-    pthread_mutex_lock(&cache_mutex);
-    new_entry->next = cache[index];
-    cache[index] = new_entry;
-    pthread_mutex_unlock(&cache_mutex);
+    // Check for io_uring once, the workers set up their own rings
+    read_engine_setup();
+    read_engine_describe(description, sizeof(description));
+    printf("<Server> Read engines: %s\n", description);
 }
 
 int main(int argc, char *argv[])
 {
+    parse_options(argc, argv);
+
     printf("<Server> Creating the server FIFO...\n");
     // Create the FIFO with the following permissions:
     // user: read, write; group: write; other: no permission
@@ -611,26 +2673,83 @@ int main(int argc, char *argv[])
     signal(SIGQUIT, quit);
     atexit(quit_atexit);
 
-    // Calculate the thread pool size based on available CPU cores ( -1 for the thread manager)
-    thread_pool_size = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    // A client that exits before its response must not kill the server: the write fails with EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    session_init(baseClientFIFO);
+
+    // Create the cache and load the digests computed by previous runs
+    cache_init(cache_budget);
+    cache_warm_start();
+    midstate_init(MIDSTATE_SLOTS);
+    if (midstate_min_size != 0)
+        printf("<Server> Resumable hashing of files >= %zu MiB\n", midstate_min_size / (1024 * 1024));
+    cdc_init(CDC_SLOTS, CDC_BUDGET);
+    printf("<Server> Chunk lists: %zu KiB average chunks, %zu MiB for %d files\n", cdc_avg_size / 1024,
+           CDC_BUDGET / (1024 * 1024), CDC_SLOTS);
+
+    // Calculate the thread pool size based on available CPU cores ( -1 for the thread manager) unless set with -T
+    if (thread_pool_size == 0)
+        thread_pool_size = sysconf(_SC_NPROCESSORS_ONLN) - 1;
     if (thread_pool_size >= MAX_THREADS)
         thread_pool_size = MAX_THREADS - 1;
     if (thread_pool_size < 1)
         thread_pool_size = 1; // Minimum 1 worker thread
 
-    printf("<Server> Creating %ld worker threads\n", thread_pool_size);
+    // At least one worker takes every size class
+    if (reserved_workers >= thread_pool_size)
+        reserved_workers = thread_pool_size - 1;
+    if (reserved_workers < 0)
+        reserved_workers = 0;
+    if (aging_ms < 0)
+        aging_ms = 0;
+    printf("<Server> Creating %ld worker threads (%ld reserved for files >= 1 MiB)\n", thread_pool_size, reserved_workers);
+    if (aging_ms > 0)
+        printf("<Server> Scheduler: smallest size class first, promoted by one class every %ld ms\n", aging_ms);
+    else
+        printf("<Server> Scheduler: smallest size class first, no aging\n");
 
     // Create the thread pool
+    scheduler_init();
     for (int i = 0; i < thread_pool_size; i++)
     {
-        if (pthread_create(&thread[i], NULL, worker_thread, NULL) != 0)
+        if (pthread_create(&thread[i], NULL, worker_thread, (void *)(intptr_t)i) != 0)
             errExit("pthread_create: failed to create worker thread\n");
     }
 
-    // Wait for clients: open the server FIFO in read-only mode
+    // Cache hits found at intake are sent by the responder; without it the workers send them
+    if (pthread_create(&responder_tid, NULL, responder_thread, NULL) == 0)
+        responder_started = 1;
+    else
+        printf("<Server> Failed to create the responder thread, cache hits go through the workers\n");
+
+    // Watch the trees given with -W; the files written there are hashed by the idle workers
+    if (nwatch_roots > 0)
+    {
+        if (watch_init() != 0)
+            printf("<Server> inotify is not available, no tree is watched\n");
+        else
+        {
+            for (int i = 0; i < nwatch_roots; i++)
+            {
+                if (watch_add_tree(watch_roots[i]) != 0)
+                    printf("<Server> Cannot watch %s\n", watch_roots[i]);
+            }
+            watch_stats_t wstats;
+            watch_get_stats(&wstats);
+            if (pthread_create(&watch_tid, NULL, watch_thread, NULL) == 0)
+            {
+                watch_started = 1;
+                printf("<Server> Watching %ld directories for written files\n", wstats.dirs);
+            }
+            else
+                printf("<Server> Failed to create the watcher thread, no tree is watched\n");
+        }
+    }
+
+    // Open the server FIFO in read-only mode, without waiting for a first client
     printf("<Server> Waiting for a client connection...\n");
-    serverFIFO = open(path2ServerFIFO, O_RDONLY);
-    if (serverFIFO == -1)
+    serverFIFO = open(path2ServerFIFO, O_RDONLY | O_NONBLOCK);
+    if (serverFIFO == -1 || fcntl(serverFIFO, F_SETFL, 0) == -1)
         errExit("<Server> open: failed to open server FIFO for reading");
 
     // Open an extra write descriptor to prevent EOF when all clients disconnect
@@ -638,28 +2757,76 @@ int main(int argc, char *argv[])
     if (serverFIFO_extra == -1)
         errExit("<Server> open: failed to open extra write descriptor for server FIFO");
 
-    // Read requests from the FIFO and update the request list for worker threads
-    struct Request request;
-    int bR = -1;
-    do
+    // The master waits on the FIFO, the listening socket, the connections and the metrics pipe;
+    // the event data is the connection, NULL for the FIFO, &serverSocket for the listener
+    // and metrics_pipe for the pipe
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        errExit("<Server> epoll_create1: failed to create the event loop");
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serverFIFO, &event) == -1)
+        errExit("<Server> epoll_ctl: failed to watch the server FIFO");
+
+    if (path2ServerSocket[0] != '\0')
     {
-        // Read a request from the FIFO
-        bR = read(serverFIFO, &request, sizeof(struct Request));
+        serverSocket = conn_listen(path2ServerSocket);
+        if (serverSocket == -1)
+            errExit("<Server> socket: failed to listen on the server socket");
+        event.data.ptr = &serverSocket;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serverSocket, &event) == -1)
+            errExit("<Server> epoll_ctl: failed to watch the server socket");
+        printf("<Server> Listening on socket %s\n", path2ServerSocket);
+    }
 
-        // Check the number of bytes read from the FIFO
-        if (bR == -1)
-        {
-            printf("<Server> it looks like the FIFO is broken\n");
-        }
-        else if (bR != sizeof(struct Request))
-            printf("<Server> it looks like I did not receive a valid request\n");
-        else
+    // SIGUSR1 dumps the metrics: the file is written by the master, not in the handler
+    if (pipe(metrics_pipe) == -1 || fcntl(metrics_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(metrics_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+        errExit("<Server> pipe: failed to create the metrics pipe");
+    event.data.ptr = metrics_pipe;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_pipe[0], &event) == -1)
+        errExit("<Server> epoll_ctl: failed to watch the metrics pipe");
+    signal(SIGUSR1, request_metrics);
+    printf("<Server> Metrics written to %s on SIGUSR1\n", path2Metrics);
+
+    // Shared-memory clients submit to a ring consumed by a thread: it can sleep on a futex,
+    // which epoll cannot wait for
+    if (ring_name[0] != '\0')
+    {
+        if (shm_ring_create(ring_name) != 0)
+            errExit("<Server> shm_open: failed to create the shared memory rings");
+        if (pthread_create(&ring_tid, NULL, ring_thread, NULL) != 0)
+            errExit("<Server> pthread_create: failed to create the ring thread");
+        ring_started = 1;
+        printf("<Server> Shared memory rings at %s\n", ring_name);
+    }
+
+    // Dispatch the events: requests are queued for the worker threads, responses are sent by the workers
+    int broken = 0;
+    while (!broken)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno != EINTR)
+            errExit("<Server> epoll_wait: the event loop failed");
+
+        for (int i = 0; i < n; i++)
         {
-            printf("<Server> Received %s from client %d\n", request.pathname, request.cPid);
-            update_request_list(&request);
+            if (events[i].data.ptr == NULL)
+                broken = read_fifo_requests() == -1;
+            else if (events[i].data.ptr == &serverSocket)
+                accept_connection();
+            else if (events[i].data.ptr == metrics_pipe)
+            {
+                // One dump answers all the signals received so far
+                char drain[64];
+                while (read(metrics_pipe[0], drain, sizeof(drain)) > 0)
+                    ;
+                dump_metrics();
+            }
+            else
+                read_connection(events[i].data.ptr);
         }
-
-    } while (bR != -1);
+    }
 
     // The FIFO is broken, run quit() to remove the FIFO and terminate the process
     quit(0);
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "session.h"
+#include "request_response.h"
+
+#define SESSION_MAX 256 // sessions kept open at once, the least recently used idle one is evicted
+
+typedef struct
+{
+    pid_t pid;                  // Client PID, 0 for a free entry
+    int fd;                     // Write descriptor of the client FIFO, -1 until the first response
+    int users;                  // Workers writing on fd
+    int ending;                 // Closed as soon as users drops to 0
+    unsigned long last_use;     // For the eviction of idle sessions
+    pthread_mutex_t open_mutex; // Serializes the open of the client FIFO
+} session_t;
+
+static session_t sessions[SESSION_MAX];
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char base_path[PATH_MAX];
+static unsigned long use_clock = 0;
+static session_stats_t counters;
+
+// Opens the FIFO of a client for writing
+static int open_fifo(pid_t pid)
+{
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s%d", base_path, pid);
+    return open(path, O_WRONLY);
+}
+
+// Open, write, close: for clients without a session
+static int write_once(pid_t pid, const void *msg, size_t len)
+{
+    int fd = open_fifo(pid);
+    if (fd == -1)
+        return -1;
+    int rc = write(fd, msg, len) == (ssize_t)len ? 0 : -1;
+    if (close(fd) == -1)
+        rc = -1;
+    return rc;
+}
+
+// Closes a session and frees its entry (session_mutex held, no users)
+static void session_close(session_t *s)
+{
+    if (s->fd != -1)
+        close(s->fd);
+    s->fd = -1;
+    s->pid = 0;
+    s->ending = 0;
+}
+
+// Returns the live session of pid, creating it if there is room or an idle session to evict;
+// NULL if every entry is in use (session_mutex held)
+static session_t *session_get(pid_t pid)
+{
+    session_t *entry = NULL, *idle = NULL;
+    for (int i = 0; i < SESSION_MAX; i++)
+    {
+        session_t *s = &sessions[i];
+        if (s->pid == pid && !s->ending)
+            return s;
+        if (s->pid == 0)
+        {
+            if (!entry)
+                entry = s;
+        }
+        else if (s->users == 0 && (!idle || s->last_use < idle->last_use))
+            idle = s;
+    }
+
+    if (!entry && idle)
+    {
+        session_close(idle);
+        counters.evicted++;
+        entry = idle;
+    }
+    if (entry)
+    {
+        entry->pid = pid;
+        entry->fd = -1;
+        entry->users = 0;
+    }
+    return entry;
+}
+
+void session_init(const char *base_fifo)
+{
+    strncpy(base_path, base_fifo, sizeof(base_path) - 1);
+    for (int i = 0; i < SESSION_MAX; i++)
+    {
+        sessions[i].fd = -1;
+        pthread_mutex_init(&sessions[i].open_mutex, NULL);
+    }
+}
+
+int session_write(pid_t pid, int keep, const void *msg, size_t len)
+{
+    session_t *s = NULL;
+    if (keep)
+    {
+        pthread_mutex_lock(&session_mutex);
+        s = session_get(pid);
+        if (s)
+        {
+            s->users++;
+            s->last_use = ++use_clock;
+        }
+        pthread_mutex_unlock(&session_mutex);
+    }
+    if (!s)
+        return write_once(pid, msg, len);
+
+    // The first response opens the FIFO; the descriptor can't be closed while users > 0
+    pthread_mutex_lock(&s->open_mutex);
+    int reused = s->fd != -1;
+    if (!reused)
+        s->fd = open_fifo(pid);
+    int fd = s->fd;
+    pthread_mutex_unlock(&s->open_mutex);
+
+    int rc = fd != -1 && write(fd, msg, len) == (ssize_t)len ? 0 : -1;
+    int broken = rc != 0 && errno == EPIPE;
+
+    pthread_mutex_lock(&session_mutex);
+    if (fd != -1)
+    {
+        if (reused)
+            counters.reused++;
+        else
+            counters.opened++;
+    }
+    // A failed write means that the client is gone: end the session
+    s->users--;
+    if (rc != 0)
+        s->ending = 1;
+    if (s->ending && s->users == 0)
+        session_close(s);
+    pthread_mutex_unlock(&session_mutex);
+
+    // A cached descriptor may belong to a former client with the same PID: retry on a new session
+    if (broken && reused)
+        return session_write(pid, keep, msg, len);
+    return rc;
+}
+
+void session_end(pid_t pid)
+{
+    pthread_mutex_lock(&session_mutex);
+    for (int i = 0; i < SESSION_MAX; i++)
+    {
+        session_t *s = &sessions[i];
+        if (s->pid == pid && !s->ending)
+        {
+            s->ending = 1;
+            if (s->users == 0)
+                session_close(s);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session_mutex);
+}
+
+void session_get_stats(session_stats_t *stats)
+{
+    pthread_mutex_lock(&session_mutex);
+    *stats = counters;
+    pthread_mutex_unlock(&session_mutex);
+}
+
+void session_cleanup(void)
+{
+    pthread_mutex_lock(&session_mutex);
+    for (int i = 0; i < SESSION_MAX; i++)
+    {
+        if (sessions[i].pid != 0)
+            session_close(&sessions[i]);
+    }
+    pthread_mutex_unlock(&session_mutex);
+}
@@ -0,0 +1,351 @@
+#include <string.h>
+
+#include "sha256_mb.h"
+#include "sha256_native.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SHA256_MB_HAVE_X86 1
+#endif
+
+// Per-lane view of a message: full blocks are read in place, the padded tail from tail[]
+typedef struct
+{
+    const uint8_t *msg;
+    size_t full;       // full 64-byte blocks in msg
+    size_t nblocks;    // full blocks + 1 or 2 padding blocks
+    uint8_t tail[128]; // last partial block, 0x80, zeros and bit length
+} mb_lane_t;
+
+// Zero block fed to lanes that already finished (their state is not updated)
+static const uint8_t mb_idle_block[64] = {0};
+
+// Prepares the padded tail of a message
+static void mb_lane_setup(mb_lane_t *lane, const uint8_t *msg, size_t len)
+{
+    size_t rem = len % 64;
+    uint64_t bits = (uint64_t)len * 8;
+
+    lane->msg = msg;
+    lane->full = len / 64;
+    memset(lane->tail, 0, sizeof(lane->tail));
+    if (rem)
+        memcpy(lane->tail, msg + lane->full * 64, rem);
+    lane->tail[rem] = 0x80;
+
+    size_t tail_len = rem + 9 > 64 ? 128 : 64;
+    for (int i = 0; i < 8; i++)
+        lane->tail[tail_len - 1 - i] = (uint8_t)(bits >> (8 * i));
+    lane->nblocks = lane->full + tail_len / 64;
+}
+
+// Returns the block b of the lane
+static const uint8_t *mb_lane_block(const mb_lane_t *lane, size_t b)
+{
+    if (b < lane->full)
+        return lane->msg + b * 64;
+    if (b < lane->nblocks)
+        return lane->tail + (b - lane->full) * 64;
+    return mb_idle_block;
+}
+
+// Writes the big-endian digest of a chaining value
+static void mb_store_digest(const uint32_t h[8], uint8_t out[32])
+{
+    for (int i = 0; i < 8; i++)
+    {
+        out[4 * i] = (uint8_t)(h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)h[i];
+    }
+}
+
+#ifdef SHA256_MB_HAVE_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f,avx2")))
+
+// Loads the 16 message words of 8 lanes: w[t] holds word t of every lane, byte swapped
+AVX2_TARGET static inline void mb_load8(const uint8_t *const blocks[8], __m256i w[16])
+{
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i r[8], t[8], u[8];
+        for (int i = 0; i < 8; i++)
+            r[i] = _mm256_loadu_si256((const __m256i *)(blocks[i] + 32 * half));
+
+        // 8x8 transpose of 32-bit words
+        for (int i = 0; i < 8; i += 2)
+        {
+            t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+            t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+        }
+        for (int i = 0; i < 8; i += 4)
+        {
+            u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+            u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+            u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+            u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            w[8 * half + i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+            w[8 * half + i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+        }
+    }
+}
+
+#define ROR256(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+// 8-lane AVX2 kernel
+AVX2_TARGET static void sha256_mb_avx2(mb_lane_t *lanes, int n, uint8_t (*out)[32])
+{
+    __m256i s[8], w[16];
+    uint32_t lane_h[8][8];
+    const uint8_t *blocks[8];
+    size_t max_blocks = 0;
+
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_set1_epi32((int)sha256_h0[i]);
+    for (int l = 0; l < n; l++)
+        if (lanes[l].nblocks > max_blocks)
+            max_blocks = lanes[l].nblocks;
+
+    for (size_t b = 0; b < max_blocks; b++)
+    {
+        int32_t active[8];
+        for (int l = 0; l < 8; l++)
+        {
+            blocks[l] = l < n ? mb_lane_block(&lanes[l], b) : mb_idle_block;
+            active[l] = l < n && b < lanes[l].nblocks ? -1 : 0;
+        }
+        __m256i mask = _mm256_loadu_si256((const __m256i *)active);
+        mb_load8(blocks, w);
+
+        __m256i a = s[0], bb = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; t++)
+        {
+            if (t >= 16)
+            {
+                __m256i w15 = w[(t + 1) & 15], w2 = w[(t + 14) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR256(w15, 7), ROR256(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR256(w2, 17), ROR256(w2, 19)), _mm256_srli_epi32(w2, 10));
+                w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t + 9) & 15], s1));
+            }
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ROR256(e, 6), ROR256(e, 11)), ROR256(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, w[t & 15]));
+            t1 = _mm256_add_epi32(t1, _mm256_set1_epi32((int)sha256_k[t]));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ROR256(a, 2), ROR256(a, 13)), ROR256(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, _mm256_or_si256(bb, c)), _mm256_and_si256(bb, c));
+            __m256i t2 = _mm256_add_epi32(S0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+
+        // Finished lanes keep their chaining value
+        __m256i v[8] = {a, bb, c, d, e, f, g, h};
+        for (int i = 0; i < 8; i++)
+            s[i] = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], v[i]), mask);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t tmp[8];
+        _mm256_storeu_si256((__m256i *)tmp, s[i]);
+        for (int l = 0; l < n; l++)
+            lane_h[l][i] = tmp[l];
+    }
+    for (int l = 0; l < n; l++)
+        mb_store_digest(lane_h[l], out[l]);
+}
+
+// 16-lane AVX-512 kernel, messages are transposed 8 lanes at a time
+AVX512_TARGET static void sha256_mb_avx512(mb_lane_t *lanes, int n, uint8_t (*out)[32])
+{
+    __m512i s[8], w[16];
+    uint32_t lane_h[16][8];
+    const uint8_t *blocks[16];
+    size_t max_blocks = 0;
+
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm512_set1_epi32((int)sha256_h0[i]);
+    for (int l = 0; l < n; l++)
+        if (lanes[l].nblocks > max_blocks)
+            max_blocks = lanes[l].nblocks;
+
+    for (size_t b = 0; b < max_blocks; b++)
+    {
+        __mmask16 active = 0;
+        for (int l = 0; l < 16; l++)
+        {
+            blocks[l] = l < n ? mb_lane_block(&lanes[l], b) : mb_idle_block;
+            if (l < n && b < lanes[l].nblocks)
+                active |= (__mmask16)(1u << l);
+        }
+
+        __m256i lo[16], hi[16];
+        mb_load8(blocks, lo);
+        mb_load8(blocks + 8, hi);
+        for (int t = 0; t < 16; t++)
+            w[t] = _mm512_inserti64x4(_mm512_castsi256_si512(lo[t]), hi[t], 1);
+
+        __m512i a = s[0], bb = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; t++)
+        {
+            if (t >= 16)
+            {
+                __m512i w15 = w[(t + 1) & 15], w2 = w[(t + 14) & 15];
+                __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18), _mm512_srli_epi32(w15, 3), 0x96);
+                __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19), _mm512_srli_epi32(w2, 10), 0x96);
+                w[t & 15] = _mm512_add_epi32(_mm512_add_epi32(w[t & 15], s0), _mm512_add_epi32(w[(t + 9) & 15], s1));
+            }
+            __m512i S1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25), 0x96);
+            __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+            __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, w[t & 15]));
+            t1 = _mm512_add_epi32(t1, _mm512_set1_epi32((int)sha256_k[t]));
+            __m512i S0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22), 0x96);
+            __m512i maj = _mm512_ternarylogic_epi32(a, bb, c, 0xE8);
+            __m512i t2 = _mm512_add_epi32(S0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm512_add_epi32(d, t1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm512_add_epi32(t1, t2);
+        }
+
+        // Finished lanes keep their chaining value
+        __m512i v[8] = {a, bb, c, d, e, f, g, h};
+        for (int i = 0; i < 8; i++)
+            s[i] = _mm512_mask_add_epi32(s[i], active, s[i], v[i]);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t tmp[16];
+        _mm512_storeu_si512((void *)tmp, s[i]);
+        for (int l = 0; l < n; l++)
+            lane_h[l][i] = tmp[l];
+    }
+    for (int l = 0; l < n; l++)
+        mb_store_digest(lane_h[l], out[l]);
+}
+#endif
+
+// Selected kernel, none until sha256_mb_select() runs
+static int mb_lanes = 1;
+static const char *mb_kernel_name = "none";
+
+// Self-test messages: message l is the bytes i % 251 from offset l, of length mb_test_lens[l];
+// the lengths cover empty, one and two padding blocks, and many blocks
+#define MB_TEST_LEN_MAX 4133
+static const size_t mb_test_lens[SHA256_MB_MAX_LANES] = {0,   1,   3,   55,  56,  63,   64,   65,
+                                                          119, 120, 127, 128, 200, 1000, 4095, 4133};
+
+// SHA-256 of the 16 digests of the self-test messages, in order
+static const uint8_t mb_test_kat[32] = {
+    0x60, 0xa4, 0x12, 0x1b, 0x89, 0x45, 0x4c, 0x80, 0xb4, 0x73, 0x53, 0x92, 0xdb, 0xaf, 0x0b, 0x0a,
+    0x76, 0xb9, 0x36, 0x22, 0xbe, 0xc1, 0xe6, 0xf1, 0x4a, 0x5c, 0x2d, 0x85, 0x51, 0xc2, 0x35, 0x14,
+};
+
+// Hashes the self-test messages in full batches, then in partial ones, with the selected kernel;
+// returns 0 if both give the known digests
+static int mb_selftest(void)
+{
+    uint8_t data[MB_TEST_LEN_MAX + SHA256_MB_MAX_LANES];
+    const uint8_t *msgs[SHA256_MB_MAX_LANES];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i % 251);
+    for (int l = 0; l < SHA256_MB_MAX_LANES; l++)
+        msgs[l] = data + l;
+
+    int batches[2] = {mb_lanes, mb_lanes > 3 ? mb_lanes - 3 : 1};
+    for (int b = 0; b < 2; b++)
+    {
+        uint8_t out[SHA256_MB_MAX_LANES][32], check[32];
+        for (int l = 0; l < SHA256_MB_MAX_LANES; l += batches[b])
+        {
+            int n = SHA256_MB_MAX_LANES - l < batches[b] ? SHA256_MB_MAX_LANES - l : batches[b];
+            sha256_mb_digest(msgs + l, mb_test_lens + l, n, out + l);
+        }
+        sha256_state_t st;
+        sha256_native_init(&st);
+        sha256_native_update(&st, &out[0][0], sizeof(out));
+        sha256_native_final(&st, check);
+        if (memcmp(check, mb_test_kat, sizeof(check)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void sha256_mb_select(void)
+{
+    mb_lanes = 1;
+    mb_kernel_name = "none";
+#ifdef SHA256_MB_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        mb_lanes = 16;
+        mb_kernel_name = "avx512";
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        mb_lanes = 8;
+        mb_kernel_name = "avx2";
+    }
+#endif
+
+    // A kernel that gets a lane wrong is not used
+    if (mb_lanes > 1 && mb_selftest() != 0)
+    {
+        mb_lanes = 1;
+        mb_kernel_name = "none (self-test failed)";
+    }
+}
+
+int sha256_mb_lanes(void) { return mb_lanes; }
+
+const char *sha256_mb_kernel(void) { return mb_kernel_name; }
+
+void sha256_mb_digest(const uint8_t *const *msgs, const size_t *lens, int n, uint8_t (*out)[32])
+{
+    mb_lane_t lanes[SHA256_MB_MAX_LANES];
+    for (int l = 0; l < n; l++)
+        mb_lane_setup(&lanes[l], msgs[l], lens[l]);
+
+#ifdef SHA256_MB_HAVE_X86
+    if (mb_lanes == 16 && n > 8)
+    {
+        sha256_mb_avx512(lanes, n, out);
+        return;
+    }
+    if (mb_lanes >= 8)
+    {
+        // Batches that fit in 8 lanes don't need the 512-bit kernel
+        for (int l = 0; l < n; l += 8)
+            sha256_mb_avx2(lanes + l, n - l < 8 ? n - l : 8, out + l);
+        return;
+    }
+#endif
+
+    // No SIMD kernel: one message at a time
+    for (int l = 0; l < n; l++)
+    {
+        sha256_state_t st;
+        sha256_native_init(&st);
+        sha256_native_update(&st, msgs[l], lens[l]);
+        sha256_native_final(&st, out[l]);
+    }
+}
@@ -0,0 +1,280 @@
+#include <string.h>
+
+#include "sha256_native.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_HAVE_X86 1
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define SHA256_HAVE_ARM 1
+#endif
+
+// SHA-256 round constants (FIPS 180-4, 4.2.2)
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint32_t sha256_h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Portable kernel
+static void sha256_blocks_scalar(uint32_t h[8], const uint8_t *data, size_t nblocks)
+{
+    uint32_t w[64];
+    while (nblocks--)
+    {
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | (uint32_t)data[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+        data += 64;
+    }
+}
+
+#ifdef SHA256_HAVE_X86
+// Intel SHA extensions kernel: 4 rounds per group, message schedule kept in 4 registers
+__attribute__((target("sha,sse4.1,ssse3"))) static void sha256_blocks_shani(uint32_t h[8], const uint8_t *data, size_t nblocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+    __m128i m[4];
+
+    // Reorder the chaining value into the ABEF/CDGH layout used by sha256rnds2
+    tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);           // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);     // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8);     // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);  // CDGH
+
+    while (nblocks--)
+    {
+        abef_save = state0;
+        cdgh_save = state1;
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++)
+        {
+            if (i < 4)
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), MASK);
+
+            msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (i >= 3 && i <= 14)
+            {
+                // Finish the schedule of the next group with the words just consumed
+                tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+                m[(i + 1) & 3] = _mm_add_epi32(m[(i + 1) & 3], tmp);
+                m[(i + 1) & 3] = _mm_sha256msg2_epu32(m[(i + 1) & 3], m[i & 3]);
+            }
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (i >= 1 && i <= 12)
+                m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    // Back to the A..H layout
+    tmp = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);     // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);  // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);     // EFGH
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+// CPUID leaf 7: EBX bit 29 reports the SHA extensions
+static int cpu_has_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    if (!(ebx & (1u << 29)))
+        return 0;
+    // SSE4.1 (leaf 1, ECX bit 19) is needed for the blend
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ecx & (1u << 19)) != 0;
+}
+#endif
+
+#ifdef SHA256_HAVE_ARM
+#if defined(__clang__)
+#define SHA256_ARM_TARGET __attribute__((target("crypto")))
+#else
+#define SHA256_ARM_TARGET __attribute__((target("arch=armv8-a+crypto")))
+#endif
+
+// ARMv8 cryptography extensions kernel
+SHA256_ARM_TARGET static void sha256_blocks_armv8(uint32_t h[8], const uint8_t *data, size_t nblocks)
+{
+    uint32x4_t state0 = vld1q_u32(&h[0]);
+    uint32x4_t state1 = vld1q_u32(&h[4]);
+    uint32x4_t m[4], tmp, save0;
+
+    while (nblocks--)
+    {
+        uint32x4_t abcd_save = state0, efgh_save = state1;
+
+        for (int i = 0; i < 4; i++)
+            m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++)
+        {
+            tmp = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+            if (i < 12)
+                m[i & 3] = vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]);
+            save0 = state0;
+            state0 = vsha256hq_u32(state0, state1, tmp);
+            state1 = vsha256h2q_u32(state1, save0, tmp);
+            if (i < 12)
+                m[i & 3] = vsha256su1q_u32(m[i & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&h[0], state0);
+    vst1q_u32(&h[4], state1);
+}
+#endif
+
+// Selected kernel, scalar until sha256_native_select() runs
+static sha256_blocks_fn sha256_blocks = sha256_blocks_scalar;
+static const char *sha256_kernel_name = "scalar";
+
+void sha256_native_select(int force_scalar)
+{
+    sha256_blocks = sha256_blocks_scalar;
+    sha256_kernel_name = "scalar";
+    if (force_scalar)
+        return;
+
+#ifdef SHA256_HAVE_X86
+    if (cpu_has_shani())
+    {
+        sha256_blocks = sha256_blocks_shani;
+        sha256_kernel_name = "sha-ni";
+    }
+#elif defined(SHA256_HAVE_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+    {
+        sha256_blocks = sha256_blocks_armv8;
+        sha256_kernel_name = "armv8-ce";
+    }
+#endif
+}
+
+const char *sha256_native_kernel(void) { return sha256_kernel_name; }
+
+void sha256_native_init(sha256_state_t *st)
+{
+    memcpy(st->h, sha256_h0, sizeof(sha256_h0));
+    st->total = 0;
+    st->buflen = 0;
+}
+
+void sha256_native_update(sha256_state_t *st, const uint8_t *data, size_t len)
+{
+    st->total += len;
+
+    // Complete a pending partial block first
+    if (st->buflen)
+    {
+        size_t n = 64 - st->buflen < len ? 64 - st->buflen : len;
+        memcpy(st->buf + st->buflen, data, n);
+        st->buflen += n;
+        data += n;
+        len -= n;
+        if (st->buflen < 64)
+            return;
+        sha256_blocks(st->h, st->buf, 1);
+        st->buflen = 0;
+    }
+
+    // Whole blocks go straight to the kernel
+    if (len >= 64)
+    {
+        sha256_blocks(st->h, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(st->buf, data, len);
+    st->buflen = len;
+}
+
+void sha256_native_final(sha256_state_t *st, uint8_t out[32])
+{
+    uint64_t bits = st->total * 8;
+
+    // Padding: 0x80, zeros, then the 64-bit big-endian message length
+    st->buf[st->buflen++] = 0x80;
+    if (st->buflen > 56)
+    {
+        memset(st->buf + st->buflen, 0, 64 - st->buflen);
+        sha256_blocks(st->h, st->buf, 1);
+        st->buflen = 0;
+    }
+    memset(st->buf + st->buflen, 0, 56 - st->buflen);
+    for (int i = 0; i < 8; i++)
+        st->buf[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_blocks(st->h, st->buf, 1);
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[4 * i] = (uint8_t)(st->h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(st->h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(st->h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)st->h[i];
+    }
+}
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+
+#define SHM_RING_MAGIC 0x53524e01u // layout version in the low byte
+
+// Futex word with a count of sleepers, so that a producer only makes a syscall if someone waits
+typedef struct
+{
+    uint32_t seq;     // Incremented by every signal, the futex word
+    uint32_t waiters; // Threads or processes sleeping on seq
+} ring_event_t;
+
+// Submission ring slot; the path is written in place by the client
+typedef struct
+{
+    uint32_t seq;       // Ring sequence: position + 1 once published
+    uint16_t slot;      // Client slot
+    uint16_t path_len;  // Path length, no terminator
+    int32_t pid;        // Client PID
+    uint32_t gen;       // Generation of the client slot
+    uint32_t id;        // Request ID
+    uint32_t flags;     // REQ_* flags
+    char path[PATH_MAX];
+} sq_slot_t;
+
+// Completion ring slot
+typedef struct
+{
+    uint32_t seq;       // Ring sequence: position + 1 once published
+    uint32_t gen;       // Generation of the client slot when the request was submitted
+    uint32_t id;        // Request ID
+    int16_t errCode;    // Error code
+    uint16_t reserved;
+    uint8_t sha256[32]; // Raw digest
+} cq_slot_t;
+
+// Client slot: owner and completion ring
+typedef struct
+{
+    int32_t owner;                                // PID of the attached client, 0 for a free slot
+    uint32_t gen;                                 // Incremented at every attach
+    uint32_t cq_head __attribute__((aligned(64))); // Next position to claim (workers)
+    uint32_t cq_tail __attribute__((aligned(64))); // Next position to read (client)
+    ring_event_t cq_event;                        // Signaled for every completion
+    cq_slot_t cq[SHM_CQ_SLOTS];
+} __attribute__((aligned(64))) client_slot_t;
+
+// The whole segment
+typedef struct
+{
+    uint32_t magic;                                // SHM_RING_MAGIC once initialized
+    int32_t server_pid;                            // To detect a server that died
+    uint32_t running;                              // Cleared at shutdown
+    uint32_t sq_head __attribute__((aligned(64))); // Next position to claim (clients)
+    uint32_t sq_tail __attribute__((aligned(64))); // Next position to read (server)
+    ring_event_t sq_event;                         // Signaled for every request
+    ring_event_t sq_space;                         // Signaled when a full ring is consumed
+    sq_slot_t sq[SHM_SQ_SLOTS];
+    client_slot_t clients[SHM_CLIENTS];
+} shm_layout_t;
+
+struct shm_ring_client
+{
+    shm_layout_t *ring;
+    unsigned int slot;
+    uint32_t gen;
+};
+
+// Server side state
+static shm_layout_t *server_ring = NULL;
+static char server_name[NAME_MAX];
+static shm_ring_stats_t counters; // atomic
+
+/* ------------------------------- futex and rings ------------------------------- */
+
+// The segment is shared between processes: no FUTEX_PRIVATE_FLAG
+static void futex_wait(uint32_t *addr, uint32_t val, const struct timespec *timeout)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Read before checking the condition: a signal after this load makes the wait return at once
+static uint32_t event_prepare(ring_event_t *ev)
+{
+    return __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+}
+
+static void event_wait(ring_event_t *ev, uint32_t seen, const struct timespec *timeout)
+{
+    __atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&ev->seq, seen, timeout);
+    __atomic_sub_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void event_signal(ring_event_t *ev)
+{
+    __atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST) != 0)
+        futex_wake(&ev->seq);
+}
+
+// Claims the slot at the head of a ring (several producers). Returns NULL if the ring is full;
+// the slot belongs to the caller until ring_publish()
+static uint32_t *ring_claim(uint32_t *head, void *slots, size_t stride, uint32_t mask, uint32_t *pos)
+{
+    uint32_t p = __atomic_load_n(head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint32_t *seq = (uint32_t *)((uint8_t *)slots + (p & mask) * stride);
+        int32_t diff = (int32_t)(__atomic_load_n(seq, __ATOMIC_ACQUIRE) - p);
+        if (diff == 0)
+        {
+            // On failure p is reloaded with the current head
+            if (__atomic_compare_exchange_n(head, &p, p + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *pos = p;
+                return seq;
+            }
+        }
+        else if (diff < 0)
+            return NULL; // the consumer has not released the slot of the previous lap
+        else
+            p = __atomic_load_n(head, __ATOMIC_RELAXED);
+    }
+}
+
+static void ring_publish(uint32_t *seq, uint32_t pos)
+{
+    __atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the slot at the tail of a ring if it is published (single consumer), NULL otherwise
+static uint32_t *ring_peek(uint32_t *tail, void *slots, size_t stride, uint32_t mask)
+{
+    uint32_t p = __atomic_load_n(tail, __ATOMIC_RELAXED);
+    uint32_t *seq = (uint32_t *)((uint8_t *)slots + (p & mask) * stride);
+    return __atomic_load_n(seq, __ATOMIC_ACQUIRE) == p + 1 ? seq : NULL;
+}
+
+// Gives the slot at the tail back to the producers of the next lap
+static void ring_release(uint32_t *tail, uint32_t *seq, uint32_t mask)
+{
+    uint32_t p = __atomic_load_n(tail, __ATOMIC_RELAXED);
+    __atomic_store_n(seq, p + mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(tail, p + 1, __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------- server side ---------------------------------- */
+
+int shm_ring_create(const char *name)
+{
+    // The server FIFO was just created, so no other server owns the segment
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, sizeof(shm_layout_t)) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    shm_layout_t *ring = mmap(NULL, sizeof(shm_layout_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return -1;
+    }
+
+    // ftruncate() zeroed the segment: only the sequences need a value
+    for (uint32_t i = 0; i < SHM_SQ_SLOTS; i++)
+        ring->sq[i].seq = i;
+    for (int c = 0; c < SHM_CLIENTS; c++)
+    {
+        for (uint32_t i = 0; i < SHM_CQ_SLOTS; i++)
+            ring->clients[c].cq[i].seq = i;
+    }
+    ring->server_pid = getpid();
+    ring->running = 1;
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    strncpy(server_name, name, sizeof(server_name) - 1);
+    server_ring = ring;
+    return 0;
+}
+
+int shm_ring_receive(shm_request_t *req)
+{
+    shm_layout_t *ring = server_ring;
+    for (;;)
+    {
+        if (!__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE))
+            return -1;
+
+        uint32_t *seq = ring_peek(&ring->sq_tail, ring->sq, sizeof(sq_slot_t), SHM_SQ_SLOTS - 1);
+        if (!seq)
+        {
+            // Sleep until a client publishes a request
+            uint32_t seen = event_prepare(&ring->sq_event);
+            if (!ring_peek(&ring->sq_tail, ring->sq, sizeof(sq_slot_t), SHM_SQ_SLOTS - 1) &&
+                __atomic_load_n(&ring->running, __ATOMIC_ACQUIRE))
+                event_wait(&ring->sq_event, seen, NULL);
+            continue;
+        }
+
+        sq_slot_t *slot = (sq_slot_t *)seq;
+        size_t path_len = slot->path_len < PATH_MAX ? slot->path_len : PATH_MAX - 1;
+        req->pid = slot->pid;
+        req->slot = slot->slot;
+        req->gen = slot->gen;
+        req->id = slot->id;
+        req->flags = slot->flags;
+        memcpy(req->path, slot->path, path_len);
+        req->path[path_len] = '\0';
+        ring_release(&ring->sq_tail, seq, SHM_SQ_SLOTS - 1);
+        event_signal(&ring->sq_space);
+
+        __atomic_add_fetch(&counters.requests, 1, __ATOMIC_RELAXED);
+        if (req->slot >= SHM_CLIENTS)
+            continue; // corrupted by a client: nobody to answer
+        return 0;
+    }
+}
+
+int shm_ring_complete(unsigned int slot, uint32_t gen, uint32_t id, short errCode, const uint8_t *sha256)
+{
+    client_slot_t *client = &server_ring->clients[slot];
+
+    // The client left: its slot may already belong to another client
+    uint32_t pos;
+    uint32_t *seq = NULL;
+    if (__atomic_load_n(&client->gen, __ATOMIC_ACQUIRE) == gen)
+        seq = ring_claim(&client->cq_head, client->cq, sizeof(cq_slot_t), SHM_CQ_SLOTS - 1, &pos);
+    if (!seq)
+    {
+        __atomic_add_fetch(&counters.dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    cq_slot_t *completion = (cq_slot_t *)seq;
+    completion->gen = gen;
+    completion->id = id;
+    completion->errCode = errCode;
+    if (sha256)
+        memcpy(completion->sha256, sha256, sizeof(completion->sha256));
+    else
+        memset(completion->sha256, 0, sizeof(completion->sha256));
+    ring_publish(seq, pos);
+    event_signal(&client->cq_event);
+
+    __atomic_add_fetch(&counters.completed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void shm_ring_stop(void)
+{
+    if (!server_ring)
+        return;
+    __atomic_store_n(&server_ring->running, 0, __ATOMIC_RELEASE);
+    event_signal(&server_ring->sq_event);
+    event_signal(&server_ring->sq_space);
+    for (int c = 0; c < SHM_CLIENTS; c++)
+        event_signal(&server_ring->clients[c].cq_event);
+}
+
+void shm_ring_destroy(void)
+{
+    if (!server_ring)
+        return;
+    munmap(server_ring, sizeof(shm_layout_t));
+    server_ring = NULL;
+    shm_unlink(server_name);
+}
+
+void shm_ring_get_stats(shm_ring_stats_t *stats)
+{
+    // Every attach starts a new generation of its slot
+    stats->attached = 0;
+    for (int c = 0; server_ring && c < SHM_CLIENTS; c++)
+        stats->attached += __atomic_load_n(&server_ring->clients[c].gen, __ATOMIC_RELAXED);
+    stats->requests = __atomic_load_n(&counters.requests, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&counters.completed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&counters.dropped, __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------- client side ---------------------------------- */
+
+// The server may die without clearing running: check its PID as well
+static int server_alive(shm_layout_t *ring)
+{
+    if (!__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE))
+        return 0;
+    return kill(ring->server_pid, 0) == 0 || errno == EPERM;
+}
+
+// Claims a free client slot, or the slot of a client that exited without detaching
+static int claim_slot(shm_layout_t *ring, pid_t pid)
+{
+    for (int c = 0; c < SHM_CLIENTS; c++)
+    {
+        int32_t owner = 0;
+        if (__atomic_compare_exchange_n(&ring->clients[c].owner, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return c;
+    }
+    for (int c = 0; c < SHM_CLIENTS; c++)
+    {
+        int32_t owner = __atomic_load_n(&ring->clients[c].owner, __ATOMIC_RELAXED);
+        if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+            __atomic_compare_exchange_n(&ring->clients[c].owner, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return c;
+    }
+    return -1;
+}
+
+shm_ring_client_t *shm_ring_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(shm_layout_t))
+    {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    shm_layout_t *ring = mmap(NULL, sizeof(shm_layout_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    int slot = -1;
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || !server_alive(ring))
+        errno = ECONNREFUSED;
+    else if ((slot = claim_slot(ring, getpid())) == -1)
+        errno = EBUSY;
+    shm_ring_client_t *client = slot == -1 ? NULL : malloc(sizeof(shm_ring_client_t));
+    if (!client)
+    {
+        if (slot != -1)
+            __atomic_store_n(&ring->clients[slot].owner, 0, __ATOMIC_RELEASE);
+        munmap(ring, sizeof(shm_layout_t));
+        return NULL;
+    }
+
+    // A new generation: completions still addressed to the previous owner are skipped
+    client->ring = ring;
+    client->slot = slot;
+    client->gen = __atomic_add_fetch(&ring->clients[slot].gen, 1, __ATOMIC_ACQ_REL);
+    return client;
+}
+
+int shm_ring_submit(shm_ring_client_t *client, uint32_t id, uint32_t flags, const char *path)
+{
+    shm_layout_t *ring = client->ring;
+    size_t path_len = strlen(path);
+    if (path_len >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    uint32_t pos;
+    uint32_t *seq;
+    while (!(seq = ring_claim(&ring->sq_head, ring->sq, sizeof(sq_slot_t), SHM_SQ_SLOTS - 1, &pos)))
+    {
+        // Full: sleep until the server consumes a request, checking that it is still there
+        struct timespec timeout = {.tv_sec = 1};
+        uint32_t seen = event_prepare(&ring->sq_space);
+        if (!server_alive(ring))
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        uint32_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_RELAXED);
+        uint32_t *next = (uint32_t *)&ring->sq[head & (SHM_SQ_SLOTS - 1)].seq;
+        if ((int32_t)(__atomic_load_n(next, __ATOMIC_ACQUIRE) - head) < 0)
+            event_wait(&ring->sq_space, seen, &timeout);
+    }
+
+    sq_slot_t *slot = (sq_slot_t *)seq;
+    slot->slot = client->slot;
+    slot->path_len = path_len;
+    slot->pid = getpid();
+    slot->gen = client->gen;
+    slot->id = id;
+    slot->flags = flags;
+    memcpy(slot->path, path, path_len);
+    ring_publish(seq, pos);
+    event_signal(&ring->sq_event);
+    return 0;
+}
+
+int shm_ring_wait(shm_ring_client_t *client, shm_completion_t *completion)
+{
+    client_slot_t *slot = &client->ring->clients[client->slot];
+    for (;;)
+    {
+        uint32_t *seq = ring_peek(&slot->cq_tail, slot->cq, sizeof(cq_slot_t), SHM_CQ_SLOTS - 1);
+        if (!seq)
+        {
+            struct timespec timeout = {.tv_sec = 1};
+            uint32_t seen = event_prepare(&slot->cq_event);
+            if (ring_peek(&slot->cq_tail, slot->cq, sizeof(cq_slot_t), SHM_CQ_SLOTS - 1))
+                continue;
+            if (!server_alive(client->ring))
+            {
+                errno = ECONNRESET;
+                return -1;
+            }
+            event_wait(&slot->cq_event, seen, &timeout);
+            continue;
+        }
+
+        cq_slot_t *cq = (cq_slot_t *)seq;
+        int mine = cq->gen == client->gen;
+        if (mine)
+        {
+            completion->id = cq->id;
+            completion->errCode = cq->errCode;
+            memcpy(completion->sha256, cq->sha256, sizeof(completion->sha256));
+        }
+        ring_release(&slot->cq_tail, seq, SHM_CQ_SLOTS - 1);
+        if (mine)
+            return 0;
+    }
+}
+
+void shm_ring_detach(shm_ring_client_t *client)
+{
+    __atomic_store_n(&client->ring->clients[client->slot].owner, 0, __ATOMIC_RELEASE);
+    munmap(client->ring, sizeof(shm_layout_t));
+    free(client);
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "tree_hash.h"
+#include "digest_engine.h"
+#include "blake3.h"
+#include "read_engine.h"
+#include "request_response.h"
+
+// Read engine sink: updates the digest context
+static int tree_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    sha256_engine->update((digest_ctx_t *)ctx, data, len);
+    return 0;
+}
+
+// Read engine sink: updates the BLAKE3 subtree
+static int blake3_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    blake3_update((blake3_hasher_t *)ctx, data, len);
+    return 0;
+}
+
+size_t tree_hash_chunks(size_t filesize)
+{
+    if (filesize == 0)
+        return 1;
+    return (filesize + TREE_CHUNK_SIZE - 1) / TREE_CHUNK_SIZE;
+}
+
+short tree_hash_leaf(int fd, const char *filename, size_t filesize, size_t index, uint8_t leaf[32])
+{
+    const uint8_t prefix = TREE_LEAF_PREFIX;
+    size_t offset = index * (size_t)TREE_CHUNK_SIZE;
+    size_t len = filesize - offset < TREE_CHUNK_SIZE ? filesize - offset : TREE_CHUNK_SIZE;
+
+    digest_ctx_t ctx;
+    if (sha256_engine->init(&ctx) != 0)
+        return READ_FILE_E;
+    sha256_engine->update(&ctx, &prefix, 1);
+
+    short errCode = read_range(fd, filename, offset, len, tree_sink, &ctx);
+    if (errCode != 0)
+        return errCode;
+
+    sha256_engine->final(&ctx, leaf);
+    return 0;
+}
+
+short tree_hash_blake3_leaf(int fd, const char *filename, size_t filesize, size_t index, uint8_t cv[32])
+{
+    size_t offset = index * (size_t)TREE_CHUNK_SIZE;
+    size_t len = filesize - offset < TREE_CHUNK_SIZE ? filesize - offset : TREE_CHUNK_SIZE;
+
+    blake3_hasher_t h;
+    blake3_init_subtree(&h, offset / BLAKE3_CHUNK_LEN);
+    short errCode = read_range(fd, filename, offset, len, blake3_sink, &h);
+    if (errCode != 0)
+        return errCode;
+
+    blake3_final_cv(&h, cv);
+    return 0;
+}
+
+void tree_hash_root(uint8_t (*leaves)[32], size_t n, uint8_t root[32])
+{
+    const uint8_t prefix = TREE_NODE_PREFIX;
+
+    // Reduce the level in place until one node is left
+    while (n > 1)
+    {
+        size_t parents = 0;
+        for (size_t i = 0; i < n; i += 2)
+        {
+            if (i + 1 == n)
+            {
+                memmove(leaves[parents++], leaves[i], 32); // promoted
+                break;
+            }
+
+            digest_ctx_t ctx;
+            sha256_engine->init(&ctx);
+            sha256_engine->update(&ctx, &prefix, 1);
+            sha256_engine->update(&ctx, leaves[i], 32);
+            sha256_engine->update(&ctx, leaves[i + 1], 32);
+            sha256_engine->final(&ctx, leaves[parents++]);
+        }
+        n = parents;
+    }
+    memcpy(root, leaves[0], 32);
+}
@@ -0,0 +1,144 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+int uring_init(uring_t *ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return -errno;
+    ring->fd = fd;
+
+    // Both rings share one mapping on kernels with IORING_FEAT_SINGLE_MMAP
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_size > ring->sq_size)
+        ring->sq_size = ring->cq_size;
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        ring->sq_ptr = NULL;
+        uring_exit(ring);
+        return -ENOMEM;
+    }
+    if (single)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            uring_exit(ring);
+            return -ENOMEM;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return -ENOMEM;
+    }
+
+    uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+int uring_register_buffers(uring_t *ring, const struct iovec *iov, unsigned int n)
+{
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+        return -errno;
+    return 0;
+}
+
+int uring_prep_read(uring_t *ring, int fd, void *buf, unsigned int len, off_t offset, int buf_index,
+                    uint64_t user_data)
+{
+    unsigned int tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        return -1;
+
+    unsigned int index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    if (buf_index >= 0)
+        sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    // The kernel reads the SQE once it sees the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return 0;
+}
+
+int uring_submit(uring_t *ring, unsigned int wait_nr)
+{
+    for (;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            ring->to_submit -= (unsigned int)ret < ring->to_submit ? (unsigned int)ret : ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+int uring_peek(uring_t *ring, uint64_t *user_data, int *res)
+{
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void uring_exit(uring_t *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
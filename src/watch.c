@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+// Events of a watched directory: files written or moved in, subdirectories created or moved
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#define WATCH_BUF_SIZE (64 * 1024)
+
+static int inotify_fd = -1;
+static char **paths = NULL; // Directory of each watch descriptor, NULL if unused
+static int npaths = 0;
+static watch_stats_t stats;
+
+// Watches one directory; a directory already watched (moved within a tree) keeps its descriptor
+static int add_watch(const char *path)
+{
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd < 0)
+        return -1;
+    if (wd >= npaths)
+    {
+        int n = npaths ? npaths : 64;
+        while (n <= wd)
+            n *= 2;
+        char **grown = realloc(paths, n * sizeof(char *));
+        if (!grown)
+        {
+            inotify_rm_watch(inotify_fd, wd);
+            return -1;
+        }
+        memset(grown + npaths, 0, (n - npaths) * sizeof(char *));
+        paths = grown;
+        npaths = n;
+    }
+
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        inotify_rm_watch(inotify_fd, wd);
+        return -1;
+    }
+    if (paths[wd])
+        free(paths[wd]);
+    else
+        stats.dirs++;
+    paths[wd] = copy;
+    return 0;
+}
+
+// Forgets a watch removed by the kernel (directory deleted) or by remove_tree
+static void forget(int wd)
+{
+    if (wd < 0 || wd >= npaths || !paths[wd])
+        return;
+    free(paths[wd]);
+    paths[wd] = NULL;
+    stats.dirs--;
+}
+
+// Watches path and its subdirectories; with fn set, also reports the files already there
+static int add_tree(const char *path, watch_fn fn, void *arg)
+{
+    if (add_watch(path) != 0)
+        return -1;
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0; // removed meanwhile
+    char child[PATH_MAX];
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL)
+    {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, d->d_name) >= (int)sizeof(child))
+            continue;
+
+        // Some file systems do not fill d_type
+        unsigned char type = d->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat(child, &st) != 0)
+                continue;
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+            add_tree(child, fn, arg);
+        else if (type == DT_REG && fn)
+        {
+            stats.events++;
+            fn(child, arg);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Removes the watches of a directory moved out of its place and of its subdirectories
+// (a move within the trees adds them back under the new path)
+static void remove_tree(const char *path)
+{
+    size_t len = strlen(path);
+    for (int wd = 0; wd < npaths; wd++)
+    {
+        if (paths[wd] && strncmp(paths[wd], path, len) == 0 && (paths[wd][len] == '\0' || paths[wd][len] == '/'))
+        {
+            inotify_rm_watch(inotify_fd, wd);
+            forget(wd);
+        }
+    }
+}
+
+int watch_init(void)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return inotify_fd < 0 ? -1 : 0;
+}
+
+int watch_add_tree(const char *root)
+{
+    if (inotify_fd < 0)
+        return -1;
+    return add_tree(root, NULL, NULL);
+}
+
+int watch_wait(int timeout_ms, watch_fn fn, void *arg)
+{
+    static uint8_t buf[WATCH_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+
+    for (;;)
+    {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n <= 0)
+            return n == 0 || errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+        for (ssize_t off = 0; off < n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)(buf + off);
+            off += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                stats.overflows++;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED)
+            {
+                forget(ev->wd);
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= npaths || !paths[ev->wd] || ev->len == 0)
+                continue;
+
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", paths[ev->wd], ev->name) >= (int)sizeof(path))
+                continue;
+            if (ev->mask & IN_ISDIR)
+            {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    add_tree(path, fn, arg);
+                else if (ev->mask & IN_MOVED_FROM)
+                    remove_tree(path);
+            }
+            else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                stats.events++;
+                fn(path, arg);
+            }
+        }
+    }
+}
+
+void watch_get_stats(watch_stats_t *out) { *out = stats; }
+
+void watch_close(void)
+{
+    if (inotify_fd != -1)
+        close(inotify_fd); // removes every watch
+    inotify_fd = -1;
+    for (int wd = 0; wd < npaths; wd++)
+        free(paths[wd]);
+    free(paths);
+    paths = NULL;
+    npaths = 0;
+}
@@ -0,0 +1,83 @@
+// Client of the original protocol, before the request flags: the v1 structs are copied here
+// and never follow include/request_response.h, so the server is checked against the clients
+// that were built with them
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#define V1_PATH_MAX 4096
+
+// Structure representing a request sent from client to server (frozen v1 layout)
+struct Request
+{
+    pid_t cPid;                 // PID of the client sending the request
+    char pathname[V1_PATH_MAX]; // Pathname of the file
+};
+
+// Structure representing a response sent from server to client (frozen v1 layout)
+struct Response
+{
+    short errCode; // Error code indicating success or failure
+    char hash[65]; // SHA-256 hash string (64 hex digits + null terminator)
+};
+
+// FIFO paths for handling SHA256 requests
+char *path2ServerFIFO = "/tmp/fifo_server_SHA256";
+char *baseClientFIFO = "/tmp/fifo_client_SHA256."; // completed with the process ID
+
+// Sends one request and prints "<hash>  <pathname>", or the error code
+int main(int argc, char *argv[])
+{
+    if (argc != 2 || strlen(argv[1]) >= V1_PATH_MAX)
+    {
+        printf("Usage: %s <pathname>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path2ClientFIFO[V1_PATH_MAX];
+    sprintf(path2ClientFIFO, "%s%d", baseClientFIFO, getpid());
+    if (mkfifo(path2ClientFIFO, S_IRUSR | S_IWUSR | S_IWGRP) == -1)
+    {
+        perror("<Client> mkfifo");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    int serverFIFO = open(path2ServerFIFO, O_WRONLY);
+    if (serverFIFO == -1)
+        perror("<Client> open server FIFO");
+    else
+    {
+        // Prepare the request exactly as the original client did
+        struct Request request;
+        request.cPid = getpid();
+        strncpy(request.pathname, argv[1], sizeof(request.pathname) - 1);
+        request.pathname[sizeof(request.pathname) - 1] = '\0';
+
+        struct Response response;
+        int clientFIFO = -1;
+        if (write(serverFIFO, &request, sizeof(request)) != sizeof(struct Request))
+            perror("<Client> write");
+        else if ((clientFIFO = open(path2ClientFIFO, O_RDONLY)) == -1)
+            perror("<Client> open client FIFO");
+        else if (read(clientFIFO, &response, sizeof(struct Response)) != sizeof(struct Response))
+            perror("<Client> read");
+        else if (response.errCode != 0)
+            printf("error %d  %s\n", response.errCode, request.pathname);
+        else
+        {
+            printf("%s  %s\n", response.hash, request.pathname);
+            status = 0;
+        }
+        if (clientFIFO != -1)
+            close(clientFIFO);
+        close(serverFIFO);
+    }
+
+    unlink(path2ClientFIFO);
+    return status;
+}
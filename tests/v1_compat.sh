@@ -0,0 +1,76 @@
+#!/bin/sh
+# Serves clients of every protocol, including the original v1 client, and garbage on the
+# server FIFO, with a server of this tree. Usage: v1_compat.sh <build directory>
+BUILD=$1
+FIFO=/tmp/fifo_server_SHA256
+status=0
+
+fail()
+{
+    echo "FAIL: $*"
+    status=1
+}
+
+# Digest printed by the client of this tree, whatever the protocol
+digest()
+{
+    timeout 10 stdbuf -o0 "$BUILD/client" "$@" 2>&1 | sed -n 's/^-->  \([0-9a-f]*\)  <--$/\1/p'
+}
+
+if [ -e "$FIFO" ]; then
+    echo "SKIP: $FIFO exists, a server is already running"
+    exit 0
+fi
+WORK=$(mktemp -d)
+LOG=$WORK/server.log
+
+head -c 100 /dev/urandom > "$WORK/small"
+head -c 3000000 /dev/urandom > "$WORK/large"
+printf 'abc' > "$WORK/abc"
+
+stdbuf -oL "$BUILD/server" -T 2 > "$LOG" 2>&1 &
+server=$!
+i=0
+while [ ! -p "$FIFO" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+[ -p "$FIFO" ] || fail "the server did not create $FIFO"
+
+for f in "$WORK/small" "$WORK/large" "$WORK/abc"; do
+    expected=$(sha256sum "$f" | cut -d' ' -f1)
+
+    # The original client: struct Request without flags
+    got=$(timeout 10 "$BUILD/v1_client" "$f" | cut -d' ' -f1)
+    [ "$got" = "$expected" ] || fail "v1 client: $f: got '$got'"
+
+    # This client: v1 without flags, v1.1 with them, v2
+    got=$(digest -1 "$f")
+    [ "$got" = "$expected" ] || fail "client -1: $f: got '$got'"
+    got=$(digest "$f")
+    [ "$got" = "$expected" ] || fail "client: $f: got '$got'"
+    [ "$(digest -1 -t "$f")" = "$(digest -t "$f")" ] || fail "client -1 -t: $f: v1.1 and v2 disagree"
+done
+
+# Garbage, then requests: the server skips it and serves them
+expected=$(sha256sum "$WORK/abc" | cut -d' ' -f1)
+printf 'not a request\n' > "$FIFO"
+got=$(timeout 10 "$BUILD/v1_client" "$WORK/abc" | cut -d' ' -f1)
+[ "$got" = "$expected" ] || fail "v1 client after garbage: got '$got'"
+printf '\377\377\377\377garbage' > "$FIFO"
+got=$(digest "$WORK/abc")
+[ "$got" = "$expected" ] || fail "v2 client after garbage: got '$got'"
+
+# The beginning of a v1 request (PID 1, "/x" and zeros), cut by a v2 message
+printf '\001\000\000\000/x\000\000\000\000' > "$FIFO"
+got=$(digest "$WORK/abc")
+[ "$got" = "$expected" ] || fail "v2 client after a cut v1 request: got '$got'"
+
+kill -INT $server
+wait $server
+rm -f "$FIFO"
+if [ $status -ne 0 ]; then
+    cat "$LOG"
+fi
+rm -r "${WORK:?}"
+exit $status